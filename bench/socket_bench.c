@@ -0,0 +1,568 @@
+/*
+ * socket_bench.c
+ *
+ * Loopback throughput, latency and connect rate benchmark for socket.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "libimobiledevice-glue/socket.h"
+#include "libimobiledevice-glue/thread.h"
+
+enum transport {
+	TRANSPORT_TCP,
+	TRANSPORT_UNIX
+};
+
+static const char *transport_names[] = { "tcp", "unix" };
+
+struct profile {
+	const char *name;
+	enum socket_options_profile profile;
+};
+
+static const struct profile profiles[] = {
+	{ "system", SOCKET_OPTIONS_PROFILE_SYSTEM },
+	{ "default", SOCKET_OPTIONS_PROFILE_DEFAULT },
+	{ "latency", SOCKET_OPTIONS_PROFILE_LATENCY },
+	{ "bulk", SOCKET_OPTIONS_PROFILE_BULK },
+};
+
+static const size_t message_sizes[] = {
+	64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304
+};
+
+static unsigned int duration_ms = 500;
+static unsigned int latency_iterations = 20000;
+static unsigned int connect_iterations = 2000;
+static size_t latency_size = 64;
+static int json_output = 0;
+static const char *filter = NULL;
+#ifndef _WIN32
+static char unix_path[256];
+#endif
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static int selected(const char *bench, enum transport transport)
+{
+	int any_bench;
+	int any_transport;
+	if (!filter) {
+		return 1;
+	}
+	any_bench = !strstr(filter, "throughput") && !strstr(filter, "latency") && !strstr(filter, "connect") && !strstr(filter, "profiles");
+	any_transport = !strstr(filter, "tcp") && !strstr(filter, "unix");
+	return (any_bench || strstr(filter, bench)) && (any_transport || strstr(filter, transport_names[transport]));
+}
+
+/* --- connection setup --- */
+
+struct endpoint {
+	enum transport transport;
+	int listen_fd;
+	uint16_t port;
+	const struct socket_options *opts;
+};
+
+static int endpoint_listen(struct endpoint *ep, enum transport transport, const struct socket_options *opts)
+{
+	ep->transport = transport;
+	ep->opts = opts;
+	ep->port = 0;
+	if (transport == TRANSPORT_TCP) {
+		ep->listen_fd = socket_create_ex("127.0.0.1", 0, 1024, opts);
+		if (ep->listen_fd < 0 || socket_get_socket_port(ep->listen_fd, &ep->port) < 0) {
+			return -1;
+		}
+	} else {
+#ifdef _WIN32
+		return -1;
+#else
+		ep->listen_fd = socket_create_unix(unix_path);
+#endif
+	}
+	return (ep->listen_fd < 0) ? -1 : 0;
+}
+
+static void endpoint_close(struct endpoint *ep)
+{
+	if (ep->listen_fd >= 0) {
+		socket_close(ep->listen_fd);
+		ep->listen_fd = -1;
+	}
+#ifndef _WIN32
+	if (ep->transport == TRANSPORT_UNIX) {
+		unlink(unix_path);
+	}
+#endif
+}
+
+static int endpoint_connect(struct endpoint *ep)
+{
+	if (ep->transport == TRANSPORT_TCP) {
+		if (ep->opts) {
+			return socket_connect_with_options("127.0.0.1", ep->port, 0, ep->opts);
+		}
+		return socket_connect("127.0.0.1", ep->port);
+	}
+#ifdef _WIN32
+	return -1;
+#else
+	return socket_connect_unix(unix_path);
+#endif
+}
+
+static int send_fully(int fd, char *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		int res = socket_send(fd, data + done, length - done);
+		if (res <= 0) {
+			return (res < 0) ? res : -EIO;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static int receive_fully(int fd, char *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		int res = socket_receive(fd, data + done, length - done);
+		if (res <= 0) {
+			return (res < 0) ? res : -EIO;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+/* --- throughput --- */
+
+struct sink_ctx {
+	struct endpoint *ep;
+	size_t size;
+	uint64_t bytes;
+	uint64_t first_ns;
+	uint64_t last_ns;
+};
+
+static void* throughput_sink(void *data)
+{
+	struct sink_ctx *ctx = (struct sink_ctx*)data;
+	int fd = socket_accept(ctx->ep->listen_fd, ctx->ep->port);
+	if (fd < 0) {
+		return NULL;
+	}
+	char *buf = malloc(ctx->size);
+	while (buf) {
+		int res = socket_receive(fd, buf, ctx->size);
+		if (res <= 0) {
+			break;
+		}
+		if (ctx->bytes == 0) {
+			ctx->first_ns = now_ns();
+		}
+		ctx->bytes += res;
+	}
+	ctx->last_ns = now_ns();
+	free(buf);
+	socket_close(fd);
+	return NULL;
+}
+
+static void report_throughput(enum transport transport, const char *profile, size_t size, uint64_t bytes, uint64_t messages, double seconds)
+{
+	double mib_s = (seconds > 0) ? (double)bytes / seconds / (1024.0 * 1024.0) : 0;
+	double msg_s = (seconds > 0) ? (double)messages / seconds : 0;
+	if (json_output) {
+		printf("{\"bench\":\"throughput\",\"transport\":\"%s\",\"profile\":\"%s\",\"size\":%zu,\"bytes\":%llu,\"messages\":%llu,\"seconds\":%.6f,\"mib_per_sec\":%.2f,\"messages_per_sec\":%.0f}\n",
+			transport_names[transport], profile, size, (unsigned long long)bytes, (unsigned long long)messages, seconds, mib_s, msg_s);
+	} else {
+		printf("throughput  %-5s %-8s %8zu B  %10.2f MiB/s  %12.0f msg/s\n", transport_names[transport], profile, size, mib_s, msg_s);
+	}
+	fflush(stdout);
+}
+
+static int bench_throughput(enum transport transport, const char *profile, const struct socket_options *opts, size_t size)
+{
+	struct endpoint ep;
+	struct sink_ctx ctx;
+	THREAD_T th;
+	uint64_t messages = 0;
+
+	if (endpoint_listen(&ep, transport, opts) < 0) {
+		fprintf(stderr, "ERROR: could not create %s listener\n", transport_names[transport]);
+		return -1;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.ep = &ep;
+	ctx.size = size;
+	if (thread_new(&th, throughput_sink, &ctx) != 0) {
+		endpoint_close(&ep);
+		return -1;
+	}
+	int fd = endpoint_connect(&ep);
+	char *buf = calloc(1, size);
+	if (fd >= 0 && buf) {
+		uint64_t end = now_ns() + (uint64_t)duration_ms * 1000000ULL;
+		do {
+			if (send_fully(fd, buf, size) < 0) {
+				break;
+			}
+			messages++;
+		} while (now_ns() < end);
+		socket_shutdown(fd, SHUT_WR);
+	}
+	thread_join(th);
+	thread_free(th);
+	free(buf);
+	if (fd >= 0) {
+		socket_close(fd);
+	}
+	endpoint_close(&ep);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: could not connect to %s listener\n", transport_names[transport]);
+		return -1;
+	}
+	report_throughput(transport, profile, size, ctx.bytes, messages, (double)(ctx.last_ns - ctx.first_ns) / 1e9);
+	return 0;
+}
+
+/* --- request/response latency --- */
+
+struct echo_ctx {
+	struct endpoint *ep;
+	size_t size;
+};
+
+static void* latency_echo(void *data)
+{
+	struct echo_ctx *ctx = (struct echo_ctx*)data;
+	int fd = socket_accept(ctx->ep->listen_fd, ctx->ep->port);
+	if (fd < 0) {
+		return NULL;
+	}
+	char *buf = malloc(ctx->size);
+	while (buf) {
+		if (receive_fully(fd, buf, ctx->size) < 0 || send_fully(fd, buf, ctx->size) < 0) {
+			break;
+		}
+	}
+	free(buf);
+	socket_close(fd);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned int count, double p)
+{
+	unsigned int idx = (unsigned int)(p / 100.0 * (count - 1) + 0.5);
+	return (double)sorted[idx] / 1000.0;
+}
+
+static int bench_latency(enum transport transport, const char *profile, const struct socket_options *opts, size_t size)
+{
+	struct endpoint ep;
+	struct echo_ctx ctx;
+	THREAD_T th;
+	unsigned int i;
+	unsigned int done = 0;
+
+	if (endpoint_listen(&ep, transport, opts) < 0) {
+		fprintf(stderr, "ERROR: could not create %s listener\n", transport_names[transport]);
+		return -1;
+	}
+	ctx.ep = &ep;
+	ctx.size = size;
+	if (thread_new(&th, latency_echo, &ctx) != 0) {
+		endpoint_close(&ep);
+		return -1;
+	}
+	int fd = endpoint_connect(&ep);
+	char *buf = calloc(1, size);
+	uint64_t *samples = calloc(latency_iterations, sizeof(uint64_t));
+	if (fd >= 0 && buf && samples) {
+		for (i = 0; i < latency_iterations; i++) {
+			uint64_t start = now_ns();
+			if (send_fully(fd, buf, size) < 0 || receive_fully(fd, buf, size) < 0) {
+				break;
+			}
+			samples[done++] = now_ns() - start;
+		}
+		socket_shutdown(fd, SHUT_RDWR);
+	}
+	thread_join(th);
+	thread_free(th);
+	free(buf);
+	if (fd >= 0) {
+		socket_close(fd);
+	}
+	endpoint_close(&ep);
+	if (done == 0) {
+		fprintf(stderr, "ERROR: %s latency benchmark failed\n", transport_names[transport]);
+		free(samples);
+		return -1;
+	}
+
+	uint64_t sum = 0;
+	for (i = 0; i < done; i++) {
+		sum += samples[i];
+	}
+	qsort(samples, done, sizeof(uint64_t), cmp_u64);
+	double mean = (double)sum / done / 1000.0;
+	double p50 = percentile_us(samples, done, 50.0);
+	double p99 = percentile_us(samples, done, 99.0);
+	double p999 = percentile_us(samples, done, 99.9);
+	double max = (double)samples[done - 1] / 1000.0;
+	if (json_output) {
+		printf("{\"bench\":\"latency\",\"transport\":\"%s\",\"profile\":\"%s\",\"size\":%zu,\"iterations\":%u,\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+			transport_names[transport], profile, size, done, mean, p50, p99, p999, max);
+	} else {
+		printf("latency     %-5s %-8s %8zu B  p50 %8.2f us  p99 %8.2f us  p999 %8.2f us\n", transport_names[transport], profile, size, p50, p99, p999);
+	}
+	fflush(stdout);
+	free(samples);
+	return 0;
+}
+
+/* --- connect/accept rate --- */
+
+struct accept_ctx {
+	struct endpoint *ep;
+	volatile unsigned int count;
+	volatile unsigned int accepted;
+};
+
+static void* connect_acceptor(void *data)
+{
+	struct accept_ctx *ctx = (struct accept_ctx*)data;
+	while (ctx->accepted < ctx->count) {
+		int fd = socket_accept(ctx->ep->listen_fd, ctx->ep->port);
+		if (fd < 0) {
+			break;
+		}
+		socket_close(fd);
+		ctx->accepted++;
+	}
+	return NULL;
+}
+
+static int bench_connect(enum transport transport)
+{
+	struct endpoint ep;
+	struct accept_ctx ctx;
+	THREAD_T th;
+	unsigned int i;
+	unsigned int connected = 0;
+
+	if (endpoint_listen(&ep, transport, NULL) < 0) {
+		fprintf(stderr, "ERROR: could not create %s listener\n", transport_names[transport]);
+		return -1;
+	}
+	ctx.ep = &ep;
+	ctx.count = connect_iterations;
+	ctx.accepted = 0;
+	if (thread_new(&th, connect_acceptor, &ctx) != 0) {
+		endpoint_close(&ep);
+		return -1;
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < connect_iterations; i++) {
+		int fd = endpoint_connect(&ep);
+		if (fd < 0 && errno == EAGAIN) {
+			/* non-blocking unix connect fails while the backlog is full */
+			while (ctx.accepted < connected) {
+#ifdef _WIN32
+				Sleep(0);
+#else
+				usleep(10);
+#endif
+			}
+			fd = endpoint_connect(&ep);
+		}
+		if (fd < 0) {
+			break;
+		}
+		socket_close(fd);
+		connected++;
+	}
+	if (connected < connect_iterations) {
+		/* unblock the acceptor */
+		ctx.count = ctx.accepted + 1;
+		int fd = endpoint_connect(&ep);
+		if (fd >= 0) {
+			socket_close(fd);
+		}
+	}
+	thread_join(th);
+	double seconds = (double)(now_ns() - start) / 1e9;
+	thread_free(th);
+	endpoint_close(&ep);
+
+	double rate = (seconds > 0) ? (double)connected / seconds : 0;
+	if (json_output) {
+		printf("{\"bench\":\"connect\",\"transport\":\"%s\",\"connections\":%u,\"seconds\":%.6f,\"connections_per_sec\":%.0f}\n",
+			transport_names[transport], connected, seconds, rate);
+	} else {
+		printf("connect     %-5s %-8s %10u conn  %12.0f conn/s\n", transport_names[transport], "-", connected, rate);
+	}
+	fflush(stdout);
+	return (connected == connect_iterations) ? 0 : -1;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [OPTIONS]\n", argv0);
+	printf("\n");
+	printf("Benchmark socket throughput, latency and connect rate over loopback.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -j, --json             print one JSON object per result\n");
+	printf("  -d, --duration MS      duration of each throughput run (default %u)\n", duration_ms);
+	printf("  -n, --iterations N     round trips per latency run (default %u)\n", latency_iterations);
+	printf("  -c, --connections N    connections per connect run (default %u)\n", connect_iterations);
+	printf("  -s, --size BYTES       latency message size (default %zu)\n", latency_size);
+	printf("  -f, --filter LIST      only run the benchmarks (throughput, latency, connect,\n");
+	printf("                         profiles) and transports (tcp, unix) in LIST,\n");
+	printf("                         e.g. \"latency,unix\"\n");
+	printf("  -h, --help             print this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+	int c;
+	unsigned int i;
+	int t;
+	static struct option longopts[] = {
+		{ "json", no_argument, NULL, 'j' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "size", required_argument, NULL, 's' },
+		{ "filter", required_argument, NULL, 'f' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "jd:n:c:s:f:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			json_output = 1;
+			break;
+		case 'd':
+			duration_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			latency_iterations = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			connect_iterations = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			latency_size = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+	}
+	if (duration_ms == 0 || latency_iterations == 0 || connect_iterations == 0 || latency_size == 0) {
+		fprintf(stderr, "ERROR: numeric options must be greater than 0\n");
+		return 2;
+	}
+#ifndef _WIN32
+	snprintf(unix_path, sizeof(unix_path), "/tmp/limd-glue-bench-%d.sock", (int)getpid());
+#endif
+
+	for (t = TRANSPORT_TCP; t <= TRANSPORT_UNIX; t++) {
+#ifdef _WIN32
+		if (t == TRANSPORT_UNIX) {
+			continue;
+		}
+#endif
+		if (selected("throughput", t)) {
+			for (i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]); i++) {
+				failed |= bench_throughput(t, "default", NULL, message_sizes[i]);
+			}
+		}
+		if (selected("latency", t)) {
+			failed |= bench_latency(t, "default", NULL, latency_size);
+		}
+		if (selected("connect", t)) {
+			failed |= bench_connect(t);
+		}
+	}
+
+	/* effect of the socket_options profiles on TCP loopback */
+	if (selected("profiles", TRANSPORT_TCP)) {
+		for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+			struct socket_options opts;
+			socket_options_init(&opts, profiles[i].profile);
+			failed |= bench_throughput(TRANSPORT_TCP, profiles[i].name, &opts, 65536);
+			failed |= bench_throughput(TRANSPORT_TCP, profiles[i].name, &opts, 1048576);
+			failed |= bench_latency(TRANSPORT_TCP, profiles[i].name, &opts, latency_size);
+		}
+	}
+
+	return (failed) ? 1 : 0;
+}
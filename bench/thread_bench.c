@@ -0,0 +1,693 @@
+/*
+ * thread_bench.c
+ *
+ * Benchmark for the thread primitives against mutex/cond baselines
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "libimobiledevice-glue/thread.h"
+
+#define MAX_PRODUCERS 16
+
+static unsigned int num_messages = 1000000;
+static unsigned int ring_capacity = 1024;
+static unsigned int lock_iterations = 1000000;
+static int json_output = 0;
+static const char *filter = NULL;
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static int selected(const char *bench)
+{
+	return !filter || strstr(filter, bench) != NULL;
+}
+
+static void report(const char *bench, const char *impl, unsigned int threads, uint64_t messages, uint64_t elapsed_ns)
+{
+	double seconds = (double)elapsed_ns / 1e9;
+	double rate = (seconds > 0) ? (double)messages / seconds : 0;
+	if (json_output) {
+		printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"threads\":%u,\"messages\":%llu,\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"ns_per_message\":%.1f}\n",
+			bench, impl, threads, (unsigned long long)messages, seconds, rate, (messages > 0) ? (double)elapsed_ns / messages : 0);
+	} else {
+		printf("%-6s %-10s %2u thr  %12.0f msg/s  %8.1f ns/msg\n", bench, impl, threads, rate, (messages > 0) ? (double)elapsed_ns / messages : 0);
+	}
+	fflush(stdout);
+}
+
+/* --- mutex/cond baselines --- */
+
+struct locked_node {
+	struct locked_node *next;
+	void *data;
+};
+
+struct locked_queue {
+	mutex_t lock;
+	cond_t not_empty;
+	cond_t not_full;
+	struct locked_node *head;
+	struct locked_node *tail;
+	/* ring mode */
+	void **slots;
+	unsigned int capacity;
+	unsigned int start;
+	unsigned int count;
+};
+
+static void locked_queue_init(struct locked_queue *q, unsigned int capacity)
+{
+	memset(q, 0, sizeof(*q));
+	mutex_init(&q->lock);
+	cond_init(&q->not_empty);
+	cond_init(&q->not_full);
+	if (capacity > 0) {
+		q->slots = calloc(capacity, sizeof(void*));
+		q->capacity = capacity;
+	}
+}
+
+static void locked_queue_destroy(struct locked_queue *q)
+{
+	cond_destroy(&q->not_full);
+	cond_destroy(&q->not_empty);
+	mutex_destroy(&q->lock);
+	free(q->slots);
+}
+
+static void locked_wait(cond_t *cond, mutex_t *lock)
+{
+	cond_wait(cond, lock);
+#ifdef _WIN32
+	mutex_lock(lock);
+#endif
+}
+
+static void locked_list_push(struct locked_queue *q, void *data)
+{
+	struct locked_node *node = malloc(sizeof(struct locked_node));
+	node->next = NULL;
+	node->data = data;
+	mutex_lock(&q->lock);
+	if (q->tail) {
+		q->tail->next = node;
+	} else {
+		q->head = node;
+	}
+	q->tail = node;
+	cond_signal(&q->not_empty);
+	mutex_unlock(&q->lock);
+}
+
+static void *locked_list_pop(struct locked_queue *q)
+{
+	mutex_lock(&q->lock);
+	while (!q->head) {
+		locked_wait(&q->not_empty, &q->lock);
+	}
+	struct locked_node *node = q->head;
+	q->head = node->next;
+	if (!q->head) {
+		q->tail = NULL;
+	}
+	mutex_unlock(&q->lock);
+	void *data = node->data;
+	free(node);
+	return data;
+}
+
+static void locked_ring_push(struct locked_queue *q, void *data)
+{
+	mutex_lock(&q->lock);
+	while (q->count == q->capacity) {
+		locked_wait(&q->not_full, &q->lock);
+	}
+	q->slots[(q->start + q->count) % q->capacity] = data;
+	q->count++;
+	cond_signal(&q->not_empty);
+	mutex_unlock(&q->lock);
+}
+
+static void *locked_ring_pop(struct locked_queue *q)
+{
+	mutex_lock(&q->lock);
+	while (q->count == 0) {
+		locked_wait(&q->not_empty, &q->lock);
+	}
+	void *data = q->slots[q->start];
+	q->start = (q->start + 1) % q->capacity;
+	q->count--;
+	cond_signal(&q->not_full);
+	mutex_unlock(&q->lock);
+	return data;
+}
+
+/* --- producers --- */
+
+enum impl {
+	IMPL_LOCKED,
+	IMPL_LOCKFREE
+};
+
+struct producer_ctx {
+	enum impl impl;
+	struct locked_queue *locked;
+	thread_mpsc_queue_t mpsc;
+	thread_spsc_ring_t spsc;
+	unsigned int count;
+};
+
+static void* mpsc_producer(void *arg)
+{
+	struct producer_ctx *ctx = (struct producer_ctx*)arg;
+	unsigned int i;
+	for (i = 1; i <= ctx->count; i++) {
+		if (ctx->impl == IMPL_LOCKFREE) {
+			thread_mpsc_queue_push(ctx->mpsc, (void*)(uintptr_t)i);
+		} else {
+			locked_list_push(ctx->locked, (void*)(uintptr_t)i);
+		}
+	}
+	return NULL;
+}
+
+static void* spsc_producer(void *arg)
+{
+	struct producer_ctx *ctx = (struct producer_ctx*)arg;
+	unsigned int i;
+	for (i = 1; i <= ctx->count; i++) {
+		if (ctx->impl == IMPL_LOCKFREE) {
+			thread_spsc_ring_push(ctx->spsc, (void*)(uintptr_t)i, -1);
+		} else {
+			locked_ring_push(ctx->locked, (void*)(uintptr_t)i);
+		}
+	}
+	return NULL;
+}
+
+static int bench_mpsc(enum impl impl, unsigned int producers)
+{
+	struct locked_queue locked;
+	struct producer_ctx ctx[MAX_PRODUCERS];
+	THREAD_T threads[MAX_PRODUCERS];
+	unsigned int i;
+	uint64_t sum = 0;
+	uint64_t expected = 0;
+	uint64_t total = (uint64_t)(num_messages / producers) * producers;
+	thread_mpsc_queue_t mpsc = NULL;
+
+	if (impl == IMPL_LOCKFREE) {
+		mpsc = thread_mpsc_queue_new();
+		if (!mpsc) {
+			return -1;
+		}
+	} else {
+		locked_queue_init(&locked, 0);
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < producers; i++) {
+		ctx[i].impl = impl;
+		ctx[i].locked = &locked;
+		ctx[i].mpsc = mpsc;
+		ctx[i].count = num_messages / producers;
+		expected += (uint64_t)ctx[i].count * (ctx[i].count + 1) / 2;
+		thread_new(&threads[i], mpsc_producer, &ctx[i]);
+	}
+	uint64_t n;
+	for (n = 0; n < total; n++) {
+		void *data = NULL;
+		if (impl == IMPL_LOCKFREE) {
+			thread_mpsc_queue_pop(mpsc, &data, -1);
+		} else {
+			data = locked_list_pop(&locked);
+		}
+		sum += (uintptr_t)data;
+	}
+	uint64_t elapsed = now_ns() - start;
+	for (i = 0; i < producers; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	if (impl == IMPL_LOCKFREE) {
+		thread_mpsc_queue_free(mpsc);
+	} else {
+		locked_queue_destroy(&locked);
+	}
+	if (sum != expected) {
+		fprintf(stderr, "ERROR: mpsc checksum mismatch\n");
+		return -1;
+	}
+	report("mpsc", (impl == IMPL_LOCKFREE) ? "lockfree" : "mutex", producers, total, elapsed);
+	return 0;
+}
+
+static int bench_spsc(enum impl impl)
+{
+	struct locked_queue locked;
+	struct producer_ctx ctx;
+	THREAD_T thread;
+	uint64_t sum = 0;
+	uint64_t n;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.impl = impl;
+	ctx.count = num_messages;
+	if (impl == IMPL_LOCKFREE) {
+		ctx.spsc = thread_spsc_ring_new(ring_capacity);
+		if (!ctx.spsc) {
+			return -1;
+		}
+	} else {
+		locked_queue_init(&locked, ring_capacity);
+		ctx.locked = &locked;
+	}
+	uint64_t start = now_ns();
+	thread_new(&thread, spsc_producer, &ctx);
+	for (n = 0; n < num_messages; n++) {
+		void *data = NULL;
+		if (impl == IMPL_LOCKFREE) {
+			thread_spsc_ring_pop(ctx.spsc, &data, -1);
+		} else {
+			data = locked_ring_pop(&locked);
+		}
+		sum += (uintptr_t)data;
+	}
+	uint64_t elapsed = now_ns() - start;
+	thread_join(thread);
+	thread_free(thread);
+	if (impl == IMPL_LOCKFREE) {
+		thread_spsc_ring_free(ctx.spsc);
+	} else {
+		locked_queue_destroy(&locked);
+	}
+	if (sum != (uint64_t)num_messages * (num_messages + 1) / 2) {
+		fprintf(stderr, "ERROR: spsc checksum mismatch\n");
+		return -1;
+	}
+	report("spsc", (impl == IMPL_LOCKFREE) ? "lockfree" : "mutex", 1, num_messages, elapsed);
+	return 0;
+}
+
+/* --- lock contention: mutex_t vs fast_mutex_t --- */
+
+struct lock_ctx {
+	enum impl impl;
+	mutex_t *mutex;
+	fast_mutex_t *fast;
+	volatile uint64_t *counter;
+	unsigned int count;
+};
+
+static void* lock_worker(void *arg)
+{
+	struct lock_ctx *ctx = (struct lock_ctx*)arg;
+	unsigned int i;
+	for (i = 0; i < ctx->count; i++) {
+		if (ctx->impl == IMPL_LOCKFREE) {
+			fast_mutex_lock(ctx->fast);
+			(*ctx->counter)++;
+			fast_mutex_unlock(ctx->fast);
+		} else {
+			mutex_lock(ctx->mutex);
+			(*ctx->counter)++;
+			mutex_unlock(ctx->mutex);
+		}
+	}
+	return NULL;
+}
+
+static int bench_lock(enum impl impl, unsigned int threads)
+{
+	mutex_t mutex;
+	fast_mutex_t fast;
+	volatile uint64_t counter = 0;
+	struct lock_ctx ctx[MAX_PRODUCERS];
+	THREAD_T th[MAX_PRODUCERS];
+	unsigned int i;
+
+	mutex_init(&mutex);
+	fast_mutex_init(&fast);
+	uint64_t start = now_ns();
+	for (i = 0; i < threads; i++) {
+		ctx[i].impl = impl;
+		ctx[i].mutex = &mutex;
+		ctx[i].fast = &fast;
+		ctx[i].counter = &counter;
+		ctx[i].count = lock_iterations / threads;
+		thread_new(&th[i], lock_worker, &ctx[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		thread_join(th[i]);
+		thread_free(th[i]);
+	}
+	uint64_t elapsed = now_ns() - start;
+	fast_mutex_destroy(&fast);
+	mutex_destroy(&mutex);
+	if (counter != (uint64_t)(lock_iterations / threads) * threads) {
+		fprintf(stderr, "ERROR: lock counter mismatch\n");
+		return -1;
+	}
+	report("lock", (impl == IMPL_LOCKFREE) ? "fast" : "mutex", threads, counter, elapsed);
+	return 0;
+}
+
+/* --- condvar ping-pong: cond_t vs fast_cond_t --- */
+
+struct pingpong_ctx {
+	enum impl impl;
+	mutex_t mutex;
+	cond_t cond;
+	fast_mutex_t fast_mutex;
+	fast_cond_t fast_cond;
+	unsigned int turn;
+	unsigned int rounds;
+};
+
+static void pingpong_run(struct pingpong_ctx *ctx, unsigned int me)
+{
+	unsigned int i;
+	for (i = 0; i < ctx->rounds; i++) {
+		if (ctx->impl == IMPL_LOCKFREE) {
+			fast_mutex_lock(&ctx->fast_mutex);
+			while (ctx->turn != me) {
+				fast_cond_wait(&ctx->fast_cond, &ctx->fast_mutex);
+			}
+			ctx->turn = !me;
+			fast_cond_signal(&ctx->fast_cond);
+			fast_mutex_unlock(&ctx->fast_mutex);
+		} else {
+			mutex_lock(&ctx->mutex);
+			while (ctx->turn != me) {
+				locked_wait(&ctx->cond, &ctx->mutex);
+			}
+			ctx->turn = !me;
+			cond_signal(&ctx->cond);
+			mutex_unlock(&ctx->mutex);
+		}
+	}
+}
+
+static void* pingpong_peer(void *arg)
+{
+	pingpong_run((struct pingpong_ctx*)arg, 1);
+	return NULL;
+}
+
+static int bench_pingpong(enum impl impl)
+{
+	struct pingpong_ctx ctx;
+	THREAD_T th;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.impl = impl;
+	ctx.rounds = lock_iterations / 10;
+	mutex_init(&ctx.mutex);
+	cond_init(&ctx.cond);
+	fast_mutex_init(&ctx.fast_mutex);
+	fast_cond_init(&ctx.fast_cond);
+	uint64_t start = now_ns();
+	thread_new(&th, pingpong_peer, &ctx);
+	pingpong_run(&ctx, 0);
+	thread_join(th);
+	uint64_t elapsed = now_ns() - start;
+	thread_free(th);
+	fast_cond_destroy(&ctx.fast_cond);
+	fast_mutex_destroy(&ctx.fast_mutex);
+	cond_destroy(&ctx.cond);
+	mutex_destroy(&ctx.mutex);
+	report("cond", (impl == IMPL_LOCKFREE) ? "fast" : "mutex", 2, (uint64_t)ctx.rounds * 2, elapsed);
+	return 0;
+}
+
+/* --- read-mostly access: mutex_t vs rwlock_t vs seqlock_t --- */
+
+enum read_impl {
+	READ_MUTEX,
+	READ_RWLOCK,
+	READ_SEQLOCK
+};
+
+static const char *read_impl_names[] = { "mutex", "rwlock", "seqlock" };
+
+struct read_shared {
+	enum read_impl impl;
+	mutex_t mutex;
+	rwlock_t rwlock;
+	seqlock_t seqlock;
+	volatile uint32_t data[4];
+};
+
+struct read_ctx {
+	struct read_shared *shared;
+	unsigned int count;
+	int writer;
+	uint32_t torn;
+};
+
+static void read_update(struct read_shared *sh, uint32_t val)
+{
+	unsigned int i;
+	switch (sh->impl) {
+	case READ_SEQLOCK:
+		seqlock_write_lock(&sh->seqlock);
+		for (i = 0; i < 4; i++) {
+			sh->data[i] = val;
+		}
+		seqlock_write_unlock(&sh->seqlock);
+		break;
+	case READ_RWLOCK:
+		rwlock_write_lock(&sh->rwlock);
+		for (i = 0; i < 4; i++) {
+			sh->data[i] = val;
+		}
+		rwlock_write_unlock(&sh->rwlock);
+		break;
+	default:
+		mutex_lock(&sh->mutex);
+		for (i = 0; i < 4; i++) {
+			sh->data[i] = val;
+		}
+		mutex_unlock(&sh->mutex);
+		break;
+	}
+}
+
+static void read_copy(struct read_shared *sh, uint32_t *out)
+{
+	unsigned int i;
+	unsigned int seq;
+	switch (sh->impl) {
+	case READ_SEQLOCK:
+		do {
+			seq = seqlock_read_begin(&sh->seqlock);
+			for (i = 0; i < 4; i++) {
+				out[i] = sh->data[i];
+			}
+		} while (seqlock_read_retry(&sh->seqlock, seq));
+		break;
+	case READ_RWLOCK:
+		rwlock_read_lock(&sh->rwlock);
+		for (i = 0; i < 4; i++) {
+			out[i] = sh->data[i];
+		}
+		rwlock_read_unlock(&sh->rwlock);
+		break;
+	default:
+		mutex_lock(&sh->mutex);
+		for (i = 0; i < 4; i++) {
+			out[i] = sh->data[i];
+		}
+		mutex_unlock(&sh->mutex);
+		break;
+	}
+}
+
+static void* read_worker(void *arg)
+{
+	struct read_ctx *ctx = (struct read_ctx*)arg;
+	uint32_t copy[4];
+	unsigned int i;
+	for (i = 0; i < ctx->count; i++) {
+		/* one update per 1024 reads keeps the workload read-mostly */
+		if (ctx->writer && (i & 1023) == 0) {
+			read_update(ctx->shared, i);
+		}
+		read_copy(ctx->shared, copy);
+		if (copy[0] != copy[3]) {
+			ctx->torn++;
+		}
+	}
+	return NULL;
+}
+
+static int bench_read(enum read_impl impl, unsigned int threads)
+{
+	struct read_shared shared;
+	struct read_ctx ctx[MAX_PRODUCERS];
+	THREAD_T th[MAX_PRODUCERS];
+	uint32_t torn = 0;
+	unsigned int i;
+
+	memset(&shared, 0, sizeof(shared));
+	shared.impl = impl;
+	mutex_init(&shared.mutex);
+	rwlock_init(&shared.rwlock);
+	seqlock_init(&shared.seqlock);
+	uint64_t start = now_ns();
+	for (i = 0; i < threads; i++) {
+		ctx[i].shared = &shared;
+		ctx[i].count = lock_iterations / threads;
+		ctx[i].writer = (i == 0);
+		ctx[i].torn = 0;
+		thread_new(&th[i], read_worker, &ctx[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		thread_join(th[i]);
+		thread_free(th[i]);
+		torn += ctx[i].torn;
+	}
+	uint64_t elapsed = now_ns() - start;
+	seqlock_destroy(&shared.seqlock);
+	rwlock_destroy(&shared.rwlock);
+	mutex_destroy(&shared.mutex);
+	if (torn) {
+		fprintf(stderr, "ERROR: %u torn reads with %s\n", torn, read_impl_names[impl]);
+		return -1;
+	}
+	report("read", read_impl_names[impl], threads, (uint64_t)(lock_iterations / threads) * threads, elapsed);
+	return 0;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [OPTIONS]\n", argv0);
+	printf("\n");
+	printf("Benchmark the thread primitives against mutex/cond baselines.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -j, --json             print one JSON object per result\n");
+	printf("  -m, --messages N       messages per run (default %u)\n", num_messages);
+	printf("  -r, --ring-size N      ring capacity for the spsc runs (default %u)\n", ring_capacity);
+	printf("  -l, --lock-ops N       lock operations per lock/read run (default %u)\n", lock_iterations);
+	printf("  -f, --filter LIST      only run the benchmarks (mpsc, spsc, lock, cond, read) in LIST\n");
+	printf("  -h, --help             print this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int producer_counts[] = { 1, 2, 4, 8 };
+	int failed = 0;
+	int c;
+	unsigned int i;
+	static struct option longopts[] = {
+		{ "json", no_argument, NULL, 'j' },
+		{ "messages", required_argument, NULL, 'm' },
+		{ "ring-size", required_argument, NULL, 'r' },
+		{ "lock-ops", required_argument, NULL, 'l' },
+		{ "filter", required_argument, NULL, 'f' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "jm:r:l:f:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			json_output = 1;
+			break;
+		case 'm':
+			num_messages = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			ring_capacity = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			lock_iterations = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+	}
+	if (num_messages < MAX_PRODUCERS || lock_iterations < 10 * MAX_PRODUCERS || ring_capacity == 0) {
+		fprintf(stderr, "ERROR: invalid message count, lock count or ring size\n");
+		return 2;
+	}
+
+	if (selected("mpsc")) {
+		for (i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+			failed |= bench_mpsc(IMPL_LOCKED, producer_counts[i]);
+			failed |= bench_mpsc(IMPL_LOCKFREE, producer_counts[i]);
+		}
+	}
+	if (selected("spsc")) {
+		failed |= bench_spsc(IMPL_LOCKED);
+		failed |= bench_spsc(IMPL_LOCKFREE);
+	}
+	if (selected("lock")) {
+		for (i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+			failed |= bench_lock(IMPL_LOCKED, producer_counts[i]);
+			failed |= bench_lock(IMPL_LOCKFREE, producer_counts[i]);
+		}
+	}
+	if (selected("cond")) {
+		failed |= bench_pingpong(IMPL_LOCKED);
+		failed |= bench_pingpong(IMPL_LOCKFREE);
+	}
+	if (selected("read")) {
+		for (i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+			failed |= bench_read(READ_MUTEX, producer_counts[i]);
+			failed |= bench_read(READ_RWLOCK, producer_counts[i]);
+			failed |= bench_read(READ_SEQLOCK, producer_counts[i]);
+		}
+	}
+
+	return (failed) ? 1 : 0;
+}
@@ -32,13 +32,72 @@ enum fd_mode {
 };
 typedef enum fd_mode fd_mode;
 
+enum fd_event {
+	FDE_READ   = 1 << FDM_READ,
+	FDE_WRITE  = 1 << FDM_WRITE,
+	FDE_EXCEPT = 1 << FDM_EXCEPT,
+	FDE_HUP    = 1 << 3,
+	FDE_ERROR  = 1 << 4
+};
+
+enum socket_connect_flags {
+	SOCKET_CONNECT_HAPPY_EYEBALLS = 1 << 0
+};
+
+enum socket_accept_flags {
+	SOCKET_ACCEPT_NONBLOCK = 1 << 0,
+	SOCKET_ACCEPT_CLOEXEC  = 1 << 1
+};
+
+#define SOCKET_DEFAULT_BACKLOG 100
+#define SOCKET_MAX_FDS 64
+
+enum socket_options_flags {
+	SOCKET_OPT_NODELAY     = 1 << 0,
+	SOCKET_OPT_NODELAY_OFF = 1 << 1,
+	SOCKET_OPT_CORK        = 1 << 2,
+	SOCKET_OPT_QUICKACK    = 1 << 3,
+	SOCKET_OPT_KEEPALIVE   = 1 << 4
+};
+
+/* numeric fields set to 0 leave the system default untouched */
+struct socket_options {
+	unsigned int flags;
+	int sndbuf;
+	int rcvbuf;
+	int busy_poll;          /* SO_BUSY_POLL, microseconds */
+	int keepalive_idle;     /* seconds */
+	int keepalive_interval; /* seconds */
+	int keepalive_count;
+	int user_timeout;       /* TCP_USER_TIMEOUT, milliseconds */
+	int notsent_lowat;      /* TCP_NOTSENT_LOWAT, bytes */
+};
+
+enum socket_options_profile {
+	SOCKET_OPTIONS_PROFILE_SYSTEM,
+	SOCKET_OPTIONS_PROFILE_DEFAULT,
+	SOCKET_OPTIONS_PROFILE_LATENCY,
+	SOCKET_OPTIONS_PROFILE_BULK
+};
+
+enum socket_io_backend {
+	SOCKET_IO_BACKEND_POLL,
+	SOCKET_IO_BACKEND_IO_URING
+};
+
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #define SHUT_RD SD_READ
 #define SHUT_WR SD_WRITE
 #define SHUT_RDWR SD_BOTH
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include <libimobiledevice-glue/glue.h>
@@ -50,12 +109,41 @@ extern "C" {
 #ifndef _WIN32
 LIMD_GLUE_API int socket_create_unix(const char *filename);
 LIMD_GLUE_API int socket_connect_unix(const char *filename);
+/* type is SOCK_STREAM or SOCK_SEQPACKET */
+LIMD_GLUE_API int socket_create_unix_ex(const char *filename, int type);
+LIMD_GLUE_API int socket_connect_unix_ex(const char *filename, int type);
+/* file descriptor passing (SCM_RIGHTS) over unix sockets. Descriptors
+ * sent without payload travel with a single filler byte, so a 1-byte
+ * message that carries descriptors always means "descriptors only":
+ * socket_send_fds() rejects a 1-byte payload with descriptors (-EINVAL),
+ * and socket_receive_fds() swallows the filler byte and returns 0. For
+ * that to be unambiguous, receive with length 0 or a buffer of at least
+ * 2 bytes. Sending neither data nor descriptors sends nothing and
+ * returns 0. */
+LIMD_GLUE_API int socket_send_fds(int fd, const void *data, size_t length, const int *fds, unsigned int num_fds);
+LIMD_GLUE_API int socket_receive_fds(int fd, void *data, size_t length, int *fds, unsigned int *num_fds, unsigned int timeout);
 #endif
+/* connected pair of sockets; type is SOCK_STREAM or SOCK_SEQPACKET
+ * (AF_UNIX socketpair, or a loopback TCP pair on Windows) */
+LIMD_GLUE_API int socket_pair(int type, int fds[2]);
 LIMD_GLUE_API int socket_create(const char *addr, uint16_t port);
+LIMD_GLUE_API int socket_create_with_options(const char *addr, uint16_t port, const struct socket_options *opts);
+LIMD_GLUE_API int socket_create_ex(const char *addr, uint16_t port, int backlog, const struct socket_options *opts);
 LIMD_GLUE_API int socket_connect_addr(struct sockaddr *addr, uint16_t port);
+LIMD_GLUE_API int socket_connect_addr_with_options(struct sockaddr *addr, uint16_t port, const struct socket_options *opts);
 LIMD_GLUE_API int socket_connect(const char *addr, uint16_t port);
+LIMD_GLUE_API int socket_connect_ex(const char *addr, uint16_t port, unsigned int flags);
+LIMD_GLUE_API int socket_connect_with_options(const char *addr, uint16_t port, unsigned int flags, const struct socket_options *opts);
+
+LIMD_GLUE_API void socket_options_init(struct socket_options *opts, enum socket_options_profile profile);
+LIMD_GLUE_API int socket_set_options(int fd, const struct socket_options *opts);
 LIMD_GLUE_API int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
+
+LIMD_GLUE_API void socket_resolver_cache_flush(void);
+LIMD_GLUE_API void socket_resolver_cache_set_ttl(unsigned int ttl_ms, unsigned int negative_ttl_ms);
+
 LIMD_GLUE_API int socket_accept(int fd, uint16_t port);
+LIMD_GLUE_API int socket_accept_ex(int fd, struct sockaddr *addr, socklen_t *addr_len, unsigned int flags);
 
 LIMD_GLUE_API int socket_shutdown(int fd, int how);
 LIMD_GLUE_API int socket_close(int fd);
@@ -65,13 +153,219 @@ LIMD_GLUE_API int socket_peek(int fd, void *data, size_t length);
 LIMD_GLUE_API int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout);
 LIMD_GLUE_API int socket_send(int fd, void *data, size_t length);
 
+LIMD_GLUE_API int socket_receivev(int fd, struct iovec *iov, int iovcnt);
+LIMD_GLUE_API int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, int flags, unsigned int timeout);
+LIMD_GLUE_API int socket_sendv(int fd, const struct iovec *iov, int iovcnt);
+
+LIMD_GLUE_API int socket_receive_all(int fd, void *data, size_t length, size_t *received, unsigned int timeout);
+LIMD_GLUE_API int socket_send_all(int fd, const void *data, size_t length, size_t *sent, unsigned int timeout);
+LIMD_GLUE_API int socket_sendfile(int fd, int file_fd, uint64_t offset, uint64_t length, uint64_t *sent, unsigned int timeout);
+
 LIMD_GLUE_API int socket_get_socket_port(int fd, uint16_t *port);
 
 LIMD_GLUE_API void socket_set_verbose(int level);
 
+/* opt-in per-fd I/O statistics; latencies are recorded in microseconds
+ * into log-linear (HdrHistogram style) buckets */
+#define SOCKET_HISTOGRAM_SUB_BITS 4
+#define SOCKET_HISTOGRAM_MAX_BITS 40
+#define SOCKET_HISTOGRAM_SUB_BUCKETS (1 << SOCKET_HISTOGRAM_SUB_BITS)
+#define SOCKET_HISTOGRAM_BUCKETS ((SOCKET_HISTOGRAM_MAX_BITS - SOCKET_HISTOGRAM_SUB_BITS + 1) * SOCKET_HISTOGRAM_SUB_BUCKETS)
+
+struct socket_histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint32_t buckets[SOCKET_HISTOGRAM_BUCKETS];
+};
+
+struct socket_io_stats {
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t send_calls;
+	uint64_t recv_calls;
+	uint64_t wait_calls;
+	uint64_t eagain;
+	uint64_t eintr;
+	uint64_t timeouts;
+	uint64_t wait_timeouts;
+	uint64_t errors;
+	struct socket_histogram wait;
+	struct socket_histogram send;
+	struct socket_histogram recv;
+};
+
+typedef void (*socket_stats_cb_t)(int fd, const struct socket_io_stats *stats, void *user_data);
+
+LIMD_GLUE_API void socket_stats_enable(int enable);
+LIMD_GLUE_API int socket_stats_is_enabled(void);
+LIMD_GLUE_API int socket_stats_get(int fd, struct socket_io_stats *stats);
+LIMD_GLUE_API void socket_stats_reset(int fd);
+LIMD_GLUE_API int socket_stats_foreach(socket_stats_cb_t cb, void *user_data);
+LIMD_GLUE_API uint64_t socket_histogram_percentile(const struct socket_histogram *histogram, double percentile);
+
+/* fault injection for testing: rates are per million calls of
+ * socket_receive_timeout(), socket_receivev_timeout(), socket_send(),
+ * socket_sendv() and socket_sendfile() on fd, and per underlying send/recv
+ * of socket_send_all(), socket_receive_all(), socket_reader_*() and
+ * socket_framer_*(). socket_send_fds()/socket_receive_fds() and the loop
+ * based APIs are not covered. */
+struct socket_fault_config {
+	uint32_t short_read_rate;
+	uint32_t short_write_rate;
+	uint32_t delay_rate;
+	uint32_t delay_ms;
+	uint32_t reset_rate;
+	uint32_t seed;
+};
+
+/* config NULL removes the faults of fd */
+LIMD_GLUE_API int socket_fault_set(int fd, const struct socket_fault_config *config);
+LIMD_GLUE_API void socket_fault_clear_all(void);
+
+/* cancellation token: while set as the calling thread's current token,
+ * blocking socket waits of that thread return -ECANCELED once the token
+ * is triggered from any thread */
+typedef struct socket_cancel* socket_cancel_t;
+
+LIMD_GLUE_API socket_cancel_t socket_cancel_new(void);
+/* only unbinds the token from the calling thread; every other thread that
+ * set it as its current token must unbind it before it is freed */
+LIMD_GLUE_API void socket_cancel_free(socket_cancel_t cancel);
+LIMD_GLUE_API void socket_cancel_trigger(socket_cancel_t cancel);
+LIMD_GLUE_API int socket_cancel_is_triggered(socket_cancel_t cancel);
+LIMD_GLUE_API void socket_cancel_reset(socket_cancel_t cancel);
+LIMD_GLUE_API void socket_cancel_set_current(socket_cancel_t cancel);
+LIMD_GLUE_API socket_cancel_t socket_cancel_get_current(void);
+
+/* SOCKET_IO_BACKEND_POLL is the default. The io_uring backend (if built)
+ * is used only after socket_set_io_backend() or with the environment
+ * variable SOCKET_IO_BACKEND=io_uring; each thread doing I/O then keeps
+ * its own ring until it exits. */
+LIMD_GLUE_API int socket_set_io_backend(enum socket_io_backend backend);
+LIMD_GLUE_API enum socket_io_backend socket_get_io_backend(void);
+
 LIMD_GLUE_API const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t addr_out_size);
 
 LIMD_GLUE_API int get_primary_mac_address(unsigned char mac_addr_buf[6]);
+LIMD_GLUE_API void socket_interface_cache_invalidate(void);
+
+/* persistent poll set: epoll where available, otherwise poll(), or
+ * WSAPoll() on Windows Vista and later. The poll set, event loop and
+ * everything built on it (relay, listener, write queue) fail with ENOSYS
+ * on older Windows targets. */
+typedef struct socket_pollset* socket_pollset_t;
+struct socket_pollset_event {
+	int fd;
+	unsigned int events;
+	void *user_data;
+};
+
+LIMD_GLUE_API socket_pollset_t socket_pollset_new(void);
+LIMD_GLUE_API void socket_pollset_free(socket_pollset_t ps);
+LIMD_GLUE_API int socket_pollset_add(socket_pollset_t ps, int fd, unsigned int events, void *user_data);
+LIMD_GLUE_API int socket_pollset_modify(socket_pollset_t ps, int fd, unsigned int events);
+LIMD_GLUE_API int socket_pollset_remove(socket_pollset_t ps, int fd);
+LIMD_GLUE_API int socket_pollset_wait(socket_pollset_t ps, struct socket_pollset_event *events, int max_events, int timeout_ms);
+
+/* event loop */
+typedef struct socket_loop* socket_loop_t;
+typedef struct socket_loop_timer* socket_loop_timer_t;
+typedef void (*socket_loop_io_cb_t)(socket_loop_t loop, int fd, unsigned int events, void *user_data);
+typedef void (*socket_loop_post_cb_t)(socket_loop_t loop, void *user_data);
+typedef void (*socket_loop_timer_cb_t)(socket_loop_t loop, socket_loop_timer_t timer, void *user_data);
+
+LIMD_GLUE_API socket_loop_t socket_loop_new(void);
+LIMD_GLUE_API void socket_loop_free(socket_loop_t loop);
+LIMD_GLUE_API int socket_loop_add(socket_loop_t loop, int fd, unsigned int events, socket_loop_io_cb_t cb, void *user_data);
+LIMD_GLUE_API int socket_loop_modify(socket_loop_t loop, int fd, unsigned int events);
+LIMD_GLUE_API int socket_loop_remove(socket_loop_t loop, int fd);
+/* A one-shot timer (interval_ms 0) is freed once its callback returns; its
+ * handle must not be passed to socket_loop_timer_cancel() after that, but
+ * may be from inside the callback. An interval timer stays valid until it
+ * is cancelled. */
+LIMD_GLUE_API socket_loop_timer_t socket_loop_timer_add(socket_loop_t loop, unsigned int timeout_ms, unsigned int interval_ms, socket_loop_timer_cb_t cb, void *user_data);
+LIMD_GLUE_API void socket_loop_timer_cancel(socket_loop_t loop, socket_loop_timer_t timer);
+LIMD_GLUE_API int socket_loop_run_once(socket_loop_t loop, int timeout_ms);
+LIMD_GLUE_API int socket_loop_run(socket_loop_t loop);
+LIMD_GLUE_API void socket_loop_stop(socket_loop_t loop);
+LIMD_GLUE_API void socket_loop_wakeup(socket_loop_t loop);
+LIMD_GLUE_API int socket_loop_post(socket_loop_t loop, socket_loop_post_cb_t cb, void *user_data);
+
+/* bidirectional relay between two sockets, driven by an event loop */
+typedef struct socket_relay* socket_relay_t;
+typedef void (*socket_relay_done_cb_t)(socket_relay_t relay, int error, void *user_data);
+
+LIMD_GLUE_API socket_relay_t socket_relay_new(socket_loop_t loop, int fd_a, int fd_b, size_t max_buffered, socket_relay_done_cb_t done_cb, void *user_data);
+LIMD_GLUE_API void socket_relay_free(socket_relay_t relay);
+LIMD_GLUE_API void socket_relay_get_stats(socket_relay_t relay, uint64_t *bytes_a_to_b, uint64_t *bytes_b_to_a);
+
+/* sharded listener: one SO_REUSEPORT socket and accept thread per shard,
+ * each pinned to a CPU. Accepted sockets are non-blocking and close-on-exec;
+ * the callback runs on the accepting shard's thread. */
+typedef struct socket_listener* socket_listener_t;
+typedef void (*socket_listener_accept_cb_t)(socket_listener_t listener, int fd, struct sockaddr *addr, socklen_t addr_len, unsigned int shard, void *user_data);
+
+LIMD_GLUE_API socket_listener_t socket_listener_new(const char *addr, uint16_t port, unsigned int num_shards, int backlog, const struct socket_options *opts, socket_listener_accept_cb_t cb, void *user_data);
+LIMD_GLUE_API void socket_listener_free(socket_listener_t listener);
+LIMD_GLUE_API uint16_t socket_listener_get_port(socket_listener_t listener);
+LIMD_GLUE_API unsigned int socket_listener_get_num_shards(socket_listener_t listener);
+
+/* non-blocking outbound queue, flushed by an event loop. Writes may come
+ * from any thread; socket_writeq_write() returns 1 while the queue is at or
+ * above the high watermark. The fd may also be added to the loop by the
+ * application (e.g. for reading); the queue only adds and removes write
+ * interest. socket_writeq_free() must be called on the loop's thread, or
+ * while the loop is not running. */
+enum socket_writeq_event {
+	SOCKET_WRITEQ_EVENT_NONE,
+	SOCKET_WRITEQ_EVENT_HIGH_WATER,
+	SOCKET_WRITEQ_EVENT_LOW_WATER,
+	SOCKET_WRITEQ_EVENT_ERROR
+};
+
+typedef struct socket_writeq* socket_writeq_t;
+typedef void (*socket_writeq_cb_t)(socket_writeq_t wq, enum socket_writeq_event event, int error, void *user_data);
+
+LIMD_GLUE_API socket_writeq_t socket_writeq_new(socket_loop_t loop, int fd, size_t low_water, size_t high_water, socket_writeq_cb_t cb, void *user_data);
+LIMD_GLUE_API void socket_writeq_free(socket_writeq_t wq);
+LIMD_GLUE_API int socket_writeq_write(socket_writeq_t wq, const void *data, size_t length);
+LIMD_GLUE_API size_t socket_writeq_pending(socket_writeq_t wq);
+
+/* buffered reader with read-ahead; peeked data points into the reader's
+ * buffer and stays valid until the next call on the reader */
+typedef struct socket_reader* socket_reader_t;
+
+LIMD_GLUE_API socket_reader_t socket_reader_new(int fd, size_t buffer_size);
+LIMD_GLUE_API void socket_reader_free(socket_reader_t reader);
+LIMD_GLUE_API int socket_reader_get_fd(socket_reader_t reader);
+LIMD_GLUE_API size_t socket_reader_available(socket_reader_t reader);
+LIMD_GLUE_API int socket_reader_fill(socket_reader_t reader, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_peek(socket_reader_t reader, size_t length, const void **data, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_consume(socket_reader_t reader, size_t length);
+LIMD_GLUE_API int socket_reader_next(socket_reader_t reader, size_t length, const void **data, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_read(socket_reader_t reader, void *data, size_t length, size_t *received, unsigned int timeout);
+
+/* length-prefixed framing on top of socket_reader_t; the payload size is
+ * the value of the length field plus length_adjust */
+struct socket_framer_config {
+	uint32_t header_size;
+	uint32_t length_offset;
+	uint32_t length_width;   /* 1, 2, 4 or 8 */
+	int big_endian;
+	int32_t length_adjust;
+	uint32_t max_frame_size; /* header included, 0 for the default (16MB) */
+};
+
+typedef struct socket_framer* socket_framer_t;
+
+LIMD_GLUE_API socket_framer_t socket_framer_new(int fd, const struct socket_framer_config *config, size_t buffer_size);
+LIMD_GLUE_API void socket_framer_free(socket_framer_t framer);
+LIMD_GLUE_API socket_reader_t socket_framer_get_reader(socket_framer_t framer);
+LIMD_GLUE_API int socket_framer_read(socket_framer_t framer, const void **header, const void **payload, unsigned int timeout);
+LIMD_GLUE_API int socket_framer_write(socket_framer_t framer, const void *header, const void *payload, size_t payload_len);
+LIMD_GLUE_API int socket_framer_flush(socket_framer_t framer);
 
 #ifdef __cplusplus
 }
@@ -53,6 +53,20 @@ typedef volatile struct {
 #define THREAD_ONCE_INIT {0, 0}
 #define THREAD_ID GetCurrentThreadId()
 #define THREAD_T_NULL (THREAD_T)NULL
+/* SRWLOCK / CONDITION_VARIABLE */
+typedef struct {
+	void* ptr;
+} fast_mutex_t;
+typedef struct {
+	void* ptr;
+} fast_cond_t;
+#define FAST_MUTEX_INITIALIZER {0}
+#define FAST_COND_INITIALIZER {0}
+/* SRWLOCK */
+typedef struct {
+	void* ptr;
+} rwlock_t;
+#define RWLOCK_INITIALIZER {0}
 #else
 #include <pthread.h>
 #include <signal.h>
@@ -64,7 +78,36 @@ typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
 #define THREAD_T_NULL (THREAD_T)NULL
+#ifdef __linux__
+typedef struct {
+	volatile unsigned int state;
+	volatile unsigned int spins;
+} fast_mutex_t;
+typedef struct {
+	volatile unsigned int seq;
+	volatile unsigned int waiters;
+} fast_cond_t;
+#define FAST_MUTEX_INITIALIZER {0, 0}
+#define FAST_COND_INITIALIZER {0, 0}
+#else
+typedef pthread_mutex_t fast_mutex_t;
+typedef pthread_cond_t fast_cond_t;
+#define FAST_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define FAST_COND_INITIALIZER PTHREAD_COND_INITIALIZER
 #endif
+typedef pthread_rwlock_t rwlock_t;
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#define RWLOCK_INITIALIZER PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#else
+#define RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#endif
+#endif
+
+typedef struct {
+	volatile unsigned int seq;
+	fast_mutex_t lock;
+} seqlock_t;
+#define SEQLOCK_INITIALIZER {0, FAST_MUTEX_INITIALIZER}
 
 #ifdef __cplusplus
 extern "C" {
@@ -80,6 +123,9 @@ LIMD_GLUE_API int thread_alive(THREAD_T thread);
 
 LIMD_GLUE_API int thread_cancel(THREAD_T thread);
 
+LIMD_GLUE_API int thread_get_cpu_count(void);
+LIMD_GLUE_API int thread_set_cpu_affinity(THREAD_T thread, unsigned int cpu_index);
+
 #ifdef _WIN32
 #undef HAVE_THREAD_CLEANUP
 #else
@@ -103,6 +149,116 @@ LIMD_GLUE_API int cond_signal(cond_t* cond);
 LIMD_GLUE_API int cond_wait(cond_t* cond, mutex_t* mutex);
 LIMD_GLUE_API int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
 
+/* adaptive spin-then-park mutex and condition variable: futex based on
+ * Linux, SRWLOCK/CONDITION_VARIABLE on Windows, pthread elsewhere.
+ * Timeouts are measured against a monotonic clock and return ETIMEDOUT.
+ * Unlike cond_wait(), fast_cond_wait() always returns with the mutex held.
+ * Not interchangeable with mutex_t/cond_t.
+ * fast_cond_t is about those semantics and static initialization rather
+ * than speed: a hand-off that has to sleep costs the same wake and wait
+ * syscalls as with cond_t. Only with more than one CPU does a waiter spin
+ * briefly first, which lets quick hand-offs skip the syscalls.
+ * Windows builds targeting XP (_WIN32_WINNT < 0x0600) and Linux builds
+ * without <linux/futex.h> fall back to a yielding spinlock and condition
+ * waits that poll about once per millisecond: fast_cond_signal() then wakes
+ * every waiter like fast_cond_broadcast(), and wakeups lag by up to a tick. */
+LIMD_GLUE_API void fast_mutex_init(fast_mutex_t* mutex);
+LIMD_GLUE_API void fast_mutex_destroy(fast_mutex_t* mutex);
+LIMD_GLUE_API void fast_mutex_lock(fast_mutex_t* mutex);
+LIMD_GLUE_API int fast_mutex_trylock(fast_mutex_t* mutex);
+LIMD_GLUE_API void fast_mutex_unlock(fast_mutex_t* mutex);
+
+LIMD_GLUE_API void fast_cond_init(fast_cond_t* cond);
+LIMD_GLUE_API void fast_cond_destroy(fast_cond_t* cond);
+LIMD_GLUE_API int fast_cond_signal(fast_cond_t* cond);
+LIMD_GLUE_API int fast_cond_broadcast(fast_cond_t* cond);
+LIMD_GLUE_API int fast_cond_wait(fast_cond_t* cond, fast_mutex_t* mutex);
+LIMD_GLUE_API int fast_cond_wait_timeout(fast_cond_t* cond, fast_mutex_t* mutex, unsigned int timeout_ms);
+
+/* reader-writer lock for read-mostly state; readers share the lock,
+ * writers are exclusive. Where the platform allows it, a waiting writer
+ * holds off new readers. Not recursive, and a read lock can't be
+ * upgraded to a write lock. */
+LIMD_GLUE_API void rwlock_init(rwlock_t* rwlock);
+LIMD_GLUE_API void rwlock_destroy(rwlock_t* rwlock);
+LIMD_GLUE_API void rwlock_read_lock(rwlock_t* rwlock);
+LIMD_GLUE_API void rwlock_read_unlock(rwlock_t* rwlock);
+LIMD_GLUE_API void rwlock_write_lock(rwlock_t* rwlock);
+LIMD_GLUE_API void rwlock_write_unlock(rwlock_t* rwlock);
+
+/* sequence lock for small, frequently read structs. Readers never block
+ * writers; they copy the data and retry if a write overlapped:
+ *
+ *   do {
+ *       seq = seqlock_read_begin(&sl);
+ *       copy = shared;
+ *   } while (seqlock_read_retry(&sl, seq));
+ *
+ * Readers must not follow pointers read from the protected data. */
+LIMD_GLUE_API void seqlock_init(seqlock_t* seqlock);
+LIMD_GLUE_API void seqlock_destroy(seqlock_t* seqlock);
+LIMD_GLUE_API void seqlock_write_lock(seqlock_t* seqlock);
+LIMD_GLUE_API void seqlock_write_unlock(seqlock_t* seqlock);
+LIMD_GLUE_API unsigned int seqlock_read_begin(seqlock_t* seqlock);
+LIMD_GLUE_API int seqlock_read_retry(seqlock_t* seqlock, unsigned int start);
+
+/* fixed-size thread pool with a FIFO work queue */
+typedef struct thread_pool* thread_pool_t;
+typedef void (*thread_pool_func_t)(void* data);
+
+/* num_threads 0 uses thread_get_cpu_count(), max_queue 0 means unbounded */
+LIMD_GLUE_API thread_pool_t thread_pool_new(const char* name, unsigned int num_threads, unsigned int max_queue);
+/* runs all queued tasks, then joins the workers */
+LIMD_GLUE_API void thread_pool_free(thread_pool_t pool);
+/* blocks while the queue is full */
+LIMD_GLUE_API int thread_pool_submit(thread_pool_t pool, thread_pool_func_t func, void* data);
+/* returns -EAGAIN instead of blocking while the queue is full */
+LIMD_GLUE_API int thread_pool_try_submit(thread_pool_t pool, thread_pool_func_t func, void* data);
+/* waits until the queue is empty and no task is running; not from a task */
+LIMD_GLUE_API void thread_pool_wait(thread_pool_t pool);
+LIMD_GLUE_API unsigned int thread_pool_get_num_threads(thread_pool_t pool);
+LIMD_GLUE_API unsigned int thread_pool_get_pending(thread_pool_t pool);
+LIMD_GLUE_API const char* thread_pool_get_name(thread_pool_t pool);
+
+/* work-stealing scheduler for CPU-bound fork/join work */
+typedef struct thread_scheduler* thread_scheduler_t;
+typedef struct thread_task_group* thread_task_group_t;
+typedef void (*thread_task_func_t)(void* data);
+
+/* num_workers 0 uses thread_get_cpu_count(); all task groups must be
+ * waited for before the scheduler is freed */
+LIMD_GLUE_API thread_scheduler_t thread_scheduler_new(unsigned int num_workers);
+LIMD_GLUE_API void thread_scheduler_free(thread_scheduler_t sched);
+/* process-wide scheduler with one worker per CPU */
+LIMD_GLUE_API thread_scheduler_t thread_scheduler_get_default(void);
+LIMD_GLUE_API unsigned int thread_scheduler_get_num_workers(thread_scheduler_t sched);
+
+/* sched NULL uses thread_scheduler_get_default() */
+LIMD_GLUE_API thread_task_group_t thread_task_group_new(thread_scheduler_t sched);
+/* waits for outstanding tasks */
+LIMD_GLUE_API void thread_task_group_free(thread_task_group_t group);
+/* may be called from within tasks of the same scheduler */
+LIMD_GLUE_API int thread_task_group_spawn(thread_task_group_t group, thread_task_func_t func, void* data);
+/* runs pending tasks on the calling thread until all tasks of group are done */
+LIMD_GLUE_API void thread_task_group_wait(thread_task_group_t group);
+
+/* lock-free hand-off queues; for the pop/push calls timeout_ms -1 waits
+ * forever and 0 returns -EAGAIN instead of waiting */
+typedef struct thread_mpsc_queue* thread_mpsc_queue_t;
+typedef struct thread_spsc_ring* thread_spsc_ring_t;
+
+/* multiple producers, one consumer; unbounded */
+LIMD_GLUE_API thread_mpsc_queue_t thread_mpsc_queue_new(void);
+LIMD_GLUE_API void thread_mpsc_queue_free(thread_mpsc_queue_t queue);
+LIMD_GLUE_API int thread_mpsc_queue_push(thread_mpsc_queue_t queue, void* data);
+LIMD_GLUE_API int thread_mpsc_queue_pop(thread_mpsc_queue_t queue, void** data, int timeout_ms);
+
+/* one producer, one consumer; capacity is rounded up to a power of two */
+LIMD_GLUE_API thread_spsc_ring_t thread_spsc_ring_new(unsigned int capacity);
+LIMD_GLUE_API void thread_spsc_ring_free(thread_spsc_ring_t ring);
+LIMD_GLUE_API int thread_spsc_ring_push(thread_spsc_ring_t ring, void* data, int timeout_ms);
+LIMD_GLUE_API int thread_spsc_ring_pop(thread_spsc_ring_t ring, void** data, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
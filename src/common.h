@@ -40,5 +40,6 @@
 #include "libimobiledevice-glue/glue.h"
 
 void socket_init();
+void socket_deinit();
 
 #endif
@@ -26,6 +26,8 @@
 #include <windows.h>
 #endif
 
+#include <stdlib.h>
+
 #include "common.h"
 #include "libimobiledevice-glue/thread.h"
 
@@ -38,6 +40,10 @@
         static void f(void); \
         struct f##_t_ { f##_t_(void) { f(); } }; static f##_t_ f##_; \
         static void f(void)
+    #define FINALIZER(f) \
+        static void f(void); \
+        struct f##_t_ { ~f##_t_(void) { f(); } }; static f##_t_ f##_; \
+        static void f(void)
 #elif defined(_MSC_VER)
     #pragma section(".CRT$XCU",read)
     #define INITIALIZER2_(f,p) \
@@ -50,10 +56,17 @@
     #else
         #define INITIALIZER(f) INITIALIZER2_(f,"_")
     #endif
+    #define FINALIZER(f) \
+        static void f(void); \
+        INITIALIZER(f##_register) { atexit(f); } \
+        static void f(void)
 #else
     #define INITIALIZER(f) \
         static void f(void) __attribute__((__constructor__)); \
         static void f(void)
+    #define FINALIZER(f) \
+        static void f(void) __attribute__((__destructor__)); \
+        static void f(void)
 #endif
 
 extern void term_colors_init();
@@ -64,6 +77,11 @@ INITIALIZER(internal_glue_init)
 	term_colors_init();
 }
 
+FINALIZER(internal_glue_deinit)
+{
+	socket_deinit();
+}
+
 const char* libimobiledevice_glue_version()
 {
 #ifndef PACKAGE_VERSION
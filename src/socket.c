@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #include <sys/time.h>
@@ -61,14 +62,36 @@
 #endif
 #ifdef __linux__
 #include <netpacket/packet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 #endif
 #endif
 #include "common.h"
 #include "libimobiledevice-glue/socket.h"
+#include "libimobiledevice-glue/thread.h"
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
+#if defined(HAVE_POLL) || (defined(_WIN32) && (_WIN32_WINNT >= 0x0600))
+/* pollset and loop: poll() or, on Windows, WSAPoll() */
+#define HAVE_SOCKET_LOOP 1
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define RECV_TIMEOUT 20000
 #define SEND_TIMEOUT 10000
@@ -83,18 +106,44 @@
 #ifndef ETIMEDOUT
 #define ETIMEDOUT 138
 #endif
+#ifndef ECANCELED
+#define ECANCELED 105
+#endif
 
 #ifndef AI_NUMERICSERV
 #define AI_NUMERICSERV 0
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD_INT(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_INT(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_XCHG_INT(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#else
+#define ATOMIC_LOAD_INT(ptr) InterlockedCompareExchange((volatile LONG*)(ptr), 0, 0)
+#define ATOMIC_STORE_INT(ptr, val) InterlockedExchange((volatile LONG*)(ptr), (LONG)(val))
+#define ATOMIC_XCHG_INT(ptr, val) InterlockedExchange((volatile LONG*)(ptr), (LONG)(val))
+#endif
+
 static int verbose = 0;
+/* read and written from any thread */
+static enum socket_io_backend io_backend = SOCKET_IO_BACKEND_POLL;
 
 #define SOCKET_ERR(level, msg, ...) \
 	if (verbose >= level) { \
 		fprintf(stderr, "[socket] " msg , ## __VA_ARGS__); \
 	}
 
+static uint64_t _monotonic_ms(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)(ts.tv_nsec / 1000000);
+#endif
+}
+
 void socket_init(void)
 {
 #ifdef _WIN32
@@ -108,6 +157,15 @@ void socket_init(void)
         if (env_debug) {
 		verbose = (int)strtol(env_debug, NULL, 10);
 	}
+	/* io_uring is opt-in: it costs every I/O thread a ring fd and mappings */
+	char *env_backend = getenv("SOCKET_IO_BACKEND");
+	if (env_backend) {
+		if (!strcmp(env_backend, "poll")) {
+			socket_set_io_backend(SOCKET_IO_BACKEND_POLL);
+		} else if (!strcmp(env_backend, "io_uring")) {
+			socket_set_io_backend(SOCKET_IO_BACKEND_IO_URING);
+		}
+	}
 }
 
 void socket_set_verbose(int level)
@@ -164,14 +222,603 @@ enum poll_status
 {
 	poll_status_success,
 	poll_status_timeout,
-	poll_status_error
+	poll_status_error,
+	poll_status_cancelled
 };
 
 #ifdef _MSC_VER
 #define ALWAYS_INLINE __forceinline
+#define THREAD_LOCAL __declspec(thread)
 #else
 #define ALWAYS_INLINE __inline__ __attribute__((__always_inline__))
+#define THREAD_LOCAL __thread
+#endif
+
+struct socket_cancel {
+	int rfd;
+	int wfd;
+	/* accessed atomically; once set the fd is kept readable */
+	int triggered;
+};
+
+/* token that blocking waits of the calling thread also wait on */
+static THREAD_LOCAL struct socket_cancel *thread_cancel_token = NULL;
+
+socket_cancel_t socket_cancel_new(void)
+{
+#ifdef _WIN32
+	errno = ENOSYS;
+	return NULL;
+#else
+	struct socket_cancel *cancel = (struct socket_cancel*)calloc(1, sizeof(struct socket_cancel));
+	if (!cancel) {
+		errno = ENOMEM;
+		return NULL;
+	}
+#ifdef HAVE_SYS_EVENTFD_H
+	cancel->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	cancel->wfd = cancel->rfd;
+	if (cancel->rfd < 0) {
+		SOCKET_ERR(1, "%s: eventfd: %s\n", __func__, strerror(errno));
+		free(cancel);
+		return NULL;
+	}
+#else
+	int pfd[2];
+	if (pipe(pfd) < 0) {
+		SOCKET_ERR(1, "%s: pipe: %s\n", __func__, strerror(errno));
+		free(cancel);
+		return NULL;
+	}
+	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(pfd[1], F_SETFL, fcntl(pfd[1], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	cancel->rfd = pfd[0];
+	cancel->wfd = pfd[1];
+#endif
+	return cancel;
+#endif
+}
+
+void socket_cancel_free(socket_cancel_t cancel)
+{
+	if (!cancel) {
+		return;
+	}
+	if (thread_cancel_token == cancel) {
+		thread_cancel_token = NULL;
+	}
+	close(cancel->rfd);
+	if (cancel->wfd != cancel->rfd) {
+		close(cancel->wfd);
+	}
+	free(cancel);
+}
+
+static void _socket_cancel_signal(struct socket_cancel *cancel)
+{
+	/* the fd stays readable until reset, waking every waiting thread */
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+	if (write(cancel->wfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		SOCKET_ERR(1, "%s: write: %s\n", __func__, strerror(errno));
+	}
+}
+
+void socket_cancel_trigger(socket_cancel_t cancel)
+{
+	if (!cancel || ATOMIC_XCHG_INT(&cancel->triggered, 1)) {
+		return;
+	}
+	_socket_cancel_signal(cancel);
+}
+
+int socket_cancel_is_triggered(socket_cancel_t cancel)
+{
+	return (cancel) ? ATOMIC_LOAD_INT(&cancel->triggered) : 0;
+}
+
+void socket_cancel_reset(socket_cancel_t cancel)
+{
+	char buf[64];
+	if (!cancel) {
+		return;
+	}
+	/* clear the flag first so a concurrent trigger isn't skipped */
+	ATOMIC_STORE_INT(&cancel->triggered, 0);
+	while (read(cancel->rfd, buf, sizeof(buf)) > 0);
+	if (ATOMIC_LOAD_INT(&cancel->triggered)) {
+		/* triggered while draining: its wakeup may have been consumed */
+		_socket_cancel_signal(cancel);
+	}
+}
+
+void socket_cancel_set_current(socket_cancel_t cancel)
+{
+	thread_cancel_token = cancel;
+}
+
+socket_cancel_t socket_cancel_get_current(void)
+{
+	return thread_cancel_token;
+}
+
+#define STATS_PAGE_BITS 8
+#define STATS_PAGE_SIZE (1 << STATS_PAGE_BITS)
+#define STATS_MAX_PAGES 4096
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STATS_ADD(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define STATS_LOAD_PTR(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define STATS_CAS_PTR(ptr, expected, desired) __sync_bool_compare_and_swap(&(ptr), (expected), (desired))
+#else
+#define STATS_ADD(var, val) ((var) += (val))
+#define STATS_LOAD_PTR(ptr) (ptr)
+#define STATS_CAS_PTR(ptr, expected, desired) (((ptr) == (expected)) ? ((ptr) = (desired), 1) : 0)
+#endif
+
+enum socket_stats_kind {
+	STATS_WAIT,
+	STATS_SEND,
+	STATS_RECV
+};
+
+/* checked on every instrumented call; the only cost while disabled */
+static int stats_enabled = 0;
+static struct socket_io_stats **stats_pages[STATS_MAX_PAGES];
+
+static uint64_t _monotonic_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)(ts.tv_nsec / 1000);
+#endif
+}
+
+/* Log-linear bucket index: values below 2*2^SUB_BITS map 1:1, above that
+ * each power of two is split into 2^SUB_BITS buckets (HdrHistogram style). */
+static unsigned int _histogram_index(uint64_t value)
+{
+	const unsigned int sub = SOCKET_HISTOGRAM_SUB_BUCKETS;
+	if (value < 2 * sub) {
+		return (unsigned int)value;
+	}
+	unsigned int msb = 63;
+	while (!(value >> msb)) {
+		msb--;
+	}
+	unsigned int shift = msb - SOCKET_HISTOGRAM_SUB_BITS;
+	unsigned int index = shift * sub + (unsigned int)(value >> shift);
+	return (index < SOCKET_HISTOGRAM_BUCKETS) ? index : SOCKET_HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t _histogram_bucket_upper(unsigned int index)
+{
+	const unsigned int sub = SOCKET_HISTOGRAM_SUB_BUCKETS;
+	if (index < 2 * sub) {
+		return index;
+	}
+	unsigned int shift = index / sub - 1;
+	uint64_t m = index % sub + sub;
+	return ((m + 1) << shift) - 1;
+}
+
+static void _histogram_record(struct socket_histogram *h, uint64_t value)
+{
+	STATS_ADD(h->count, 1);
+	STATS_ADD(h->sum_us, value);
+	STATS_ADD(h->buckets[_histogram_index(value)], 1);
+	/* racy min/max updates can only lose precision, never corrupt */
+	if (value > h->max_us) {
+		h->max_us = value;
+	}
+	if (value < h->min_us) {
+		h->min_us = value;
+	}
+}
+
+/* min_us is kept at UINT64_MAX until the first sample so a 0us sample sticks */
+static void _socket_stats_clear(struct socket_io_stats *st)
+{
+	memset(st, 0, sizeof(struct socket_io_stats));
+	st->wait.min_us = UINT64_MAX;
+	st->send.min_us = UINT64_MAX;
+	st->recv.min_us = UINT64_MAX;
+}
+
+static void _socket_stats_snapshot(struct socket_io_stats *dst, const struct socket_io_stats *st)
+{
+	memcpy(dst, st, sizeof(struct socket_io_stats));
+	if (dst->wait.min_us == UINT64_MAX) {
+		dst->wait.min_us = 0;
+	}
+	if (dst->send.min_us == UINT64_MAX) {
+		dst->send.min_us = 0;
+	}
+	if (dst->recv.min_us == UINT64_MAX) {
+		dst->recv.min_us = 0;
+	}
+}
+
+static struct socket_io_stats* _socket_stats_entry(int fd, int create)
+{
+	if (fd < 0 || (unsigned int)fd >= STATS_MAX_PAGES * STATS_PAGE_SIZE) {
+		return NULL;
+	}
+	unsigned int page = (unsigned int)fd >> STATS_PAGE_BITS;
+	unsigned int slot = (unsigned int)fd & (STATS_PAGE_SIZE - 1);
+	struct socket_io_stats **entries = STATS_LOAD_PTR(stats_pages[page]);
+	if (!entries) {
+		if (!create) {
+			return NULL;
+		}
+		struct socket_io_stats **newpage = (struct socket_io_stats**)calloc(STATS_PAGE_SIZE, sizeof(struct socket_io_stats*));
+		if (!newpage) {
+			return NULL;
+		}
+		if (!STATS_CAS_PTR(stats_pages[page], NULL, newpage)) {
+			free(newpage);
+		}
+		entries = STATS_LOAD_PTR(stats_pages[page]);
+	}
+	struct socket_io_stats *entry = STATS_LOAD_PTR(entries[slot]);
+	if (!entry && create) {
+		struct socket_io_stats *newentry = (struct socket_io_stats*)malloc(sizeof(struct socket_io_stats));
+		if (!newentry) {
+			return NULL;
+		}
+		_socket_stats_clear(newentry);
+		if (!STATS_CAS_PTR(entries[slot], NULL, newentry)) {
+			free(newentry);
+		}
+		entry = STATS_LOAD_PTR(entries[slot]);
+	}
+	return entry;
+}
+
+static void _socket_stats_record(int fd, enum socket_stats_kind kind, int res, uint64_t bytes, uint64_t start)
+{
+	struct socket_io_stats *st = _socket_stats_entry(fd, 1);
+	if (!st) {
+		return;
+	}
+	uint64_t elapsed = _monotonic_us() - start;
+	switch (kind) {
+		case STATS_WAIT:
+			STATS_ADD(st->wait_calls, 1);
+			if (res == -ETIMEDOUT) {
+				STATS_ADD(st->wait_timeouts, 1);
+			}
+			_histogram_record(&st->wait, elapsed);
+			return;
+		case STATS_SEND:
+			STATS_ADD(st->send_calls, 1);
+			STATS_ADD(st->bytes_sent, bytes);
+			_histogram_record(&st->send, elapsed);
+			break;
+		case STATS_RECV:
+		default:
+			STATS_ADD(st->recv_calls, 1);
+			STATS_ADD(st->bytes_received, bytes);
+			_histogram_record(&st->recv, elapsed);
+			break;
+	}
+	if (res == -ETIMEDOUT) {
+		STATS_ADD(st->timeouts, 1);
+	} else if (res == -EAGAIN || res == -EWOULDBLOCK) {
+		STATS_ADD(st->eagain, 1);
+	} else if (res < 0) {
+		STATS_ADD(st->errors, 1);
+	}
+}
+
+static void _socket_stats_count(int fd, int err)
+{
+	struct socket_io_stats *st = _socket_stats_entry(fd, 1);
+	if (!st) {
+		return;
+	}
+	if (err == EINTR) {
+		STATS_ADD(st->eintr, 1);
+	} else if (err == EAGAIN || err == EWOULDBLOCK) {
+		STATS_ADD(st->eagain, 1);
+	}
+}
+
+void socket_stats_enable(int enable)
+{
+	stats_enabled = (enable) ? 1 : 0;
+}
+
+int socket_stats_is_enabled(void)
+{
+	return stats_enabled;
+}
+
+int socket_stats_get(int fd, struct socket_io_stats *stats)
+{
+	if (!stats) {
+		return -EINVAL;
+	}
+	struct socket_io_stats *st = _socket_stats_entry(fd, 0);
+	if (!st) {
+		return -ENOENT;
+	}
+	_socket_stats_snapshot(stats, st);
+	return 0;
+}
+
+void socket_stats_reset(int fd)
+{
+	unsigned int page, slot;
+	if (fd >= 0) {
+		struct socket_io_stats *st = _socket_stats_entry(fd, 0);
+		if (st) {
+			_socket_stats_clear(st);
+		}
+		return;
+	}
+	for (page = 0; page < STATS_MAX_PAGES; page++) {
+		struct socket_io_stats **entries = STATS_LOAD_PTR(stats_pages[page]);
+		if (!entries) {
+			continue;
+		}
+		for (slot = 0; slot < STATS_PAGE_SIZE; slot++) {
+			if (entries[slot]) {
+				_socket_stats_clear(entries[slot]);
+			}
+		}
+	}
+}
+
+int socket_stats_foreach(socket_stats_cb_t cb, void *user_data)
+{
+	unsigned int page, slot;
+	int count = 0;
+	if (!cb) {
+		return -EINVAL;
+	}
+	for (page = 0; page < STATS_MAX_PAGES; page++) {
+		struct socket_io_stats **entries = STATS_LOAD_PTR(stats_pages[page]);
+		if (!entries) {
+			continue;
+		}
+		for (slot = 0; slot < STATS_PAGE_SIZE; slot++) {
+			struct socket_io_stats *st = entries[slot];
+			if (!st || (st->send_calls == 0 && st->recv_calls == 0 && st->wait_calls == 0)) {
+				continue;
+			}
+			struct socket_io_stats snapshot;
+			_socket_stats_snapshot(&snapshot, st);
+			cb((int)(page * STATS_PAGE_SIZE + slot), &snapshot, user_data);
+			count++;
+		}
+	}
+	return count;
+}
+
+uint64_t socket_histogram_percentile(const struct socket_histogram *histogram, double percentile)
+{
+	unsigned int i;
+	uint64_t seen = 0;
+	if (!histogram || histogram->count == 0) {
+		return 0;
+	}
+	if (percentile < 0.0) {
+		percentile = 0.0;
+	} else if (percentile > 100.0) {
+		percentile = 100.0;
+	}
+	uint64_t target = (uint64_t)((percentile / 100.0) * (double)histogram->count + 0.5);
+	if (target == 0) {
+		target = 1;
+	}
+	for (i = 0; i < SOCKET_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= target) {
+			uint64_t upper = _histogram_bucket_upper(i);
+			return (upper < histogram->max_us) ? upper : histogram->max_us;
+		}
+	}
+	return histogram->max_us;
+}
+
+enum socket_fault_op {
+	FAULT_RECV,
+	FAULT_SEND
+};
+
+struct socket_fault {
+	int fd;
+	struct socket_fault_config config;
+	uint32_t rng;
+	struct socket_fault *next;
+};
+
+/* number of fds with faults configured; checked on every hooked call */
+static int faults_active = 0;
+static struct socket_fault *faults = NULL;
+static mutex_t faults_mutex;
+static thread_once_t faults_once = THREAD_ONCE_INIT;
+
+static void _faults_init(void)
+{
+	mutex_init(&faults_mutex);
+}
+
+static uint32_t _fault_next(struct socket_fault *fault)
+{
+	/* xorshift32, so a given seed replays the same fault sequence */
+	uint32_t x = fault->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fault->rng = x;
+	return x;
+}
+
+static int _fault_hit(struct socket_fault *fault, uint32_t rate)
+{
+	return rate > 0 && (_fault_next(fault) % 1000000) < rate;
+}
+
+/* Returns 0 to go ahead with the (possibly shortened) length, or a
+ * negative errno to be returned to the caller instead. */
+static int _socket_fault_apply(int fd, enum socket_fault_op op, size_t *length)
+{
+	struct socket_fault *fault;
+	uint32_t delay_ms = 0;
+	int reset = 0;
+
+	thread_once(&faults_once, _faults_init);
+	mutex_lock(&faults_mutex);
+	for (fault = faults; fault; fault = fault->next) {
+		if (fault->fd == fd) {
+			break;
+		}
+	}
+	if (fault) {
+		if (_fault_hit(fault, fault->config.reset_rate)) {
+			reset = 1;
+		} else {
+			if (_fault_hit(fault, fault->config.delay_rate)) {
+				delay_ms = fault->config.delay_ms;
+			}
+			uint32_t rate = (op == FAULT_RECV) ? fault->config.short_read_rate : fault->config.short_write_rate;
+			if (*length > 1 && _fault_hit(fault, rate)) {
+				*length = 1 + _fault_next(fault) % (*length - 1);
+			}
+		}
+	}
+	mutex_unlock(&faults_mutex);
+
+	if (reset) {
+		SOCKET_ERR(3, "%s: fd=%d injected reset\n", __func__, fd);
+		shutdown(fd, SHUT_RDWR);
+		return -ECONNRESET;
+	}
+	if (delay_ms > 0) {
+#ifdef _WIN32
+		Sleep(delay_ms);
+#else
+		struct timespec ts;
+		ts.tv_sec = delay_ms / 1000;
+		ts.tv_nsec = (long)(delay_ms % 1000) * 1000000;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
 #endif
+	}
+	return 0;
+}
+
+#define FAULT_IOV_STACK_COUNT 16
+
+/* Like _socket_fault_apply() for an iovec array. A shortened transfer is
+ * described by a truncated copy in tmp (or a malloc()ed array returned via
+ * *alloc if tmp is too small), to which *iov is pointed. */
+static int _socket_fault_apply_iov(int fd, enum socket_fault_op op, const struct iovec **iov, int *iovcnt, struct iovec *tmp, struct iovec **alloc)
+{
+	size_t total = 0;
+	int i;
+
+	*alloc = NULL;
+	if (!*iov || *iovcnt <= 0) {
+		return 0;
+	}
+	for (i = 0; i < *iovcnt; i++) {
+		total += (*iov)[i].iov_len;
+	}
+	size_t length = total;
+	int res = _socket_fault_apply(fd, op, &length);
+	if (res < 0 || length == total) {
+		return res;
+	}
+	struct iovec *out = tmp;
+	if (*iovcnt > FAULT_IOV_STACK_COUNT) {
+		out = (struct iovec*)malloc(sizeof(struct iovec) * (*iovcnt));
+		if (!out) {
+			return -ENOMEM;
+		}
+		*alloc = out;
+	}
+	for (i = 0; i < *iovcnt && length > 0; i++) {
+		out[i] = (*iov)[i];
+		if (out[i].iov_len > length) {
+			out[i].iov_len = length;
+		}
+		length -= out[i].iov_len;
+	}
+	*iov = out;
+	*iovcnt = i;
+	return 0;
+}
+
+int socket_fault_set(int fd, const struct socket_fault_config *config)
+{
+	struct socket_fault **pp;
+	struct socket_fault *fault;
+
+	if (fd < 0) {
+		return -EINVAL;
+	}
+	thread_once(&faults_once, _faults_init);
+	mutex_lock(&faults_mutex);
+	for (pp = &faults; *pp; pp = &(*pp)->next) {
+		if ((*pp)->fd == fd) {
+			break;
+		}
+	}
+	fault = *pp;
+	if (!config) {
+		if (fault) {
+			*pp = fault->next;
+			free(fault);
+			faults_active--;
+		}
+		mutex_unlock(&faults_mutex);
+		return 0;
+	}
+	if (!fault) {
+		fault = (struct socket_fault*)calloc(1, sizeof(struct socket_fault));
+		if (!fault) {
+			mutex_unlock(&faults_mutex);
+			return -ENOMEM;
+		}
+		fault->fd = fd;
+		fault->next = faults;
+		faults = fault;
+		faults_active++;
+	}
+	fault->config = *config;
+	fault->rng = (config->seed) ? config->seed : ((uint32_t)fd * 2654435761u) | 1;
+	mutex_unlock(&faults_mutex);
+	return 0;
+}
+
+void socket_fault_clear_all(void)
+{
+	thread_once(&faults_once, _faults_init);
+	mutex_lock(&faults_mutex);
+	while (faults) {
+		struct socket_fault *next = faults->next;
+		free(faults);
+		faults = next;
+	}
+	faults_active = 0;
+	mutex_unlock(&faults_mutex);
+}
 
 #ifdef _WIN32
 static ALWAYS_INLINE int WSAError_to_errno(int wsaerr)
@@ -218,76 +865,159 @@ static ALWAYS_INLINE int WSAError_to_errno(int wsaerr)
 }
 #endif
 
-// timeout of -1 means infinity
-static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int timeout)
+static int _socket_set_nonblocking(int fd)
 {
-#ifdef HAVE_POLL
-	// https://man7.org/linux/man-pages/man2/select.2.html
-	// Correspondence between select() and poll() notifications
-	// #define POLLIN_SET  (EPOLLRDNORM | EPOLLRDBAND | EPOLLIN |
-	//                      EPOLLHUP | EPOLLERR)
-	//                    /* Ready for reading */
-	// #define POLLOUT_SET (EPOLLWRBAND | EPOLLWRNORM | EPOLLOUT |
-	//                      EPOLLERR)
-	//                    /* Ready for writing */
-	// #define POLLEX_SET  (EPOLLPRI)
-	//                    /* Exceptional condition */
-
-	short events;
-	switch (mode) {
-		case FDM_READ:
-			events = POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
-			break;
-		case FDM_WRITE:
-			events = POLLWRBAND | POLLWRNORM | POLLOUT | POLLERR;
-			break;
-		case FDM_EXCEPT:
-			events = POLLPRI;
-			break;
-		default:
-			SOCKET_ERR(2, "%s: fd_mode %d unsupported\n", __func__, mode);
-			return poll_status_error;
+#ifdef _WIN32
+	u_long l_yes = 1;
+	if (ioctlsocket(fd, FIONBIO, &l_yes) != 0) {
+		errno = WSAError_to_errno(WSAGetLastError());
+		return -1;
+	}
+	return 0;
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static int _socket_errno(void)
+{
+#ifdef _WIN32
+	errno = WSAError_to_errno(WSAGetLastError());
+#endif
+	return errno;
+}
+
+#ifdef HAVE_SOCKET_LOOP
+// https://man7.org/linux/man-pages/man2/select.2.html
+// Correspondence between select() and poll() notifications
+// #define POLLIN_SET  (EPOLLRDNORM | EPOLLRDBAND | EPOLLIN |
+//                      EPOLLHUP | EPOLLERR)
+//                    /* Ready for reading */
+// #define POLLOUT_SET (EPOLLWRBAND | EPOLLWRNORM | EPOLLOUT |
+//                      EPOLLERR)
+//                    /* Ready for writing */
+// #define POLLEX_SET  (EPOLLPRI)
+//                    /* Exceptional condition */
+static ALWAYS_INLINE short fd_mode_to_poll_events(fd_mode mode)
+{
+	switch (mode) {
+		case FDM_READ:
+			return POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
+		case FDM_WRITE:
+			return POLLWRBAND | POLLWRNORM | POLLOUT | POLLERR;
+		case FDM_EXCEPT:
+			return POLLPRI;
+		default:
+			break;
+	}
+	return 0;
+}
+
+static ALWAYS_INLINE short fd_events_to_poll_events(unsigned int fde)
+{
+	short events = 0;
+	if (fde & FDE_READ)
+		events |= fd_mode_to_poll_events(FDM_READ);
+	if (fde & FDE_WRITE)
+		events |= fd_mode_to_poll_events(FDM_WRITE);
+	if (fde & FDE_EXCEPT)
+		events |= fd_mode_to_poll_events(FDM_EXCEPT);
+#ifndef HAVE_POLL
+	/* WSAPoll() rejects anything else as requested events */
+	events &= (POLLRDNORM | POLLWRNORM);
+#endif
+	return events;
+}
+
+static ALWAYS_INLINE unsigned int poll_events_to_fd_events(short revents)
+{
+	unsigned int fde = 0;
+	if (revents & (POLLIN | POLLRDNORM | POLLRDBAND))
+		fde |= FDE_READ;
+	if (revents & (POLLOUT | POLLWRNORM | POLLWRBAND))
+		fde |= FDE_WRITE;
+	if (revents & POLLPRI)
+		fde |= FDE_EXCEPT;
+	if (revents & POLLHUP)
+		fde |= FDE_HUP;
+	if (revents & (POLLERR | POLLNVAL))
+		fde |= FDE_ERROR;
+	return fde;
+}
+#endif
+
+// timeout of -1 means infinity
+static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int timeout)
+{
+	struct socket_cancel *cancel = thread_cancel_token;
+	if (cancel && ATOMIC_LOAD_INT(&cancel->triggered)) {
+		return poll_status_cancelled;
+	}
+#ifdef HAVE_POLL
+	short events = fd_mode_to_poll_events(mode);
+	if (events == 0) {
+		SOCKET_ERR(2, "%s: fd_mode %d unsupported\n", __func__, mode);
+		return poll_status_error;
 	}
 	while (1) {
-		struct pollfd pfd = {
-			.fd = fd,
-			.events = events,
+		struct pollfd pfd[2] = {
+			{ .fd = fd, .events = events },
+			{ .fd = (cancel) ? cancel->rfd : -1, .events = POLLIN },
 		};
-		switch (poll(&pfd, 1, timeout)) {
-			case 1:
-				if((pfd.revents & (POLLNVAL | POLLERR)) != 0)
-				{
-					SOCKET_ERR(2, "%s: poll unexpected events: %d\n", __func__, (int)pfd.revents);
-					return poll_status_error;
-				}
-				return poll_status_success;
-			case 0:
-				return poll_status_timeout;
-			case -1:
-				if(errno == EINTR)
-				{
-					SOCKET_ERR(2, "%s: EINTR\n", __func__);
-					continue;
-				}
-				// fallthrough
-			default:
-				SOCKET_ERR(2, "%s: poll failed: %s\n", __func__, strerror(errno));
+		int res = poll(pfd, (cancel) ? 2 : 1, timeout);
+		if (res > 0) {
+			if (pfd[1].revents != 0) {
+				SOCKET_ERR(3, "%s: fd=%d wait cancelled\n", __func__, fd);
+				return poll_status_cancelled;
+			}
+			if((pfd[0].revents & (POLLNVAL | POLLERR)) != 0)
+			{
+				SOCKET_ERR(2, "%s: poll unexpected events: %d\n", __func__, (int)pfd[0].revents);
 				return poll_status_error;
+			}
+			return poll_status_success;
+		} else if (res == 0) {
+			return poll_status_timeout;
+		}
+		if(errno == EINTR)
+		{
+			SOCKET_ERR(2, "%s: EINTR\n", __func__);
+			if (stats_enabled) {
+				_socket_stats_count(fd, EINTR);
+			}
+			continue;
 		}
+		SOCKET_ERR(2, "%s: poll failed: %s\n", __func__, strerror(errno));
+		return poll_status_error;
 	}
 #else
 	fd_set fds;
+	fd_set cfds;
+	fd_set *rfds;
 	int sret;
 	int eagain;
+	int maxfd = fd;
 	struct timeval to;
 	struct timeval *pto;
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-
 	sret = poll_status_error;
 
 	do {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		rfds = NULL;
+		if (cancel) {
+			FD_ZERO(&cfds);
+			FD_SET(cancel->rfd, &cfds);
+			if (cancel->rfd > maxfd) {
+				maxfd = cancel->rfd;
+			}
+			rfds = &cfds;
+		}
 		if (timeout > 0) {
 			to.tv_sec = (time_t) (timeout / 1000);
 			to.tv_usec = (time_t) ((timeout - (to.tv_sec * 1000)) * 1000);
@@ -298,20 +1028,28 @@ static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int tim
 		eagain = 0;
 		switch (mode) {
 		case FDM_READ:
-			sret = select(fd + 1, &fds, NULL, NULL, pto);
+			if (cancel) {
+				FD_SET(cancel->rfd, &fds);
+			}
+			sret = select(maxfd + 1, &fds, NULL, NULL, pto);
+			rfds = &fds;
 			break;
 		case FDM_WRITE:
-			sret = select(fd + 1, NULL, &fds, NULL, pto);
+			sret = select(maxfd + 1, rfds, &fds, NULL, pto);
 			break;
 		case FDM_EXCEPT:
-			sret = select(fd + 1, NULL, NULL, &fds, pto);
+			sret = select(maxfd + 1, rfds, NULL, &fds, pto);
 			break;
 		default:
 			SOCKET_ERR(2, "%s: fd_mode %d unsupported\n", __func__, mode);
 			return poll_status_error;
 		}
 
-		if (sret == 1) {
+		if (sret > 0) {
+			if (cancel && FD_ISSET(cancel->rfd, rfds)) {
+				SOCKET_ERR(3, "%s: fd=%d wait cancelled\n", __func__, fd);
+				return poll_status_cancelled;
+			}
 			return poll_status_success;
 		} else if (sret == 0) {
 			return poll_status_timeout;
@@ -339,8 +1077,520 @@ static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int tim
 #endif
 }
 
+#ifdef HAVE_IO_URING
+/* Minimal per-thread io_uring used to replace poll() + recv()/send() with a
+ * single io_uring_enter() call. The operation is linked to a timeout which
+ * takes over the role of the poll() timeout. */
+struct uring_ctx {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+#define URING_ENTRIES 8
+#define URING_UDATA_OP 1
+#define URING_UDATA_TIMEOUT 2
+#define URING_UDATA_CANCEL 3
+
+/* set once io_uring turned out to be unusable process-wide */
+static int uring_unavailable = 0;
+/* set once the kernel's opcode support was checked */
+static int uring_probed = 0;
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+/* stored as the thread's context when setting up a ring failed for this
+ * thread only (e.g. fd or locked memory limits), so it isn't retried on
+ * every call */
+static struct uring_ctx uring_ctx_failed;
+
+static void _uring_ctx_free(void *data)
+{
+	struct uring_ctx *ctx = (struct uring_ctx*)data;
+	if (!ctx || ctx == &uring_ctx_failed) {
+		return;
+	}
+	if (ctx->sqes && ctx->sqes != MAP_FAILED) {
+		munmap(ctx->sqes, ctx->sqes_size);
+	}
+	if (ctx->cq_ring && ctx->cq_ring != MAP_FAILED && ctx->cq_ring != ctx->sq_ring) {
+		munmap(ctx->cq_ring, ctx->cq_ring_size);
+	}
+	if (ctx->sq_ring && ctx->sq_ring != MAP_FAILED) {
+		munmap(ctx->sq_ring, ctx->sq_ring_size);
+	}
+	if (ctx->fd >= 0) {
+		close(ctx->fd);
+	}
+	free(ctx);
+}
+
+static void _uring_key_init(void)
+{
+	if (pthread_key_create(&uring_key, _uring_ctx_free) != 0) {
+		ATOMIC_STORE_INT(&uring_unavailable, 1);
+	}
+}
+
+static int _uring_enabled(void)
+{
+	return ATOMIC_LOAD_INT(&io_backend) == SOCKET_IO_BACKEND_IO_URING && !ATOMIC_LOAD_INT(&uring_unavailable);
+}
+
+static struct uring_ctx* _uring_ctx_fail(struct uring_ctx *ctx)
+{
+	_uring_ctx_free(ctx);
+	pthread_setspecific(uring_key, &uring_ctx_failed);
+	return NULL;
+}
+
+/* opcodes _uring_sock_op() and _uring_drain() submit */
+static const uint8_t uring_required_ops[] = {
+	IORING_OP_RECV,
+	IORING_OP_SEND,
+	IORING_OP_RECVMSG,
+	IORING_OP_SENDMSG,
+	IORING_OP_LINK_TIMEOUT,
+	IORING_OP_ASYNC_CANCEL
+};
+
+/* Returns 1 if the kernel supports every opcode we submit. Only called
+ * once per process, so that later -EINVAL results of individual operations
+ * can be passed to the caller as they are. */
+static int _uring_probe(int ring_fd)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, size);
+	unsigned int i;
+	int res = 1;
+
+	if (!probe) {
+		return 0;
+	}
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		/* kernel predates IORING_REGISTER_PROBE, and IORING_OP_SEND/RECV */
+		SOCKET_ERR(2, "%s: io_uring_register: %s, falling back to poll\n", __func__, strerror(errno));
+		free(probe);
+		return 0;
+	}
+	for (i = 0; i < sizeof(uring_required_ops) / sizeof(uring_required_ops[0]); i++) {
+		uint8_t op = uring_required_ops[i];
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			SOCKET_ERR(2, "%s: io_uring opcode %d unsupported, falling back to poll\n", __func__, op);
+			res = 0;
+			break;
+		}
+	}
+	free(probe);
+	return res;
+}
+
+static struct uring_ctx* _uring_ctx_get(void)
+{
+	struct uring_ctx *ctx;
+	struct io_uring_params params;
+
+	pthread_once(&uring_key_once, _uring_key_init);
+	if (ATOMIC_LOAD_INT(&uring_unavailable)) {
+		return NULL;
+	}
+	ctx = (struct uring_ctx*)pthread_getspecific(uring_key);
+	if (ctx) {
+		return (ctx == &uring_ctx_failed) ? NULL : ctx;
+	}
+
+	ctx = (struct uring_ctx*)calloc(1, sizeof(struct uring_ctx));
+	if (!ctx) {
+		return NULL;
+	}
+	memset(&params, 0, sizeof(params));
+	ctx->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ctx->fd < 0) {
+		SOCKET_ERR(2, "%s: io_uring_setup: %s, falling back to poll\n", __func__, strerror(errno));
+		if (errno == ENOSYS || errno == EPERM || errno == EINVAL) {
+			ATOMIC_STORE_INT(&uring_unavailable, 1);
+		}
+		ctx->fd = -1;
+		return _uring_ctx_fail(ctx);
+	}
+	if (!(params.features & IORING_FEAT_NODROP)) {
+		/* kernel is too old to support everything we need */
+		ATOMIC_STORE_INT(&uring_unavailable, 1);
+		return _uring_ctx_fail(ctx);
+	}
+	if (!ATOMIC_LOAD_INT(&uring_probed)) {
+		if (!_uring_probe(ctx->fd)) {
+			ATOMIC_STORE_INT(&uring_unavailable, 1);
+			return _uring_ctx_fail(ctx);
+		}
+		ATOMIC_STORE_INT(&uring_probed, 1);
+	}
+
+	ctx->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ctx->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ctx->cq_ring_size > ctx->sq_ring_size) {
+			ctx->sq_ring_size = ctx->cq_ring_size;
+		}
+		ctx->cq_ring_size = ctx->sq_ring_size;
+	}
+	ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_SQ_RING);
+	if (ctx->sq_ring == MAP_FAILED) {
+		return _uring_ctx_fail(ctx);
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ctx->cq_ring = ctx->sq_ring;
+	} else {
+		ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_CQ_RING);
+		if (ctx->cq_ring == MAP_FAILED) {
+			return _uring_ctx_fail(ctx);
+		}
+	}
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = (struct io_uring_sqe*)mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_SQES);
+	if (ctx->sqes == MAP_FAILED) {
+		return _uring_ctx_fail(ctx);
+	}
+
+	ctx->sq_head = (unsigned int*)((char*)ctx->sq_ring + params.sq_off.head);
+	ctx->sq_tail = (unsigned int*)((char*)ctx->sq_ring + params.sq_off.tail);
+	ctx->sq_mask = (unsigned int*)((char*)ctx->sq_ring + params.sq_off.ring_mask);
+	ctx->sq_array = (unsigned int*)((char*)ctx->sq_ring + params.sq_off.array);
+	ctx->cq_head = (unsigned int*)((char*)ctx->cq_ring + params.cq_off.head);
+	ctx->cq_tail = (unsigned int*)((char*)ctx->cq_ring + params.cq_off.tail);
+	ctx->cq_mask = (unsigned int*)((char*)ctx->cq_ring + params.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe*)((char*)ctx->cq_ring + params.cq_off.cqes);
+
+	pthread_setspecific(uring_key, ctx);
+	return ctx;
+}
+
+static struct io_uring_sqe* _uring_get_sqe(struct uring_ctx *ctx, unsigned int *tail)
+{
+	unsigned int index = *tail & *ctx->sq_mask;
+	struct io_uring_sqe *sqe = &ctx->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ctx->sq_array[index] = index;
+	(*tail)++;
+	return sqe;
+}
+
+/* Consumes available completions, counting down *pending for the
+ * operation and its linked timeout. */
+static void _uring_reap(struct uring_ctx *ctx, unsigned int *pending, int *op_res, int *timed_out)
+{
+	unsigned int head = *ctx->cq_head;
+	unsigned int cq_tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != cq_tail) {
+		struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask];
+		if (cqe->user_data == URING_UDATA_OP) {
+			*op_res = cqe->res;
+			(*pending)--;
+		} else if (cqe->user_data == URING_UDATA_TIMEOUT) {
+			if (cqe->res == -ETIME) {
+				*timed_out = 1;
+			}
+			(*pending)--;
+		}
+		head++;
+	}
+	__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Called when io_uring_enter() fails while the operation is in flight. The
+ * kernel may still write into the caller's buffer, so cancel the operation
+ * and wait until all of its completions have been reaped before the caller
+ * gets control back. */
+static void _uring_drain(struct uring_ctx *ctx, unsigned int *pending, int *op_res, int *timed_out)
+{
+	unsigned int tail = *ctx->sq_tail;
+	struct io_uring_sqe *sqe = _uring_get_sqe(ctx, &tail);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = URING_UDATA_OP;
+	sqe->user_data = URING_UDATA_CANCEL;
+	__atomic_store_n(ctx->sq_tail, tail, __ATOMIC_RELEASE);
+
+	unsigned int to_submit = 1;
+	while (*pending > 0) {
+		int res = (int)syscall(__NR_io_uring_enter, ctx->fd, to_submit, *pending, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res >= 0) {
+			to_submit = 0;
+		} else if (errno != EINTR) {
+			/* wait for the ring to post completions instead */
+			struct pollfd pfd;
+			pfd.fd = ctx->fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			poll(&pfd, 1, 100);
+		}
+		_uring_reap(ctx, pending, op_res, timed_out);
+	}
+}
+
+/* Returns the result of the operation (as negative errno on failure),
+ * -ETIMEDOUT if the linked timeout expired, or -EAGAIN if the caller
+ * should fall back to the poll() path. */
+static int _uring_sock_op(int fd, uint8_t opcode, void *data, size_t length, int flags, int timeout)
+{
+	if (thread_cancel_token) {
+		/* cancellable waits go through poll_wrapper */
+		return -EAGAIN;
+	}
+	struct uring_ctx *ctx = _uring_ctx_get();
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	unsigned int to_submit = 1;
+	unsigned int pending;
+	int op_res = -EAGAIN;
+	int timed_out = 0;
+
+	if (!ctx) {
+		return -EAGAIN;
+	}
+
+	unsigned int tail = *ctx->sq_tail;
+	sqe = _uring_get_sqe(ctx, &tail);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)length;
+	sqe->msg_flags = (uint32_t)flags;
+	sqe->user_data = URING_UDATA_OP;
+	if (timeout >= 0) {
+		sqe->flags |= IOSQE_IO_LINK;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		sqe = _uring_get_sqe(ctx, &tail);
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->user_data = URING_UDATA_TIMEOUT;
+		to_submit = 2;
+	}
+	__atomic_store_n(ctx->sq_tail, tail, __ATOMIC_RELEASE);
+
+	pending = to_submit;
+	while (pending > 0) {
+		int res = (int)syscall(__NR_io_uring_enter, ctx->fd, to_submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				if (to_submit > 0 && *ctx->sq_head == tail) {
+					to_submit = 0;
+				}
+				continue;
+			}
+			SOCKET_ERR(2, "%s: io_uring_enter: %s\n", __func__, strerror(errno));
+			if (to_submit > 0) {
+				/* nothing was submitted, rewind */
+				__atomic_store_n(ctx->sq_tail, tail - to_submit, __ATOMIC_RELEASE);
+				return -EAGAIN;
+			}
+			_uring_drain(ctx, &pending, &op_res, &timed_out);
+			/* nothing is in flight any more; don't reuse this ring */
+			_uring_ctx_fail(ctx);
+			/* if the operation was cancelled nothing was transferred */
+			return (op_res == -ECANCELED) ? -EAGAIN : op_res;
+		}
+		to_submit = 0;
+		_uring_reap(ctx, &pending, &op_res, &timed_out);
+	}
+
+	if (op_res == -ECANCELED && timed_out) {
+		return -ETIMEDOUT;
+	}
+	/* opcode support was probed at setup, so errors belong to the call */
+	return op_res;
+}
+#endif
+
+int socket_set_io_backend(enum socket_io_backend backend)
+{
+	switch (backend) {
+		case SOCKET_IO_BACKEND_POLL:
+			ATOMIC_STORE_INT(&io_backend, backend);
+			return 0;
+		case SOCKET_IO_BACKEND_IO_URING:
+#ifdef HAVE_IO_URING
+			if (!ATOMIC_LOAD_INT(&uring_unavailable)) {
+				ATOMIC_STORE_INT(&io_backend, backend);
+				return 0;
+			}
+#endif
+			return -ENOTSUP;
+		default:
+			break;
+	}
+	return -EINVAL;
+}
+
+enum socket_io_backend socket_get_io_backend(void)
+{
+#ifdef HAVE_IO_URING
+	if (!_uring_enabled()) {
+		return SOCKET_IO_BACKEND_POLL;
+	}
+#endif
+	return ATOMIC_LOAD_INT(&io_backend);
+}
+
+static const struct socket_options socket_connect_default_options = {
+	.flags = SOCKET_OPT_NODELAY,
+	.sndbuf = 0x20000,
+	.rcvbuf = 0x20000,
+};
+
+void socket_options_init(struct socket_options *opts, enum socket_options_profile profile)
+{
+	if (!opts) {
+		return;
+	}
+	memset(opts, 0, sizeof(struct socket_options));
+	switch (profile) {
+		case SOCKET_OPTIONS_PROFILE_DEFAULT:
+			*opts = socket_connect_default_options;
+			break;
+		case SOCKET_OPTIONS_PROFILE_LATENCY:
+			opts->flags = SOCKET_OPT_NODELAY | SOCKET_OPT_QUICKACK;
+			opts->busy_poll = 50;
+			opts->notsent_lowat = 0x4000;
+			break;
+		case SOCKET_OPTIONS_PROFILE_BULK:
+			opts->flags = SOCKET_OPT_NODELAY_OFF;
+			opts->sndbuf = 0x400000;
+			opts->rcvbuf = 0x400000;
+			break;
+		case SOCKET_OPTIONS_PROFILE_SYSTEM:
+		default:
+			break;
+	}
+}
+
+static int _socket_setsockopt_int(int fd, int level, int name, int value, const char *desc)
+{
+	if (setsockopt(fd, level, name, (void*)&value, sizeof(int)) == -1) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		SOCKET_ERR(1, "Could not set %s on socket: %s\n", desc, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int socket_set_options(int fd, const struct socket_options *opts)
+{
+	int res = 0;
+	int err = 0;
+
+	if (fd < 0 || !opts) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#define APPLY_OPT(level, name, value, desc) \
+	if (_socket_setsockopt_int(fd, level, name, value, desc) < 0) { \
+		res = -1; \
+		err = errno; \
+	}
+
+	if (opts->flags & SOCKET_OPT_NODELAY) {
+		APPLY_OPT(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	} else if (opts->flags & SOCKET_OPT_NODELAY_OFF) {
+		APPLY_OPT(IPPROTO_TCP, TCP_NODELAY, 0, "TCP_NODELAY");
+	}
+	if (opts->flags & SOCKET_OPT_CORK) {
+#if defined(TCP_CORK)
+		APPLY_OPT(IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK");
+#elif defined(TCP_NOPUSH)
+		APPLY_OPT(IPPROTO_TCP, TCP_NOPUSH, 1, "TCP_NOPUSH");
+#else
+		SOCKET_ERR(2, "%s: TCP_CORK not supported on this platform\n", __func__);
+#endif
+	}
+	if (opts->flags & SOCKET_OPT_QUICKACK) {
+#ifdef TCP_QUICKACK
+		APPLY_OPT(IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+#else
+		SOCKET_ERR(2, "%s: TCP_QUICKACK not supported on this platform\n", __func__);
+#endif
+	}
+	if (opts->sndbuf > 0) {
+		APPLY_OPT(SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "send buffer");
+	}
+	if (opts->rcvbuf > 0) {
+		APPLY_OPT(SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "receive buffer");
+	}
+	if (opts->busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+		APPLY_OPT(SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll, "SO_BUSY_POLL");
+#else
+		SOCKET_ERR(2, "%s: SO_BUSY_POLL not supported on this platform\n", __func__);
+#endif
+	}
+	if (opts->flags & SOCKET_OPT_KEEPALIVE) {
+		APPLY_OPT(SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#if defined(TCP_KEEPIDLE)
+		if (opts->keepalive_idle > 0) {
+			APPLY_OPT(IPPROTO_TCP, TCP_KEEPIDLE, opts->keepalive_idle, "TCP_KEEPIDLE");
+		}
+#elif defined(TCP_KEEPALIVE)
+		if (opts->keepalive_idle > 0) {
+			APPLY_OPT(IPPROTO_TCP, TCP_KEEPALIVE, opts->keepalive_idle, "TCP_KEEPALIVE");
+		}
+#endif
+#ifdef TCP_KEEPINTVL
+		if (opts->keepalive_interval > 0) {
+			APPLY_OPT(IPPROTO_TCP, TCP_KEEPINTVL, opts->keepalive_interval, "TCP_KEEPINTVL");
+		}
+#endif
+#ifdef TCP_KEEPCNT
+		if (opts->keepalive_count > 0) {
+			APPLY_OPT(IPPROTO_TCP, TCP_KEEPCNT, opts->keepalive_count, "TCP_KEEPCNT");
+		}
+#endif
+	}
+	if (opts->user_timeout > 0) {
+#ifdef TCP_USER_TIMEOUT
+		APPLY_OPT(IPPROTO_TCP, TCP_USER_TIMEOUT, opts->user_timeout, "TCP_USER_TIMEOUT");
+#else
+		SOCKET_ERR(2, "%s: TCP_USER_TIMEOUT not supported on this platform\n", __func__);
+#endif
+	}
+	if (opts->notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+		APPLY_OPT(IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts->notsent_lowat, "TCP_NOTSENT_LOWAT");
+#else
+		SOCKET_ERR(2, "%s: TCP_NOTSENT_LOWAT not supported on this platform\n", __func__);
+#endif
+	}
+#undef APPLY_OPT
+
+	if (res < 0) {
+		errno = err;
+	}
+	return res;
+}
+
 #ifndef _WIN32
 int socket_create_unix(const char *filename)
+{
+	return socket_create_unix_ex(filename, SOCK_STREAM);
+}
+
+int socket_create_unix_ex(const char *filename, int type)
 {
 	struct sockaddr_un name;
 	int sock;
@@ -348,11 +1598,16 @@ int socket_create_unix(const char *filename)
 	int yes = 1;
 #endif
 
+	if (type != SOCK_STREAM && type != SOCK_SEQPACKET) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	// remove if still present
 	unlink(filename);
 
 	/* Create the socket. */
-	sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	sock = socket(PF_UNIX, type, 0);
 	if (sock < 0) {
 		SOCKET_ERR(1, "socket(): %s\n", strerror(errno));
 		return -1;
@@ -386,6 +1641,11 @@ int socket_create_unix(const char *filename)
 }
 
 int socket_connect_unix(const char *filename)
+{
+	return socket_connect_unix_ex(filename, SOCK_STREAM);
+}
+
+int socket_connect_unix_ex(const char *filename, int type)
 {
 	struct sockaddr_un name;
 	int sfd = -1;
@@ -395,6 +1655,11 @@ int socket_connect_unix(const char *filename)
 #endif
 	int bufsize = 0x20000;
 
+	if (type != SOCK_STREAM && type != SOCK_SEQPACKET) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	// check if socket file exists...
 	if (stat(filename, &fst) != 0) {
 		SOCKET_ERR(2, "%s: stat '%s': %s\n", __func__, filename, strerror(errno));
@@ -406,7 +1671,7 @@ int socket_connect_unix(const char *filename)
 		return -1;
 	}
 	// make a new socket
-	if ((sfd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+	if ((sfd = socket(PF_UNIX, type, 0)) < 0) {
 		SOCKET_ERR(2, "%s: socket: %s\n", __func__, strerror(errno));
 		return -1;
 	}
@@ -468,28 +1733,490 @@ int socket_connect_unix(const char *filename)
 
 	return sfd;
 }
-#endif
 
-int socket_create(const char* addr, uint16_t port)
+int socket_send_fds(int fd, const void *data, size_t length, const int *fds, unsigned int num_fds)
 {
-	int sfd = -1;
-	int yes = 1;
-	int no = 0;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	char portstr[8];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	char dummy = 0;
+	int flags = 0;
 	int res;
 
-	memset(&hints, '\0', sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-	hints.ai_protocol = IPPROTO_TCP;
-
-	snprintf(portstr, 8, "%d", port);
-
-	res = getaddrinfo(addr, portstr, &hints, &result);
-	if (res != 0) {
+	if (fd < 0 || (!fds && num_fds > 0) || num_fds > SOCKET_MAX_FDS || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	if (length == 1 && num_fds > 0) {
+		/* indistinguishable from a descriptors-only message */
+		return -EINVAL;
+	}
+	if (length == 0 && num_fds == 0) {
+		/* nothing to send; don't put a stray filler byte on the stream */
+		return 0;
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	/* a stream socket needs at least one byte to carry the control message */
+	if (length == 0) {
+		data = &dummy;
+		length = 1;
+	}
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (num_fds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	res = socket_check_fd(fd, FDM_WRITE, SEND_TIMEOUT);
+	if (res <= 0) {
+		return res;
+	}
+	do {
+		res = (int)sendmsg(fd, &msg, flags);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		SOCKET_ERR(2, "%s: fd=%d sendmsg: %s\n", __func__, fd, strerror(errno));
+		return -errno;
+	}
+	return (data == &dummy) ? 0 : res;
+}
+
+int socket_receive_fds(int fd, void *data, size_t length, int *fds, unsigned int *num_fds, unsigned int timeout)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char dummy;
+	int flags = 0;
+	unsigned int max_fds;
+	unsigned int count = 0;
+	int res;
+
+	if (fd < 0 || !fds || !num_fds || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	max_fds = (*num_fds > SOCKET_MAX_FDS) ? SOCKET_MAX_FDS : *num_fds;
+	*num_fds = 0;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	if (length == 0) {
+		data = &dummy;
+		length = 1;
+	}
+	iov.iov_base = data;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (max_fds > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * max_fds);
+	}
+
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		return res;
+	}
+	do {
+		res = (int)recvmsg(fd, &msg, flags);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		return -errno;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		unsigned int n = (unsigned int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		unsigned int i;
+		for (i = 0; i < n; i++) {
+			int rfd;
+			memcpy(&rfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (count < max_fds) {
+				fds[count++] = rfd;
+			} else {
+				close(rfd);
+			}
+		}
+	}
+#ifndef MSG_CMSG_CLOEXEC
+	for (unsigned int i = 0; i < count; i++) {
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	*num_fds = count;
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		SOCKET_ERR(1, "%s: fd=%d control data truncated, some descriptors were dropped\n", __func__, fd);
+	}
+	if (msg.msg_flags & MSG_TRUNC) {
+		/* message boundary lost on a SOCK_SEQPACKET socket */
+		while (count > 0) {
+			close(fds[--count]);
+		}
+		*num_fds = 0;
+		return -EMSGSIZE;
+	}
+	if (res == 0) {
+		if (count > 0) {
+			return 0;
+		}
+		SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	if (data == &dummy) {
+		return 0;
+	}
+	if (res == 1 && count > 0 && length > 1) {
+		/* the filler byte of a descriptors-only message */
+		return 0;
+	}
+	return res;
+}
+#endif
+
+#define RESOLVER_CACHE_BUCKETS 64
+#define RESOLVER_CACHE_MAX_ENTRIES 256
+#define RESOLVER_CACHE_TTL 30000
+#define RESOLVER_CACHE_NEGATIVE_TTL 5000
+
+struct resolver_cache_entry {
+	struct resolver_cache_entry *next;
+	char *host;
+	uint16_t port;
+	int family;
+	int flags;
+	int error;
+	uint64_t expires;
+	struct addrinfo *result;
+};
+
+static struct resolver_cache_entry *resolver_cache[RESOLVER_CACHE_BUCKETS];
+static unsigned int resolver_cache_count = 0;
+static unsigned int resolver_cache_ttl = RESOLVER_CACHE_TTL;
+static unsigned int resolver_cache_negative_ttl = RESOLVER_CACHE_NEGATIVE_TTL;
+static mutex_t resolver_mutex;
+static thread_once_t resolver_once = THREAD_ONCE_INIT;
+
+static void _resolver_init(void)
+{
+	mutex_init(&resolver_mutex);
+}
+
+static void _addrinfo_copy_free(struct addrinfo *ai)
+{
+	while (ai) {
+		struct addrinfo *next = ai->ai_next;
+		free(ai);
+		ai = next;
+	}
+}
+
+/* Deep copy of an addrinfo list; each node and its address share one
+ * allocation. ai_canonname is not preserved. */
+static struct addrinfo* _addrinfo_copy(const struct addrinfo *src)
+{
+	struct addrinfo *head = NULL;
+	struct addrinfo **tail = &head;
+	for (; src; src = src->ai_next) {
+		struct addrinfo *ai = (struct addrinfo*)malloc(sizeof(struct addrinfo) + src->ai_addrlen);
+		if (!ai) {
+			_addrinfo_copy_free(head);
+			return NULL;
+		}
+		memcpy(ai, src, sizeof(struct addrinfo));
+		ai->ai_addr = (struct sockaddr*)(ai + 1);
+		memcpy(ai->ai_addr, src->ai_addr, src->ai_addrlen);
+		ai->ai_canonname = NULL;
+		ai->ai_next = NULL;
+		*tail = ai;
+		tail = &ai->ai_next;
+	}
+	return head;
+}
+
+static unsigned int _resolver_hash(const char *host, uint16_t port, int family, int flags)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	const char *p = (host) ? host : "";
+	while (*p) {
+		h = (h ^ (unsigned char)*p++) * 16777619u;
+	}
+	h = (h ^ port) * 16777619u;
+	h = (h ^ (uint32_t)family) * 16777619u;
+	h = (h ^ (uint32_t)flags) * 16777619u;
+	return h % RESOLVER_CACHE_BUCKETS;
+}
+
+static void _resolver_entry_free(struct resolver_cache_entry *entry)
+{
+	free(entry->host);
+	_addrinfo_copy_free(entry->result);
+	free(entry);
+}
+
+/* must be called with resolver_mutex held */
+static void _resolver_cache_evict(uint64_t now)
+{
+	struct resolver_cache_entry *oldest = NULL;
+	struct resolver_cache_entry **oldest_link = NULL;
+	unsigned int i;
+	for (i = 0; i < RESOLVER_CACHE_BUCKETS; i++) {
+		struct resolver_cache_entry **link = &resolver_cache[i];
+		while (*link) {
+			struct resolver_cache_entry *entry = *link;
+			if (entry->expires <= now) {
+				*link = entry->next;
+				_resolver_entry_free(entry);
+				resolver_cache_count--;
+				continue;
+			}
+			if (!oldest || entry->expires < oldest->expires) {
+				oldest = entry;
+				oldest_link = link;
+			}
+			link = &entry->next;
+		}
+	}
+	if (resolver_cache_count >= RESOLVER_CACHE_MAX_ENTRIES && oldest) {
+		*oldest_link = oldest->next;
+		_resolver_entry_free(oldest);
+		resolver_cache_count--;
+	}
+}
+
+/* getaddrinfo() through the resolver cache. The result must be released
+ * with _addrinfo_copy_free(). Returns 0 or a getaddrinfo() error code. */
+static int _resolver_getaddrinfo(const char *host, uint16_t port, const struct addrinfo *hints, struct addrinfo **result)
+{
+	char portstr[8];
+	struct addrinfo *res = NULL;
+	int err;
+	uint64_t now = _monotonic_ms();
+	unsigned int bucket = _resolver_hash(host, port, hints->ai_family, hints->ai_flags);
+	struct resolver_cache_entry *entry;
+	unsigned int ttl, negative_ttl;
+
+	thread_once(&resolver_once, _resolver_init);
+
+	*result = NULL;
+	mutex_lock(&resolver_mutex);
+	ttl = resolver_cache_ttl;
+	negative_ttl = resolver_cache_negative_ttl;
+	for (entry = resolver_cache[bucket]; entry; entry = entry->next) {
+		if (entry->port == port && entry->family == hints->ai_family && entry->flags == hints->ai_flags
+		    && ((!host && !entry->host) || (host && entry->host && !strcmp(host, entry->host)))) {
+			break;
+		}
+	}
+	if (entry && entry->expires > now) {
+		err = entry->error;
+		if (err == 0) {
+			*result = _addrinfo_copy(entry->result);
+			if (!*result) {
+				err = EAI_MEMORY;
+			}
+		}
+		mutex_unlock(&resolver_mutex);
+		return err;
+	}
+	mutex_unlock(&resolver_mutex);
+
+	snprintf(portstr, 8, "%d", port);
+	err = getaddrinfo(host, portstr, hints, &res);
+	if (err == 0) {
+		*result = _addrinfo_copy(res);
+		freeaddrinfo(res);
+		if (!*result) {
+			return EAI_MEMORY;
+		}
+	}
+
+	/* don't cache temporary failures */
+	if (((err == 0) ? ttl : negative_ttl) == 0 || (err != 0 && err != EAI_NONAME
+#ifdef EAI_NODATA
+	    && err != EAI_NODATA
+#endif
+	    )) {
+		return err;
+	}
+
+	struct resolver_cache_entry *newentry = (struct resolver_cache_entry*)calloc(1, sizeof(struct resolver_cache_entry));
+	if (!newentry) {
+		return err;
+	}
+	newentry->host = (host) ? strdup(host) : NULL;
+	newentry->port = port;
+	newentry->family = hints->ai_family;
+	newentry->flags = hints->ai_flags;
+	newentry->error = err;
+	if (err == 0) {
+		newentry->result = _addrinfo_copy(*result);
+		if (!newentry->result) {
+			_resolver_entry_free(newentry);
+			return err;
+		}
+	}
+
+	mutex_lock(&resolver_mutex);
+	/* the TTLs may have changed (or caching been disabled) meanwhile */
+	ttl = (err == 0) ? resolver_cache_ttl : resolver_cache_negative_ttl;
+	if (ttl == 0) {
+		mutex_unlock(&resolver_mutex);
+		_resolver_entry_free(newentry);
+		return err;
+	}
+	newentry->expires = now + ttl;
+	/* replace an existing (expired or concurrently added) entry */
+	struct resolver_cache_entry **link = &resolver_cache[bucket];
+	while (*link) {
+		entry = *link;
+		if (entry->port == port && entry->family == hints->ai_family && entry->flags == hints->ai_flags
+		    && ((!host && !entry->host) || (host && entry->host && !strcmp(host, entry->host)))) {
+			*link = entry->next;
+			_resolver_entry_free(entry);
+			resolver_cache_count--;
+			break;
+		}
+		link = &entry->next;
+	}
+	if (resolver_cache_count >= RESOLVER_CACHE_MAX_ENTRIES) {
+		_resolver_cache_evict(now);
+	}
+	newentry->next = resolver_cache[bucket];
+	resolver_cache[bucket] = newentry;
+	resolver_cache_count++;
+	mutex_unlock(&resolver_mutex);
+
+	return err;
+}
+
+void socket_resolver_cache_flush(void)
+{
+	unsigned int i;
+	thread_once(&resolver_once, _resolver_init);
+	mutex_lock(&resolver_mutex);
+	for (i = 0; i < RESOLVER_CACHE_BUCKETS; i++) {
+		while (resolver_cache[i]) {
+			struct resolver_cache_entry *entry = resolver_cache[i];
+			resolver_cache[i] = entry->next;
+			_resolver_entry_free(entry);
+		}
+	}
+	resolver_cache_count = 0;
+	mutex_unlock(&resolver_mutex);
+}
+
+void socket_resolver_cache_set_ttl(unsigned int ttl_ms, unsigned int negative_ttl_ms)
+{
+	thread_once(&resolver_once, _resolver_init);
+	mutex_lock(&resolver_mutex);
+	resolver_cache_ttl = ttl_ms;
+	resolver_cache_negative_ttl = negative_ttl_ms;
+	mutex_unlock(&resolver_mutex);
+	if (ttl_ms == 0 && negative_ttl_ms == 0) {
+		socket_resolver_cache_flush();
+	}
+}
+
+int socket_pair(int type, int fds[2])
+{
+	if (!fds || (type != SOCK_STREAM && type != SOCK_SEQPACKET)) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef _WIN32
+	/* no socketpair() on Windows; connect through a loopback listener */
+	uint16_t port = 0;
+	if (type != SOCK_STREAM) {
+		errno = EINVAL;
+		return -1;
+	}
+	int lfd = socket_create("127.0.0.1", 0);
+	if (lfd < 0) {
+		return -1;
+	}
+	if (socket_get_socket_port(lfd, &port) < 0) {
+		socket_close(lfd);
+		return -1;
+	}
+	fds[0] = socket_connect("127.0.0.1", port);
+	if (fds[0] < 0) {
+		socket_close(lfd);
+		return -1;
+	}
+	fds[1] = socket_accept(lfd, port);
+	socket_close(lfd);
+	if (fds[1] < 0) {
+		socket_close(fds[0]);
+		return -1;
+	}
+#else
+	int stype = type;
+#ifdef SOCK_CLOEXEC
+	stype |= SOCK_CLOEXEC;
+#endif
+	if (socketpair(AF_UNIX, stype, 0, fds) < 0) {
+		SOCKET_ERR(1, "%s: socketpair: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+#ifdef SO_NOSIGPIPE
+	int yes = 1;
+	setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int));
+	setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int));
+#endif
+#endif
+	return 0;
+}
+
+int socket_create(const char* addr, uint16_t port)
+{
+	return socket_create_ex(addr, port, SOCKET_DEFAULT_BACKLOG, NULL);
+}
+
+int socket_create_with_options(const char* addr, uint16_t port, const struct socket_options *opts)
+{
+	return socket_create_ex(addr, port, SOCKET_DEFAULT_BACKLOG, opts);
+}
+
+static int _socket_create_listener(const char* addr, uint16_t port, int backlog, const struct socket_options *opts, int reuseport)
+{
+	int sfd = -1;
+	int yes = 1;
+	int no = 0;
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+	int res;
+
+	memset(&hints, '\0', sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	res = _resolver_getaddrinfo(addr, port, &hints, &result);
+	if (res != 0) {
 		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
 		return -1;
 	}
@@ -509,6 +2236,14 @@ int socket_create(const char* addr, uint16_t port)
 			continue;
 		}
 
+#ifdef SO_REUSEPORT
+		if (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void*)&yes, sizeof(int)) == -1) {
+			SOCKET_ERR(1, "setsockopt() SO_REUSEPORT: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+#endif
+
 #ifdef SO_NOSIGPIPE
 		if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
 			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
@@ -537,7 +2272,12 @@ int socket_create(const char* addr, uint16_t port)
 			continue;
 		}
 
-		if (listen(sfd, 100) < 0) {
+		if (opts) {
+			/* accepted sockets inherit these from the listening socket */
+			socket_set_options(sfd, opts);
+		}
+
+		if (listen(sfd, (backlog > 0) ? backlog : SOCKET_DEFAULT_BACKLOG) < 0) {
 #ifdef _WIN32
 			errno = WSAError_to_errno(WSAGetLastError());
 #endif
@@ -548,7 +2288,7 @@ int socket_create(const char* addr, uint16_t port)
 		break;
 	}
 
-	freeaddrinfo(result);
+	_addrinfo_copy_free(result);
 
 	if (rp == NULL) {
 		return -1;
@@ -557,6 +2297,11 @@ int socket_create(const char* addr, uint16_t port)
 	return sfd;
 }
 
+int socket_create_ex(const char* addr, uint16_t port, int backlog, const struct socket_options *opts)
+{
+	return _socket_create_listener(addr, port, backlog, opts, 0);
+}
+
 #ifdef AF_INET6
 static uint32_t _in6_addr_scope(struct in6_addr* addr)
 {
@@ -892,87 +2637,189 @@ static int getifaddrs(struct ifaddrs** ifap)
 #endif
 #endif
 
-int get_primary_mac_address(unsigned char mac_addr_buf[6])
+#define IFACE_SCOPE_SLOTS 16
+#define IFACE_CACHE_TTL 5000
+
+/* key kinds of the interface table's hash */
+#define IFACE_KEY_ADDR_SCOPE 1	/* addr is configured on interface scope_id */
+#define IFACE_KEY_SCOPE_IF 2	/* interface scope_id has a non-loopback address of the scope in addr[0] */
+#define IFACE_KEY_ADDR 3	/* addr is configured on interface value */
+
+struct iface6_key {
+	struct in6_addr addr;
+	uint32_t scope_id;
+	uint32_t kind;	/* 0 for an unused slot */
+	uint32_t value;
+};
+
+/* Snapshot of the system's interfaces. IPv6 addresses are hashed by address
+ * and by (scope, interface) so a scope id lookup is a few probes instead of
+ * a walk over the interfaces. */
+struct iface_table {
+	struct iface6_key *keys;
+	unsigned int keys_mask;
+	/* last non-loopback interface with an address of the scope, or -1 */
+	int32_t fallback[IFACE_SCOPE_SLOTS];
+	int have_mac;
+	unsigned char mac[6];
+	uint64_t updated;
+	int valid;
+};
+
+static struct iface_table iface_cache;
+static rwlock_t iface_lock;
+static thread_once_t iface_once = THREAD_ONCE_INIT;
+static int iface_initialized = 0;
+#ifdef __linux__
+static int iface_nl_fd = -1;
+#endif
+
+static void _iface_init(void)
+{
+	rwlock_init(&iface_lock);
+	iface_initialized = 1;
+}
+
+static int _ifaddrs_primary_mac(struct ifaddrs *ifaddr, unsigned char mac_addr_buf[6])
 {
 	int result = -1;
-	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
-	if (getifaddrs(&ifaddr) != -1) {
-		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-			if (ifa->ifa_addr == NULL) {
-				continue;
-			}
-			if ((ifa->ifa_flags & IFF_UP) == 0) {
-				continue;
-			}
-			if (ifa->ifa_flags & IFF_LOOPBACK) {
-				continue;
-			}
+	struct ifaddrs *ifa = NULL;
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL) {
+			continue;
+		}
+		if ((ifa->ifa_flags & IFF_UP) == 0) {
+			continue;
+		}
+		if (ifa->ifa_flags & IFF_LOOPBACK) {
+			continue;
+		}
 #if defined(__APPLE__) || defined (__FreeBSD__) || defined (__HAIKU__)
-			if (ifa->ifa_addr->sa_family != AF_LINK) {
-				continue;
-			}
+		if (ifa->ifa_addr->sa_family != AF_LINK) {
+			continue;
+		}
 #if defined (__APPLE__)
-			if (!strcmp(ifa->ifa_name, "en0")) {
+		if (!strcmp(ifa->ifa_name, "en0")) {
 #elif defined (__FreeBSD__) || defined (__HAIKU__)
-			{
+		{
 #endif
-				memcpy(mac_addr_buf, (unsigned char *)LLADDR((struct sockaddr_dl *)(ifa)->ifa_addr), 6);
-				result = 0;
-				break;
-			}
+			memcpy(mac_addr_buf, (unsigned char *)LLADDR((struct sockaddr_dl *)(ifa)->ifa_addr), 6);
+			result = 0;
+			break;
+		}
 #elif defined (__linux__)
-			if (ifa->ifa_addr->sa_family != AF_PACKET) {
-				continue;
-			}
-			if (strcmp(ifa->ifa_name, "lo") != 0) {
-				memcpy(mac_addr_buf, ((struct sockaddr_ll*)ifa->ifa_addr)->sll_addr, 6);
-				result = 0;
-				break;
-			}
+		if (ifa->ifa_addr->sa_family != AF_PACKET) {
+			continue;
+		}
+		if (strcmp(ifa->ifa_name, "lo") != 0) {
+			memcpy(mac_addr_buf, ((struct sockaddr_ll*)ifa->ifa_addr)->sll_addr, 6);
+			result = 0;
+			break;
+		}
 #elif defined (WIN32)
-			if (ifa->ifa_data) {
-				memcpy(mac_addr_buf, ifa->ifa_data, 6);
-				result = 0;
-				break;
-			}
+		if (ifa->ifa_data) {
+			memcpy(mac_addr_buf, ifa->ifa_data, 6);
+			result = 0;
+			break;
+		}
 #elif defined(__CYGWIN__)
-			if (ifa->ifa_data) {
-				memcpy(mac_addr_buf, ((struct ifaddrs_hwdata *)ifa->ifa_data)->ifa_hwaddr.sa_data, 6);
-				result = 0;
-				break;
-			}
+		if (ifa->ifa_data) {
+			memcpy(mac_addr_buf, ((struct ifaddrs_hwdata *)ifa->ifa_data)->ifa_hwaddr.sa_data, 6);
+			result = 0;
+			break;
+		}
 #else
 #error get_primary_mac_address is not supported on this platform.
 #endif
-		}
-		freeifaddrs(ifaddr);
 	}
 	return result;
 }
 
-static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
+static void _iface_table_clear(struct iface_table *table)
 {
-	int32_t res = -1;
-	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
-	uint32_t addr_scope;
-
-	/* get scope for requested address */
-	addr_scope = _in6_addr_scope(&addr->sin6_addr);
-	if (addr_scope == 0) {
-		/* global scope doesn't need a specific scope id */
-		return addr_scope;
+	unsigned int i;
+	free(table->keys);
+	table->keys = NULL;
+	table->keys_mask = 0;
+	for (i = 0; i < IFACE_SCOPE_SLOTS; i++) {
+		table->fallback[i] = -1;
 	}
+	table->have_mac = 0;
+	table->valid = 0;
+}
 
-	/* get interfaces */
-	if (getifaddrs(&ifaddr) == -1) {
-#ifdef _WIN32
+static struct iface6_key* _iface_table_slot(struct iface_table *table, uint32_t kind, const struct in6_addr *addr, uint32_t scope_id)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+	for (i = 0; i < sizeof(addr->s6_addr); i++) {
+		hash = (hash ^ addr->s6_addr[i]) * 16777619U;
+	}
+	hash = (hash ^ scope_id) * 16777619U;
+	hash = (hash ^ kind) * 16777619U;
+
+	/* the table is never more than half full */
+	for (i = hash & table->keys_mask; ; i = (i + 1) & table->keys_mask) {
+		struct iface6_key *key = &table->keys[i];
+		if (key->kind == 0 || (key->kind == kind && key->scope_id == scope_id && memcmp(&key->addr, addr, sizeof(key->addr)) == 0)) {
+			return key;
+		}
+	}
+}
+
+static void _iface_table_insert(struct iface_table *table, uint32_t kind, const struct in6_addr *addr, uint32_t scope_id, uint32_t value)
+{
+	struct iface6_key *key = _iface_table_slot(table, kind, addr, scope_id);
+	key->addr = *addr;
+	key->scope_id = scope_id;
+	key->kind = kind;
+	key->value = value;
+}
+
+static int _iface_table_lookup(struct iface_table *table, uint32_t kind, const struct in6_addr *addr, uint32_t scope_id, uint32_t *value)
+{
+	struct iface6_key *key = _iface_table_slot(table, kind, addr, scope_id);
+	if (key->kind == 0) {
+		return 0;
+	}
+	if (value) {
+		*value = key->value;
+	}
+	return 1;
+}
+
+static int _iface_table_build(struct iface_table *table)
+{
+	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
+	unsigned int total = 0;
+
+	if (getifaddrs(&ifaddr) == -1) {
+#ifdef _WIN32
 		errno = WSAError_to_errno(WSAGetLastError());
 #endif
 		SOCKET_ERR(1, "getifaddrs(): %s\n", strerror(errno));
-		return res;
+		return -1;
+	}
+
+	_iface_table_clear(table);
+	table->have_mac = (_ifaddrs_primary_mac(ifaddr, table->mac) == 0);
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		total++;
+	}
+	/* up to three keys per address, at most half full */
+	unsigned int size = 16;
+	while (size < total * 6) {
+		size *= 2;
+	}
+	table->keys = (struct iface6_key*)calloc(size, sizeof(struct iface6_key));
+	if (!table->keys) {
+		freeifaddrs(ifaddr);
+		return -1;
 	}
+	table->keys_mask = size - 1;
 
-	/* loop over interfaces */
 	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
 		/* skip if no address is available */
 		if (ifa->ifa_addr == NULL) {
@@ -997,48 +2844,256 @@ static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
 #endif
 
 		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)ifa->ifa_addr;
-
-		/* skip if scopes do not match */
-		if (_in6_addr_scope(&addr_in->sin6_addr) != addr_scope) {
+		uint32_t scope = _in6_addr_scope(&addr_in->sin6_addr);
+		if (scope >= IFACE_SCOPE_SLOTS) {
 			continue;
 		}
+		uint32_t scope_id = addr_in->sin6_scope_id;
+		_iface_table_insert(table, IFACE_KEY_ADDR_SCOPE, &addr_in->sin6_addr, scope_id, 1);
+		_iface_table_insert(table, IFACE_KEY_ADDR, &addr_in->sin6_addr, 0, scope_id);
+		if ((ifa->ifa_flags & IFF_LOOPBACK) == 0) {
+			struct in6_addr scope_key;
+			memset(&scope_key, 0, sizeof(scope_key));
+			scope_key.s6_addr[0] = (uint8_t)scope;
+			_iface_table_insert(table, IFACE_KEY_SCOPE_IF, &scope_key, scope_id, 1);
+			table->fallback[scope] = (int32_t)scope_id;
+		}
+	}
+	freeifaddrs(ifaddr);
 
-		/* use if address is equal */
-		if (memcmp(&addr->sin6_addr.s6_addr, &addr_in->sin6_addr.s6_addr, sizeof(addr_in->sin6_addr.s6_addr)) == 0) {
-			/* if scope id equals the requested one then assume it was valid */
-			if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
-				res = addr_in->sin6_scope_id;
-				break;
-			}
-			res = addr_in->sin6_scope_id;
+	table->updated = _monotonic_ms();
+	table->valid = 1;
+	return 0;
+}
+
+#ifdef __linux__
+/* Returns 1 if the kernel reported link or address changes since the last
+ * call, 0 if not, or -1 if change notifications are unavailable. */
+static int _iface_netlink_changed(void)
+{
+	char buf[4096];
+	int changed = 0;
+
+	if (iface_nl_fd == -1) {
+		struct sockaddr_nl snl;
+		iface_nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+		if (iface_nl_fd < 0) {
+			SOCKET_ERR(2, "%s: netlink socket: %s\n", __func__, strerror(errno));
+			iface_nl_fd = -2;
+			return -1;
+		}
+		memset(&snl, 0, sizeof(snl));
+		snl.nl_family = AF_NETLINK;
+		snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+		if (bind(iface_nl_fd, (struct sockaddr*)&snl, sizeof(snl)) < 0) {
+			SOCKET_ERR(2, "%s: netlink bind: %s\n", __func__, strerror(errno));
+			close(iface_nl_fd);
+			iface_nl_fd = -2;
+			return -1;
+		}
+		/* anything before the subscription is unknown */
+		return 1;
+	}
+	if (iface_nl_fd < 0) {
+		return -1;
+	}
+	while (1) {
+		ssize_t r = recv(iface_nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r > 0) {
+			changed = 1;
 			continue;
 		}
-
-		/* skip loopback interface if not already matched exactly above */
-		if ((ifa->ifa_flags & IFF_LOOPBACK) != 0) {
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0 && errno == ENOBUFS) {
+			/* notifications were dropped, assume a change */
+			changed = 1;
 			continue;
 		}
+		break;
+	}
+	return changed;
+}
+#endif
 
-		res = addr_in->sin6_scope_id;
+/* must be called with iface_lock held for writing */
+static struct iface_table* _iface_table_get(int force)
+{
+	int stale = force || !iface_cache.valid;
+#ifdef __linux__
+	int changed = _iface_netlink_changed();
+	if (changed != 0) {
+		stale |= (changed > 0) || (_monotonic_ms() - iface_cache.updated >= IFACE_CACHE_TTL);
+	}
+#else
+	stale |= (_monotonic_ms() - iface_cache.updated >= IFACE_CACHE_TTL);
+#endif
+	if (stale && _iface_table_build(&iface_cache) < 0) {
+		return NULL;
+	}
+	return &iface_cache;
+}
 
-		/* if scope id equals the requested one then assume it was valid */
-		if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
-			/* set the scope id of this interface as most likely candidate */
-			break;
-		}
+/* Same staleness rules as _iface_table_get(), but without consuming the
+ * change notifications, so it only needs iface_lock held for reading. */
+static int _iface_table_fresh(void)
+{
+	if (!iface_cache.valid) {
+		return 0;
+	}
+#ifdef __linux__
+	if (iface_nl_fd == -1) {
+		return 0;
+	}
+	if (iface_nl_fd >= 0) {
+#ifdef HAVE_POLL
+		struct pollfd pfd;
+		pfd.fd = iface_nl_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) == 0;
+#else
+		return 0;
+#endif
 	}
+#endif
+	return (_monotonic_ms() - iface_cache.updated < IFACE_CACHE_TTL);
+}
 
-	freeifaddrs(ifaddr);
+/* Returns with iface_lock held for reading, rebuilding the table first if
+ * it is stale. The caller must call rwlock_read_unlock() even if NULL is
+ * returned. */
+static struct iface_table* _iface_table_read_lock(int force)
+{
+	struct iface_table *table;
+
+	rwlock_read_lock(&iface_lock);
+	if (!force && _iface_table_fresh()) {
+		return &iface_cache;
+	}
+	rwlock_read_unlock(&iface_lock);
+
+	rwlock_write_lock(&iface_lock);
+	table = _iface_table_get(force);
+	rwlock_write_unlock(&iface_lock);
+
+	rwlock_read_lock(&iface_lock);
+	/* the table might have been invalidated in between */
+	return (table && iface_cache.valid) ? &iface_cache : NULL;
+}
+
+void socket_interface_cache_invalidate(void)
+{
+	thread_once(&iface_once, _iface_init);
+	rwlock_write_lock(&iface_lock);
+	iface_cache.valid = 0;
+	rwlock_write_unlock(&iface_lock);
+}
+
+int get_primary_mac_address(unsigned char mac_addr_buf[6])
+{
+	int result = -1;
+	thread_once(&iface_once, _iface_init);
+	struct iface_table *table = _iface_table_read_lock(0);
+	if (table && table->have_mac) {
+		memcpy(mac_addr_buf, table->mac, 6);
+		result = 0;
+	}
+	rwlock_read_unlock(&iface_lock);
+	return result;
+}
+
+static int32_t _iface_table_scope_id(struct iface_table *table, struct sockaddr_in6* addr, uint32_t addr_scope)
+{
+	struct in6_addr scope_key;
+	uint32_t scope_id;
+
+	if (addr_scope >= IFACE_SCOPE_SLOTS || !table->keys) {
+		return -1;
+	}
+	/* if the requested scope id is an interface with an address of this
+	 * scope (or with exactly this address) assume it was valid */
+	if (_iface_table_lookup(table, IFACE_KEY_ADDR_SCOPE, &addr->sin6_addr, addr->sin6_scope_id, NULL)) {
+		return addr->sin6_scope_id;
+	}
+	memset(&scope_key, 0, sizeof(scope_key));
+	scope_key.s6_addr[0] = (uint8_t)addr_scope;
+	if (_iface_table_lookup(table, IFACE_KEY_SCOPE_IF, &scope_key, addr->sin6_scope_id, NULL)) {
+		return addr->sin6_scope_id;
+	}
+	/* a local address is reached through its own interface */
+	if (_iface_table_lookup(table, IFACE_KEY_ADDR, &addr->sin6_addr, 0, &scope_id)) {
+		return (int32_t)scope_id;
+	}
+	/* otherwise use the most likely candidate */
+	return table->fallback[addr_scope];
+}
+
+static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
+{
+	int32_t res = -1;
+	uint32_t addr_scope;
+
+	/* get scope for requested address */
+	addr_scope = _in6_addr_scope(&addr->sin6_addr);
+	if (addr_scope == 0) {
+		/* global scope doesn't need a specific scope id */
+		return addr_scope;
+	}
+
+	thread_once(&iface_once, _iface_init);
+	struct iface_table *table = _iface_table_read_lock(0);
+	if (table) {
+		res = _iface_table_scope_id(table, addr, addr_scope);
+		if (res < 0 && _monotonic_ms() - table->updated >= 1000) {
+			/* the interface might have just appeared */
+			rwlock_read_unlock(&iface_lock);
+			table = _iface_table_read_lock(1);
+			if (table) {
+				res = _iface_table_scope_id(table, addr, addr_scope);
+			}
+		}
+	}
+	rwlock_read_unlock(&iface_lock);
 
 	return res;
 }
+
+static void _iface_deinit(void)
+{
+	if (!iface_initialized) {
+		return;
+	}
+	rwlock_write_lock(&iface_lock);
+	_iface_table_clear(&iface_cache);
+#ifdef __linux__
+	if (iface_nl_fd >= 0) {
+		close(iface_nl_fd);
+	}
+	iface_nl_fd = -1;
+#endif
+	rwlock_write_unlock(&iface_lock);
+}
+#endif
+
+/* called by the library destructor */
+void socket_deinit(void)
+{
+#ifdef AF_INET6
+	_iface_deinit();
 #endif
+}
 
 int socket_connect_addr(struct sockaddr* addr, uint16_t port)
+{
+	return socket_connect_addr_with_options(addr, port, NULL);
+}
+
+int socket_connect_addr_with_options(struct sockaddr* addr, uint16_t port, const struct socket_options *opts)
 {
 	int sfd = -1;
 	int yes = 1;
-	int bufsize = 0x20000;
 	int addrlen = 0;
 #ifdef _WIN32
 	u_long l_yes = 1;
@@ -1153,38 +3208,190 @@ int socket_connect_addr(struct sockaddr* addr, uint16_t port)
 		return -1;
 	}
 
-	if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
+	socket_set_options(sfd, (opts) ? opts : &socket_connect_default_options);
+
+	return sfd;
+}
+
+#ifdef HAVE_POLL
+#define CONNECT_ATTEMPT_DELAY 250
+#define CONNECT_MAX_ATTEMPTS 16
+
+/* Creates a non-blocking socket for the given address and initiates the
+ * connection. Returns the socket or -1 with errno set. */
+static int _socket_connect_start(struct addrinfo *ai, int *connected)
+{
+	int yes = 1;
+	int sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sfd == -1) {
+		return -1;
+	}
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+		SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
+		socket_close(sfd);
+		return -1;
+	}
 #endif
-		SOCKET_ERR(1, "Could not set TCP_NODELAY on socket: %s\n", strerror(errno));
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
+		SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
+		socket_close(sfd);
+		return -1;
 	}
+	int flags = fcntl(sfd, F_GETFL, 0);
+	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set send buffer for socket: %s\n", strerror(errno));
+	*connected = 0;
+	if (connect(sfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		*connected = 1;
+		return sfd;
+	}
+	if (errno != EINPROGRESS) {
+		int err = errno;
+		socket_close(sfd);
+		errno = err;
+		return -1;
 	}
+	return sfd;
+}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set receive buffer for socket: %s\n", strerror(errno));
+/* RFC 8305 style connection racing: candidates are interleaved by address
+ * family and started CONNECT_ATTEMPT_DELAY ms apart (or immediately when the
+ * previous attempt failed). The first socket that connects wins. */
+static int _socket_connect_happy_eyeballs(struct addrinfo *result)
+{
+	struct addrinfo *candidates[CONNECT_MAX_ATTEMPTS];
+	struct pollfd pfds[CONNECT_MAX_ATTEMPTS];
+	uint64_t deadlines[CONNECT_MAX_ATTEMPTS];
+	unsigned int count = 0;
+	unsigned int next = 0;
+	unsigned int active = 0;
+	uint64_t next_start = 0;
+	int winner = -1;
+	int last_err = ECONNREFUSED;
+	struct addrinfo *rp;
+	unsigned int i;
+
+	/* interleave address families, starting with the preferred (first) one */
+	int first_family = result->ai_family;
+	struct addrinfo *pref = result;
+	struct addrinfo *other = result;
+	while (count < CONNECT_MAX_ATTEMPTS && (pref || other)) {
+		while (pref && pref->ai_family != first_family) pref = pref->ai_next;
+		if (pref) {
+			candidates[count++] = pref;
+			pref = pref->ai_next;
+		}
+		while (other && other->ai_family == first_family) other = other->ai_next;
+		if (other && count < CONNECT_MAX_ATTEMPTS) {
+			candidates[count++] = other;
+			other = other->ai_next;
+		}
 	}
 
-	return sfd;
+	while (winner < 0) {
+		uint64_t now = _monotonic_ms();
+		if (next < count && (active == 0 || now >= next_start)) {
+			int connected = 0;
+			rp = candidates[next++];
+			int sfd = _socket_connect_start(rp, &connected);
+			if (sfd < 0) {
+				last_err = errno;
+				continue;
+			}
+			if (connected) {
+				winner = sfd;
+				break;
+			}
+			pfds[active].fd = sfd;
+			pfds[active].events = POLLOUT;
+			pfds[active].revents = 0;
+			deadlines[active] = now + CONNECT_TIMEOUT;
+			active++;
+			next_start = now + CONNECT_ATTEMPT_DELAY;
+			if (verbose >= 3) {
+				char addrtxt[48];
+				socket_addr_to_string(rp->ai_addr, addrtxt, sizeof(addrtxt));
+				SOCKET_ERR(3, "%s: started connection attempt to %s\n", __func__, addrtxt);
+			}
+			continue;
+		}
+		if (active == 0) {
+			break;
+		}
+
+		uint64_t wake = deadlines[0];
+		for (i = 1; i < active; i++) {
+			if (deadlines[i] < wake) {
+				wake = deadlines[i];
+			}
+		}
+		if (next < count && next_start < wake) {
+			wake = next_start;
+		}
+		int wait_ms = (wake > now) ? (int)(wake - now) : 0;
+		int n = poll(pfds, active, wait_ms);
+		if (n < 0 && errno != EINTR) {
+			last_err = errno;
+			break;
+		}
+		now = _monotonic_ms();
+		for (i = 0; i < active; ) {
+			int failed = 0;
+			if (pfds[i].revents != 0) {
+				int so_error = 0;
+				socklen_t len = sizeof(so_error);
+				getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+				if (so_error == 0 && (pfds[i].revents & POLLOUT)) {
+					winner = pfds[i].fd;
+					pfds[i] = pfds[--active];
+					deadlines[i] = deadlines[active];
+					break;
+				}
+				last_err = (so_error) ? so_error : ECONNREFUSED;
+				failed = 1;
+			} else if (now >= deadlines[i]) {
+				last_err = ETIMEDOUT;
+				failed = 1;
+			}
+			if (failed) {
+				socket_close(pfds[i].fd);
+				pfds[i] = pfds[--active];
+				deadlines[i] = deadlines[active];
+				/* don't wait for the attempt delay after a failure */
+				next_start = now;
+				continue;
+			}
+			i++;
+		}
+	}
+
+	for (i = 0; i < active; i++) {
+		socket_close(pfds[i].fd);
+	}
+	if (winner < 0) {
+		errno = last_err;
+	}
+	return winner;
 }
+#endif
 
 int socket_connect(const char *addr, uint16_t port)
+{
+	return socket_connect_ex(addr, port, 0);
+}
+
+int socket_connect_ex(const char *addr, uint16_t port, unsigned int connect_flags)
+{
+	return socket_connect_with_options(addr, port, connect_flags, NULL);
+}
+
+int socket_connect_with_options(const char *addr, uint16_t port, unsigned int connect_flags, const struct socket_options *opts)
 {
 	int sfd = -1;
 	int yes = 1;
-	int bufsize = 0x20000;
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
-	char portstr[8];
 	int res;
 #ifdef _WIN32
 	u_long l_yes = 1;
@@ -1198,14 +3405,19 @@ int socket_connect(const char *addr, uint16_t port)
 	hints.ai_flags = AI_NUMERICSERV;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	snprintf(portstr, 8, "%d", port);
-
-	res = getaddrinfo(addr, portstr, &hints, &result);
+	res = _resolver_getaddrinfo(addr, port, &hints, &result);
 	if (res != 0) {
 		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
 		return -1;
 	}
 
+#ifdef HAVE_POLL
+	if (connect_flags & SOCKET_CONNECT_HAPPY_EYEBALLS) {
+		sfd = _socket_connect_happy_eyeballs(result);
+		/* rp only signals success below */
+		rp = (sfd < 0) ? NULL : result;
+	} else
+#endif
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 		if (sfd == -1) {
@@ -1272,38 +3484,19 @@ int socket_connect(const char *addr, uint16_t port)
 		socket_close(sfd);
 	}
 
-	freeaddrinfo(result);
+	_addrinfo_copy_free(result);
 
 	if (rp == NULL) {
 		SOCKET_ERR(2, "%s: Could not connect to %s:%d\n", __func__, addr, port);
 		return -1;
 	}
 
-	if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set TCP_NODELAY on socket: %s\n", strerror(errno));
-	}
-
-	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set send buffer for socket: %s\n", strerror(errno));
-	}
-
-	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set receive buffer for socket: %s\n", strerror(errno));
-	}
+	socket_set_options(sfd, (opts) ? opts : &socket_connect_default_options);
 
 	return sfd;
 }
 
-int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
+static int _socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 {
 	if (fd < 0) {
 		SOCKET_ERR(2, "ERROR: invalid fd in check_fd %d\n", fd);
@@ -1324,6 +3517,8 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 			return 1;
 		case poll_status_timeout:
 			return -ETIMEDOUT;
+		case poll_status_cancelled:
+			return -ECANCELED;
 		case poll_status_error:
 		default:
 			SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
@@ -1333,6 +3528,17 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 	return -ECONNRESET;
 }
 
+int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
+{
+	if (stats_enabled) {
+		uint64_t start = _monotonic_us();
+		int res = _socket_check_fd(fd, fdm, timeout);
+		_socket_stats_record(fd, STATS_WAIT, res, 0, start);
+		return res;
+	}
+	return _socket_check_fd(fd, fdm, timeout);
+}
+
 int socket_accept(int fd, uint16_t port)
 {
 #ifdef _WIN32
@@ -1353,19 +3559,71 @@ int socket_accept(int fd, uint16_t port)
 	return result;
 }
 
-int socket_shutdown(int fd, int how)
+int socket_accept_ex(int fd, struct sockaddr *addr, socklen_t *addr_len, unsigned int flags)
 {
-	int result = shutdown(fd, how);
-#ifdef _WIN32
+	struct sockaddr_storage ss;
+	socklen_t ss_len = sizeof(ss);
+	int result;
+
+	if (!addr || !addr_len) {
+		addr = (struct sockaddr*)&ss;
+		addr_len = &ss_len;
+	}
+#ifdef HAVE_ACCEPT4
+	int aflags = 0;
+	if (flags & SOCKET_ACCEPT_NONBLOCK) {
+		aflags |= SOCK_NONBLOCK;
+	}
+	if (flags & SOCKET_ACCEPT_CLOEXEC) {
+		aflags |= SOCK_CLOEXEC;
+	}
+	do {
+		result = accept4(fd, addr, addr_len, aflags);
+	} while (result < 0 && errno == EINTR);
+#else
+	result = accept(fd, addr, addr_len);
 	if (result < 0) {
+#ifdef _WIN32
 		errno = WSAError_to_errno(WSAGetLastError());
-	}
 #endif
-	return result;
-}
+		return result;
+	}
+	if ((flags & SOCKET_ACCEPT_NONBLOCK) && _socket_set_nonblocking(result) < 0) {
+		int err = errno;
+		socket_close(result);
+		errno = err;
+		return -1;
+	}
+#ifdef FD_CLOEXEC
+	if (flags & SOCKET_ACCEPT_CLOEXEC) {
+		fcntl(result, F_SETFD, fcntl(result, F_GETFD, 0) | FD_CLOEXEC);
+	}
+#endif
+#endif
+	return result;
+}
+
+int socket_shutdown(int fd, int how)
+{
+	int result = shutdown(fd, how);
+#ifdef _WIN32
+	if (result < 0) {
+		errno = WSAError_to_errno(WSAGetLastError());
+	}
+#endif
+	return result;
+}
 
 int socket_close(int fd)
 {
+	if (fd >= 0) {
+		/* the fd number may be reused by an unrelated socket; reset even
+		 * with stats disabled now, they may be enabled again later */
+		socket_stats_reset(fd);
+	}
+	if (faults_active) {
+		socket_fault_set(fd, NULL);
+	}
 #ifdef _WIN32
 	int result = closesocket(fd);
 	if (result < 0) {
@@ -1387,11 +3645,24 @@ int socket_peek(int fd, void *data, size_t length)
 	return socket_receive_timeout(fd, data, length, MSG_PEEK, RECV_TIMEOUT);
 }
 
-int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout)
+static int _socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout)
 {
 	int res;
 	int result;
 
+#ifdef HAVE_IO_URING
+	if (_uring_enabled() && fd >= 0) {
+		result = _uring_sock_op(fd, IORING_OP_RECV, data, length, flags, (timeout > 0 && (int)timeout > 0) ? (int)timeout : -1);
+		if (result != -EAGAIN) {
+			if (result == 0) {
+				SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+				return -ECONNRESET;
+			}
+			return result;
+		}
+	}
+#endif
+
 	// check if data is available
 	res = socket_check_fd(fd, FDM_READ, timeout);
 	if (res <= 0) {
@@ -1413,16 +3684,41 @@ int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigne
 	return result;
 }
 
-int socket_send(int fd, void *data, size_t length)
+int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout)
 {
-	int flags = 0;
-	int res = socket_check_fd(fd, FDM_WRITE, SEND_TIMEOUT);
-	if (res <= 0) {
+	if (faults_active) {
+		int res = _socket_fault_apply(fd, FAULT_RECV, &length);
+		if (res < 0) {
+			return res;
+		}
+	}
+	if (stats_enabled) {
+		uint64_t start = _monotonic_us();
+		int res = _socket_receive_timeout(fd, data, length, flags, timeout);
+		_socket_stats_record(fd, STATS_RECV, res, (res > 0 && !(flags & MSG_PEEK)) ? (uint64_t)res : 0, start);
 		return res;
 	}
+	return _socket_receive_timeout(fd, data, length, flags, timeout);
+}
+
+static int _socket_send(int fd, void *data, size_t length)
+{
+	int flags = 0;
 #ifdef MSG_NOSIGNAL
 	flags |= MSG_NOSIGNAL;
 #endif
+#ifdef HAVE_IO_URING
+	if (_uring_enabled() && fd >= 0) {
+		int r = _uring_sock_op(fd, IORING_OP_SEND, data, length, flags, SEND_TIMEOUT);
+		if (r != -EAGAIN) {
+			return r;
+		}
+	}
+#endif
+	int res = socket_check_fd(fd, FDM_WRITE, SEND_TIMEOUT);
+	if (res <= 0) {
+		return res;
+	}
 	int s = (int)send(fd, data, length, flags);
 	if (s < 0) {
 #ifdef _WIN32
@@ -1433,25 +3729,2765 @@ int socket_send(int fd, void *data, size_t length)
 	return s;
 }
 
-int socket_get_socket_port(int fd, uint16_t *port)
+int socket_send(int fd, void *data, size_t length)
 {
+	if (faults_active) {
+		int res = _socket_fault_apply(fd, FAULT_SEND, &length);
+		if (res < 0) {
+			return res;
+		}
+	}
+	if (stats_enabled) {
+		uint64_t start = _monotonic_us();
+		int res = _socket_send(fd, data, length);
+		_socket_stats_record(fd, STATS_SEND, res, (res > 0) ? (uint64_t)res : 0, start);
+		return res;
+	}
+	return _socket_send(fd, data, length);
+}
+
 #ifdef _WIN32
-	int addr_len;
+#define WSABUF_STACK_COUNT 16
+static WSABUF* _iovec_to_wsabuf(const struct iovec *iov, int iovcnt, WSABUF *stackbufs)
+{
+	WSABUF *bufs = stackbufs;
+	int i;
+	if (iovcnt > WSABUF_STACK_COUNT) {
+		bufs = (WSABUF*)malloc(sizeof(WSABUF) * iovcnt);
+		if (!bufs) {
+			return NULL;
+		}
+	}
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = (char*)iov[i].iov_base;
+		bufs[i].len = (ULONG)iov[i].iov_len;
+	}
+	return bufs;
+}
+#endif
+
+int socket_receivev(int fd, struct iovec *iov, int iovcnt)
+{
+	return socket_receivev_timeout(fd, iov, iovcnt, 0, RECV_TIMEOUT);
+}
+
+static int _socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, int flags, unsigned int timeout)
+{
+	int res;
+	int result;
+
+	if (!iov || iovcnt <= 0) {
+		return -EINVAL;
+	}
+#ifndef _WIN32
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+#endif
+
+#ifdef HAVE_IO_URING
+	if (_uring_enabled() && fd >= 0) {
+		result = _uring_sock_op(fd, IORING_OP_RECVMSG, &msg, 1, flags, (timeout > 0 && (int)timeout > 0) ? (int)timeout : -1);
+		if (result != -EAGAIN) {
+			if (result == 0) {
+				SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+				return -ECONNRESET;
+			}
+			return result;
+		}
+	}
+#endif
+
+	// check if data is available
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		return res;
+	}
+	// if we get here, there _is_ data available
+#ifdef _WIN32
+	WSABUF stackbufs[WSABUF_STACK_COUNT];
+	WSABUF *bufs = _iovec_to_wsabuf(iov, iovcnt, stackbufs);
+	DWORD received = 0;
+	DWORD wsaflags = (DWORD)flags;
+	if (!bufs) {
+		return -ENOMEM;
+	}
+	if (WSARecv(fd, bufs, iovcnt, &received, &wsaflags, NULL, NULL) == SOCKET_ERROR) {
+		result = -1;
+	} else {
+		result = (int)received;
+	}
+	if (bufs != stackbufs) {
+		free(bufs);
+	}
 #else
-	socklen_t addr_len;
+	result = (int)recvmsg(fd, &msg, flags);
 #endif
-	struct sockaddr_in addr;
+	if (result == 0) {
+		// but this is an error condition
+		SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	if (result < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	return result;
+}
 
-	memset(&addr, 0, sizeof(addr));
+int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, int flags, unsigned int timeout)
+{
+	struct iovec faultiov[FAULT_IOV_STACK_COUNT];
+	struct iovec *faultalloc = NULL;
+	int res;
+	if (faults_active) {
+		const struct iovec *fiov = iov;
+		res = _socket_fault_apply_iov(fd, FAULT_RECV, &fiov, &iovcnt, faultiov, &faultalloc);
+		if (res < 0) {
+			return res;
+		}
+		iov = (struct iovec*)fiov;
+	}
+	if (stats_enabled) {
+		uint64_t start = _monotonic_us();
+		res = _socket_receivev_timeout(fd, iov, iovcnt, flags, timeout);
+		_socket_stats_record(fd, STATS_RECV, res, (res > 0 && !(flags & MSG_PEEK)) ? (uint64_t)res : 0, start);
+	} else {
+		res = _socket_receivev_timeout(fd, iov, iovcnt, flags, timeout);
+	}
+	free(faultalloc);
+	return res;
+}
 
-	addr_len = sizeof(addr);
-	if (0 > getsockname(fd, (struct sockaddr*)&addr, &addr_len)) {
+static int _socket_sendv(int fd, const struct iovec *iov, int iovcnt)
+{
+	int flags = 0;
+	int s;
+
+	if (!iov || iovcnt <= 0) {
+		return -EINVAL;
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifndef _WIN32
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = iovcnt;
+#endif
+#ifdef HAVE_IO_URING
+	if (_uring_enabled() && fd >= 0) {
+		int r = _uring_sock_op(fd, IORING_OP_SENDMSG, &msg, 1, flags, SEND_TIMEOUT);
+		if (r != -EAGAIN) {
+			return r;
+		}
+	}
+#endif
+	int res = socket_check_fd(fd, FDM_WRITE, SEND_TIMEOUT);
+	if (res <= 0) {
+		return res;
+	}
+#ifdef _WIN32
+	WSABUF stackbufs[WSABUF_STACK_COUNT];
+	WSABUF *bufs = _iovec_to_wsabuf(iov, iovcnt, stackbufs);
+	DWORD sent = 0;
+	if (!bufs) {
+		return -ENOMEM;
+	}
+	if (WSASend(fd, bufs, iovcnt, &sent, (DWORD)flags, NULL, NULL) == SOCKET_ERROR) {
+		s = -1;
+	} else {
+		s = (int)sent;
+	}
+	if (bufs != stackbufs) {
+		free(bufs);
+	}
+#else
+	s = (int)sendmsg(fd, &msg, flags);
+#endif
+	if (s < 0) {
 #ifdef _WIN32
 		errno = WSAError_to_errno(WSAGetLastError());
 #endif
+		return -errno;
+	}
+	return s;
+}
+
+int socket_sendv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct iovec faultiov[FAULT_IOV_STACK_COUNT];
+	struct iovec *faultalloc = NULL;
+	int res;
+	if (faults_active) {
+		res = _socket_fault_apply_iov(fd, FAULT_SEND, &iov, &iovcnt, faultiov, &faultalloc);
+		if (res < 0) {
+			return res;
+		}
+	}
+	if (stats_enabled) {
+		uint64_t start = _monotonic_us();
+		res = _socket_sendv(fd, iov, iovcnt);
+		_socket_stats_record(fd, STATS_SEND, res, (res > 0) ? (uint64_t)res : 0, start);
+	} else {
+		res = _socket_sendv(fd, iov, iovcnt);
+	}
+	free(faultalloc);
+	return res;
+}
+
+/* Returns the milliseconds left until deadline, -1 for no deadline, or 0 if
+ * the deadline passed already. */
+static int _deadline_remaining(uint64_t deadline)
+{
+	if (deadline == 0) {
 		return -1;
 	}
+	uint64_t now = _monotonic_ms();
+	if (now >= deadline) {
+		return 0;
+	}
+	uint64_t diff = deadline - now;
+	return (diff > INT32_MAX) ? INT32_MAX : (int)diff;
+}
 
-	*port = ntohs(addr.sin_port);
-	return 0;
+static int _socket_transfer_all(int fd, fd_mode mode, char *data, size_t length, size_t *done, uint64_t deadline)
+{
+	size_t total = 0;
+	int flags = 0;
+	int result = 0;
+#ifdef MSG_NOSIGNAL
+	if (mode == FDM_WRITE) {
+		flags |= MSG_NOSIGNAL;
+	}
+#endif
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+	/* try the syscall first; only wait if it would block */
+	int need_poll = 0;
+#else
+	int need_poll = 1;
+#endif
+
+	if (fd < 0) {
+		return -EINVAL;
+	}
+
+	while (total < length) {
+		if (need_poll) {
+			int remaining = _deadline_remaining(deadline);
+			if (remaining == 0) {
+				result = -ETIMEDOUT;
+				break;
+			}
+			enum poll_status ps = poll_wrapper(fd, mode, remaining);
+			if (ps == poll_status_timeout) {
+				result = -ETIMEDOUT;
+				break;
+			} else if (ps == poll_status_cancelled) {
+				result = -ECANCELED;
+				break;
+			} else if (ps != poll_status_success) {
+				SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
+				result = -ECONNRESET;
+				break;
+			}
+		}
+		size_t space = length - total;
+		if (faults_active) {
+			int res = _socket_fault_apply(fd, (mode == FDM_WRITE) ? FAULT_SEND : FAULT_RECV, &space);
+			if (res < 0) {
+				result = res;
+				break;
+			}
+		}
+		int chunk = (space > INT32_MAX) ? INT32_MAX : (int)space;
+		int r;
+		if (mode == FDM_WRITE) {
+			r = (int)send(fd, data + total, chunk, flags);
+		} else {
+			r = (int)recv(fd, data + total, chunk, flags);
+		}
+		if (r > 0) {
+			total += r;
+#ifdef MSG_DONTWAIT
+			need_poll = 0;
+#endif
+			continue;
+		}
+		if (r == 0) {
+			if (mode == FDM_READ) {
+				SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+				result = -ECONNRESET;
+				break;
+			}
+			need_poll = 1;
+			continue;
+		}
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		if (stats_enabled) {
+			_socket_stats_count(fd, errno);
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			need_poll = 1;
+			continue;
+		}
+		result = -errno;
+		break;
+	}
+
+	if (done) {
+		*done = total;
+	}
+	return result;
+}
+
+static int _socket_transfer_all_stats(int fd, fd_mode mode, char *data, size_t length, size_t *done, uint64_t deadline)
+{
+	size_t total = 0;
+	uint64_t start = _monotonic_us();
+	int res = _socket_transfer_all(fd, mode, data, length, &total, deadline);
+	_socket_stats_record(fd, (mode == FDM_WRITE) ? STATS_SEND : STATS_RECV, res, total, start);
+	if (done) {
+		*done = total;
+	}
+	return res;
+}
+
+int socket_receive_all(int fd, void *data, size_t length, size_t *received, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+	if (stats_enabled) {
+		return _socket_transfer_all_stats(fd, FDM_READ, (char*)data, length, received, deadline);
+	}
+	return _socket_transfer_all(fd, FDM_READ, (char*)data, length, received, deadline);
+}
+
+int socket_send_all(int fd, const void *data, size_t length, size_t *sent, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+	if (stats_enabled) {
+		return _socket_transfer_all_stats(fd, FDM_WRITE, (char*)data, length, sent, deadline);
+	}
+	return _socket_transfer_all(fd, FDM_WRITE, (char*)data, length, sent, deadline);
+}
+
+#define SENDFILE_BUFFER_SIZE 0x20000
+
+static int _socket_sendfile_copy(int fd, int file_fd, uint64_t offset, uint64_t length, uint64_t *sent, uint64_t deadline)
+{
+	char *buf = (char*)malloc(SENDFILE_BUFFER_SIZE);
+	uint64_t total = 0;
+	int result = 0;
+
+	if (!buf) {
+		return -ENOMEM;
+	}
+#ifdef _WIN32
+	if (_lseeki64(file_fd, (__int64)offset, SEEK_SET) < 0) {
+		free(buf);
+		return -errno;
+	}
+#endif
+	while (total < length) {
+		size_t chunk = (length - total > SENDFILE_BUFFER_SIZE) ? SENDFILE_BUFFER_SIZE : (size_t)(length - total);
+#ifdef _WIN32
+		int r = _read(file_fd, buf, (unsigned int)chunk);
+#else
+		ssize_t r = pread(file_fd, buf, chunk, (off_t)(offset + total));
+#endif
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			result = -errno;
+			break;
+		}
+		if (r == 0) {
+			/* file is shorter than requested */
+			result = -EIO;
+			break;
+		}
+		size_t done = 0;
+		result = _socket_transfer_all(fd, FDM_WRITE, buf, (size_t)r, &done, deadline);
+		total += done;
+		if (result < 0) {
+			break;
+		}
+	}
+	free(buf);
+	if (sent) {
+		*sent = total;
+	}
+	return result;
+}
+
+static int _socket_sendfile(int fd, int file_fd, uint64_t offset, uint64_t length, uint64_t *sent, uint64_t deadline)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	uint64_t total = 0;
+	int result = 0;
+	/* try the syscall first; only wait if it would block */
+	int need_poll = 0;
+	while (total < length) {
+		if (need_poll) {
+			int remaining = _deadline_remaining(deadline);
+			if (remaining == 0) {
+				result = -ETIMEDOUT;
+				break;
+			}
+			enum poll_status ps = poll_wrapper(fd, FDM_WRITE, remaining);
+			if (ps == poll_status_timeout) {
+				result = -ETIMEDOUT;
+				break;
+			} else if (ps == poll_status_cancelled) {
+				result = -ECANCELED;
+				break;
+			} else if (ps != poll_status_success) {
+				SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
+				result = -ECONNRESET;
+				break;
+			}
+		}
+		off_t off = (off_t)(offset + total);
+		size_t chunk = (length - total > 0x7ffff000) ? 0x7ffff000 : (size_t)(length - total);
+		if (faults_active) {
+			int res = _socket_fault_apply(fd, FAULT_SEND, &chunk);
+			if (res < 0) {
+				result = res;
+				break;
+			}
+		}
+		ssize_t r = sendfile(fd, file_fd, &off, chunk);
+		if (r > 0) {
+			total += r;
+			need_poll = 0;
+			continue;
+		}
+		if (r == 0) {
+			/* file is shorter than requested */
+			result = -EIO;
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN) {
+			need_poll = 1;
+			continue;
+		}
+		if ((errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) && total == 0) {
+			/* file type not supported by sendfile(), copy through user space */
+			SOCKET_ERR(3, "%s: sendfile: %s, falling back to read/send\n", __func__, strerror(errno));
+			return _socket_sendfile_copy(fd, file_fd, offset, length, sent, deadline);
+		}
+		result = -errno;
+		break;
+	}
+	if (sent) {
+		*sent = total;
+	}
+	return result;
+#else
+	return _socket_sendfile_copy(fd, file_fd, offset, length, sent, deadline);
+#endif
+}
+
+int socket_sendfile(int fd, int file_fd, uint64_t offset, uint64_t length, uint64_t *sent, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+
+	if (fd < 0 || file_fd < 0) {
+		return -EINVAL;
+	}
+#ifdef _WIN32
+	return _socket_sendfile(fd, file_fd, offset, length, sent, deadline);
+#else
+	/* a blocking sendfile()/send() of a large chunk would sleep in the
+	 * kernel past the deadline, so only ever wait in poll_wrapper() */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags >= 0 && !(flags & O_NONBLOCK)) {
+		if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			flags = -1;
+		}
+	} else {
+		flags = -1;
+	}
+	int res = _socket_sendfile(fd, file_fd, offset, length, sent, deadline);
+	if (flags >= 0) {
+		fcntl(fd, F_SETFL, flags);
+	}
+	return res;
+#endif
+}
+
+int socket_get_socket_port(int fd, uint16_t *port)
+{
+#ifdef _WIN32
+	int addr_len;
+#else
+	socklen_t addr_len;
+#endif
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+
+	addr_len = sizeof(addr);
+	if (0 > getsockname(fd, (struct sockaddr*)&addr, &addr_len)) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -1;
+	}
+
+	*port = ntohs(addr.sin_port);
+	return 0;
+}
+
+#ifdef HAVE_SOCKET_LOOP
+#define SOCKET_LOOP_MAX_EVENTS 64
+
+struct socket_pollset_entry {
+	unsigned int events;
+	void *user_data;
+#ifndef HAVE_SYS_EPOLL_H
+	unsigned int index;
+#endif
+	int registered;
+};
+
+struct socket_pollset {
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+#else
+	struct pollfd *pfds;
+	unsigned int num_pfds;
+	unsigned int pfds_size;
+	unsigned int next;
+#endif
+	struct socket_pollset_entry *entries;
+	unsigned int entries_size;
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t _fd_events_to_epoll(unsigned int events)
+{
+	/* same event sets as poll_wrapper() uses for the respective fd_mode */
+	return (uint32_t)(unsigned short)fd_events_to_poll_events(events);
+}
+
+static unsigned int _epoll_to_fd_events(uint32_t ev)
+{
+	unsigned int events = poll_events_to_fd_events((short)(ev & 0xFFFF));
+	if (ev & EPOLLRDHUP)
+		events |= FDE_HUP;
+	return events;
+}
+#endif
+
+#ifndef HAVE_SYS_EPOLL_H
+static int _socket_poll(struct pollfd *pfds, unsigned int num, int timeout_ms)
+{
+#ifdef HAVE_POLL
+	return poll(pfds, num, timeout_ms);
+#else
+	if (num == 0) {
+		/* WSAPoll() fails without any sockets */
+		Sleep((timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms);
+		return 0;
+	}
+	int n = WSAPoll(pfds, num, timeout_ms);
+	if (n == SOCKET_ERROR) {
+		errno = WSAError_to_errno(WSAGetLastError());
+		return -1;
+	}
+	return n;
+#endif
+}
+#endif
+
+socket_pollset_t socket_pollset_new(void)
+{
+	struct socket_pollset *ps = calloc(1, sizeof(struct socket_pollset));
+	if (!ps) {
+		errno = ENOMEM;
+		return NULL;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	ps->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ps->epfd < 0) {
+		SOCKET_ERR(1, "%s: epoll_create1: %s\n", __func__, strerror(errno));
+		free(ps);
+		return NULL;
+	}
+#endif
+	return ps;
+}
+
+void socket_pollset_free(socket_pollset_t ps)
+{
+	if (!ps) {
+		return;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	close(ps->epfd);
+#else
+	free(ps->pfds);
+#endif
+	free(ps->entries);
+	free(ps);
+}
+
+static struct socket_pollset_entry* _socket_pollset_entry(struct socket_pollset *ps, int fd)
+{
+	if (fd < 0 || (unsigned int)fd >= ps->entries_size || !ps->entries[fd].registered) {
+		return NULL;
+	}
+	return &ps->entries[fd];
+}
+
+int socket_pollset_add(socket_pollset_t ps, int fd, unsigned int events, void *user_data)
+{
+	if (!ps || fd < 0) {
+		return -EINVAL;
+	}
+	if ((unsigned int)fd >= ps->entries_size) {
+		unsigned int newsize = (ps->entries_size) ? ps->entries_size : 64;
+		while (newsize <= (unsigned int)fd) {
+			newsize *= 2;
+		}
+		struct socket_pollset_entry *newentries = realloc(ps->entries, newsize * sizeof(struct socket_pollset_entry));
+		if (!newentries) {
+			return -ENOMEM;
+		}
+		memset(newentries + ps->entries_size, 0, (newsize - ps->entries_size) * sizeof(struct socket_pollset_entry));
+		ps->entries = newentries;
+		ps->entries_size = newsize;
+	}
+	struct socket_pollset_entry *entry = &ps->entries[fd];
+	if (entry->registered) {
+		return -EEXIST;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = _fd_events_to_epoll(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		int err = errno;
+		SOCKET_ERR(2, "%s: epoll_ctl(ADD, %d): %s\n", __func__, fd, strerror(err));
+		return -err;
+	}
+#else
+	if (ps->num_pfds == ps->pfds_size) {
+		unsigned int newsize = (ps->pfds_size) ? ps->pfds_size * 2 : 16;
+		struct pollfd *newpfds = realloc(ps->pfds, newsize * sizeof(struct pollfd));
+		if (!newpfds) {
+			return -ENOMEM;
+		}
+		ps->pfds = newpfds;
+		ps->pfds_size = newsize;
+	}
+	entry->index = ps->num_pfds++;
+	ps->pfds[entry->index].fd = fd;
+	ps->pfds[entry->index].events = fd_events_to_poll_events(events);
+	ps->pfds[entry->index].revents = 0;
+#endif
+	entry->events = events;
+	entry->user_data = user_data;
+	entry->registered = 1;
+	return 0;
+}
+
+int socket_pollset_modify(socket_pollset_t ps, int fd, unsigned int events)
+{
+	struct socket_pollset_entry *entry = (ps) ? _socket_pollset_entry(ps, fd) : NULL;
+	if (!entry) {
+		return -ENOENT;
+	}
+	if (entry->events == events) {
+		return 0;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = _fd_events_to_epoll(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(ps->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		int err = errno;
+		SOCKET_ERR(2, "%s: epoll_ctl(MOD, %d): %s\n", __func__, fd, strerror(err));
+		return -err;
+	}
+#else
+	ps->pfds[entry->index].events = fd_events_to_poll_events(events);
+#endif
+	entry->events = events;
+	return 0;
+}
+
+int socket_pollset_remove(socket_pollset_t ps, int fd)
+{
+	struct socket_pollset_entry *entry = (ps) ? _socket_pollset_entry(ps, fd) : NULL;
+	if (!entry) {
+		return -ENOENT;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	/* the fd might already be closed, in which case the kernel dropped it already */
+	if (epoll_ctl(ps->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+		SOCKET_ERR(2, "%s: epoll_ctl(DEL, %d): %s\n", __func__, fd, strerror(errno));
+	}
+#else
+	unsigned int last = ps->num_pfds - 1;
+	if (entry->index != last) {
+		ps->pfds[entry->index] = ps->pfds[last];
+		ps->entries[ps->pfds[last].fd].index = entry->index;
+	}
+	ps->num_pfds--;
+#endif
+	entry->registered = 0;
+	entry->user_data = NULL;
+	return 0;
+}
+
+int socket_pollset_wait(socket_pollset_t ps, struct socket_pollset_event *events, int max_events, int timeout_ms)
+{
+	int count = 0;
+	int i;
+	if (!ps || !events || max_events <= 0) {
+		return -EINVAL;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event evs[SOCKET_LOOP_MAX_EVENTS];
+	if (max_events > SOCKET_LOOP_MAX_EVENTS) {
+		max_events = SOCKET_LOOP_MAX_EVENTS;
+	}
+	int n;
+	do {
+		n = epoll_wait(ps->epfd, evs, max_events, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		int err = errno;
+		SOCKET_ERR(2, "%s: epoll_wait: %s\n", __func__, strerror(err));
+		return -err;
+	}
+	for (i = 0; i < n; i++) {
+		struct socket_pollset_entry *entry = _socket_pollset_entry(ps, evs[i].data.fd);
+		if (!entry) {
+			continue;
+		}
+		events[count].fd = evs[i].data.fd;
+		events[count].events = _epoll_to_fd_events(evs[i].events);
+		events[count].user_data = entry->user_data;
+		count++;
+	}
+#else
+	int n;
+	do {
+		n = _socket_poll(ps->pfds, ps->num_pfds, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		int err = errno;
+		SOCKET_ERR(2, "%s: poll: %s\n", __func__, strerror(err));
+		return -err;
+	}
+	/* start where the last call stopped so busy fds can't starve the others */
+	unsigned int num = ps->num_pfds;
+	unsigned int start = (num > 0) ? ps->next % num : 0;
+	for (i = 0; n > 0 && count < max_events && i < (int)num; i++) {
+		unsigned int idx = (start + i) % num;
+		if (ps->pfds[idx].revents == 0) {
+			continue;
+		}
+		n--;
+		events[count].fd = (int)ps->pfds[idx].fd;
+		events[count].events = poll_events_to_fd_events(ps->pfds[idx].revents);
+		events[count].user_data = ps->entries[ps->pfds[idx].fd].user_data;
+		count++;
+		ps->next = idx + 1;
+	}
+#endif
+	return count;
+}
+
+struct socket_loop_source {
+	int fd;
+	uint32_t gen;
+	unsigned int events;
+	socket_loop_io_cb_t cb;
+	void *user_data;
+	/* internal write handler sharing the fd with cb (see socket_writeq_t);
+	 * it adds FDE_WRITE to the polled events while attached */
+	socket_loop_io_cb_t wcb;
+	void *wdata;
+};
+
+struct socket_loop_timer {
+	uint64_t deadline;
+	unsigned int interval;
+	unsigned int heap_index;
+	int cancelled;
+	socket_loop_timer_cb_t cb;
+	void *user_data;
+};
+
+struct socket_loop_post {
+	struct socket_loop_post *next;
+	socket_loop_post_cb_t cb;
+	void *user_data;
+};
+
+struct socket_loop {
+	socket_pollset_t pollset;
+	int wake_rfd;
+	int wake_wfd;
+	struct socket_loop_source *sources;
+	unsigned int sources_size;
+	uint32_t gen;
+	struct socket_loop_timer **timers;
+	unsigned int num_timers;
+	unsigned int timers_size;
+	struct socket_loop_timer *current_timer;
+	mutex_t posts_lock;
+	struct socket_loop_post *posts;
+	struct socket_loop_post **posts_tail;
+	volatile int stop;
+};
+
+#define TIMER_NOT_QUEUED ((unsigned int)-1)
+
+static void _timer_heap_swap(struct socket_loop *loop, unsigned int a, unsigned int b)
+{
+	struct socket_loop_timer *t = loop->timers[a];
+	loop->timers[a] = loop->timers[b];
+	loop->timers[b] = t;
+	loop->timers[a]->heap_index = a;
+	loop->timers[b]->heap_index = b;
+}
+
+static void _timer_heap_up(struct socket_loop *loop, unsigned int i)
+{
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (loop->timers[parent]->deadline <= loop->timers[i]->deadline) {
+			break;
+		}
+		_timer_heap_swap(loop, i, parent);
+		i = parent;
+	}
+}
+
+static void _timer_heap_down(struct socket_loop *loop, unsigned int i)
+{
+	while (1) {
+		unsigned int l = 2*i + 1;
+		unsigned int r = l + 1;
+		unsigned int m = i;
+		if (l < loop->num_timers && loop->timers[l]->deadline < loop->timers[m]->deadline) {
+			m = l;
+		}
+		if (r < loop->num_timers && loop->timers[r]->deadline < loop->timers[m]->deadline) {
+			m = r;
+		}
+		if (m == i) {
+			break;
+		}
+		_timer_heap_swap(loop, i, m);
+		i = m;
+	}
+}
+
+static int _timer_heap_push(struct socket_loop *loop, struct socket_loop_timer *timer)
+{
+	if (loop->num_timers == loop->timers_size) {
+		unsigned int newsize = (loop->timers_size) ? loop->timers_size * 2 : 16;
+		struct socket_loop_timer **newtimers = realloc(loop->timers, newsize * sizeof(struct socket_loop_timer*));
+		if (!newtimers) {
+			return -ENOMEM;
+		}
+		loop->timers = newtimers;
+		loop->timers_size = newsize;
+	}
+	timer->heap_index = loop->num_timers;
+	loop->timers[loop->num_timers++] = timer;
+	_timer_heap_up(loop, timer->heap_index);
+	return 0;
+}
+
+static void _timer_heap_remove(struct socket_loop *loop, struct socket_loop_timer *timer)
+{
+	unsigned int i = timer->heap_index;
+	if (i == TIMER_NOT_QUEUED) {
+		return;
+	}
+	loop->num_timers--;
+	if (i != loop->num_timers) {
+		_timer_heap_swap(loop, i, loop->num_timers);
+		_timer_heap_down(loop, i);
+		_timer_heap_up(loop, i);
+	}
+	timer->heap_index = TIMER_NOT_QUEUED;
+}
+
+static void _socket_loop_wake_drain(struct socket_loop *loop)
+{
+	char buf[64];
+#ifdef _WIN32
+	while (recv(loop->wake_rfd, buf, sizeof(buf), 0) > 0);
+#else
+	while (read(loop->wake_rfd, buf, sizeof(buf)) > 0);
+#endif
+}
+
+socket_loop_t socket_loop_new(void)
+{
+	struct socket_loop *loop = calloc(1, sizeof(struct socket_loop));
+	if (!loop) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	loop->wake_rfd = -1;
+	loop->wake_wfd = -1;
+	loop->pollset = socket_pollset_new();
+	if (!loop->pollset) {
+		free(loop);
+		return NULL;
+	}
+	mutex_init(&loop->posts_lock);
+	loop->posts_tail = &loop->posts;
+#ifdef HAVE_SYS_EVENTFD_H
+	loop->wake_rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop->wake_wfd = loop->wake_rfd;
+	if (loop->wake_rfd < 0) {
+		SOCKET_ERR(1, "%s: eventfd: %s\n", __func__, strerror(errno));
+		socket_loop_free(loop);
+		return NULL;
+	}
+#elif defined(_WIN32)
+	int pfd[2];
+	if (socket_pair(SOCK_STREAM, pfd) < 0) {
+		SOCKET_ERR(1, "%s: socket_pair: %s\n", __func__, strerror(errno));
+		socket_loop_free(loop);
+		return NULL;
+	}
+	loop->wake_rfd = pfd[0];
+	loop->wake_wfd = pfd[1];
+	_socket_set_nonblocking(pfd[0]);
+	_socket_set_nonblocking(pfd[1]);
+#else
+	int pfd[2];
+	if (pipe(pfd) < 0) {
+		SOCKET_ERR(1, "%s: pipe: %s\n", __func__, strerror(errno));
+		socket_loop_free(loop);
+		return NULL;
+	}
+	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(pfd[1], F_SETFL, fcntl(pfd[1], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	loop->wake_rfd = pfd[0];
+	loop->wake_wfd = pfd[1];
+#endif
+	int res = socket_pollset_add(loop->pollset, loop->wake_rfd, FDE_READ, NULL);
+	if (res < 0) {
+		socket_loop_free(loop);
+		errno = -res;
+		return NULL;
+	}
+	return loop;
+}
+
+void socket_loop_free(socket_loop_t loop)
+{
+	unsigned int i;
+	if (!loop) {
+		return;
+	}
+	socket_pollset_free(loop->pollset);
+#ifdef _WIN32
+	if (loop->wake_rfd >= 0) {
+		socket_close(loop->wake_rfd);
+	}
+	if (loop->wake_wfd >= 0) {
+		socket_close(loop->wake_wfd);
+	}
+#else
+	if (loop->wake_rfd >= 0) {
+		close(loop->wake_rfd);
+	}
+	if (loop->wake_wfd >= 0 && loop->wake_wfd != loop->wake_rfd) {
+		close(loop->wake_wfd);
+	}
+#endif
+	for (i = 0; i < loop->num_timers; i++) {
+		free(loop->timers[i]);
+	}
+	free(loop->timers);
+	while (loop->posts) {
+		struct socket_loop_post *post = loop->posts;
+		loop->posts = post->next;
+		free(post);
+	}
+	mutex_destroy(&loop->posts_lock);
+	free(loop->sources);
+	free(loop);
+}
+
+int socket_loop_add(socket_loop_t loop, int fd, unsigned int events, socket_loop_io_cb_t cb, void *user_data)
+{
+	if (!loop || fd < 0 || !cb) {
+		return -EINVAL;
+	}
+	if ((unsigned int)fd >= loop->sources_size) {
+		unsigned int newsize = (loop->sources_size) ? loop->sources_size : 64;
+		while (newsize <= (unsigned int)fd) {
+			newsize *= 2;
+		}
+		struct socket_loop_source *newsources = realloc(loop->sources, newsize * sizeof(struct socket_loop_source));
+		if (!newsources) {
+			return -ENOMEM;
+		}
+		for (unsigned int i = loop->sources_size; i < newsize; i++) {
+			memset(&newsources[i], 0, sizeof(struct socket_loop_source));
+			newsources[i].fd = -1;
+		}
+		loop->sources = newsources;
+		loop->sources_size = newsize;
+	}
+	struct socket_loop_source *src = &loop->sources[fd];
+	if (src->fd >= 0) {
+		if (src->cb) {
+			return -EEXIST;
+		}
+		/* only a write handler is registered, share the source with it */
+		int res = socket_pollset_modify(loop->pollset, fd, events | FDE_WRITE);
+		if (res < 0) {
+			return res;
+		}
+		src->events = events;
+		src->cb = cb;
+		src->user_data = user_data;
+		return 0;
+	}
+	if (++loop->gen == 0) {
+		loop->gen = 1;
+	}
+	/* the generation lets dispatch detect sources that were replaced by a callback */
+	int res = socket_pollset_add(loop->pollset, fd, events, (void*)(uintptr_t)loop->gen);
+	if (res < 0) {
+		return res;
+	}
+	src->fd = fd;
+	src->gen = loop->gen;
+	src->events = events;
+	src->cb = cb;
+	src->user_data = user_data;
+	src->wcb = NULL;
+	src->wdata = NULL;
+	return 0;
+}
+
+int socket_loop_modify(socket_loop_t loop, int fd, unsigned int events)
+{
+	if (!loop || fd < 0 || (unsigned int)fd >= loop->sources_size || loop->sources[fd].fd < 0 || !loop->sources[fd].cb) {
+		return -ENOENT;
+	}
+	struct socket_loop_source *src = &loop->sources[fd];
+	int res = socket_pollset_modify(loop->pollset, fd, events | ((src->wcb) ? FDE_WRITE : 0));
+	if (res == 0) {
+		src->events = events;
+	}
+	return res;
+}
+
+int socket_loop_remove(socket_loop_t loop, int fd)
+{
+	if (!loop || fd < 0 || (unsigned int)fd >= loop->sources_size || loop->sources[fd].fd < 0 || !loop->sources[fd].cb) {
+		return -ENOENT;
+	}
+	struct socket_loop_source *src = &loop->sources[fd];
+	src->cb = NULL;
+	src->user_data = NULL;
+	src->events = 0;
+	if (src->wcb) {
+		/* the write handler keeps the source */
+		socket_pollset_modify(loop->pollset, fd, FDE_WRITE);
+		return 0;
+	}
+	socket_pollset_remove(loop->pollset, fd);
+	src->fd = -1;
+	return 0;
+}
+
+/* Attaches (cb != NULL) or detaches the write handler of fd. It is invoked
+ * for FDE_WRITE, FDE_HUP and FDE_ERROR independently of a callback added
+ * with socket_loop_add() for the same fd. */
+static int _socket_loop_set_writer(struct socket_loop *loop, int fd, socket_loop_io_cb_t cb, void *user_data)
+{
+	int res;
+	if (cb) {
+		if ((unsigned int)fd >= loop->sources_size || loop->sources[fd].fd < 0) {
+			res = socket_loop_add(loop, fd, 0, cb, user_data);
+			if (res < 0) {
+				return res;
+			}
+			/* turn the new source into a writer-only one */
+			struct socket_loop_source *src = &loop->sources[fd];
+			src->cb = NULL;
+			src->user_data = NULL;
+			src->wcb = cb;
+			src->wdata = user_data;
+			res = socket_pollset_modify(loop->pollset, fd, FDE_WRITE);
+			if (res < 0) {
+				src->wcb = NULL;
+				socket_pollset_remove(loop->pollset, fd);
+				src->fd = -1;
+			}
+			return res;
+		}
+		struct socket_loop_source *src = &loop->sources[fd];
+		if (src->wcb) {
+			return -EEXIST;
+		}
+		res = socket_pollset_modify(loop->pollset, fd, src->events | FDE_WRITE);
+		if (res == 0) {
+			src->wcb = cb;
+			src->wdata = user_data;
+		}
+		return res;
+	}
+	if ((unsigned int)fd >= loop->sources_size || loop->sources[fd].fd < 0 || !loop->sources[fd].wcb) {
+		return -ENOENT;
+	}
+	struct socket_loop_source *src = &loop->sources[fd];
+	src->wcb = NULL;
+	src->wdata = NULL;
+	if (!src->cb) {
+		socket_pollset_remove(loop->pollset, fd);
+		src->fd = -1;
+		return 0;
+	}
+	return socket_pollset_modify(loop->pollset, fd, src->events);
+}
+
+socket_loop_timer_t socket_loop_timer_add(socket_loop_t loop, unsigned int timeout_ms, unsigned int interval_ms, socket_loop_timer_cb_t cb, void *user_data)
+{
+	if (!loop || !cb) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct socket_loop_timer *timer = calloc(1, sizeof(struct socket_loop_timer));
+	if (!timer) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	timer->deadline = _monotonic_ms() + timeout_ms;
+	timer->interval = interval_ms;
+	timer->cb = cb;
+	timer->user_data = user_data;
+	if (_timer_heap_push(loop, timer) < 0) {
+		free(timer);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return timer;
+}
+
+void socket_loop_timer_cancel(socket_loop_t loop, socket_loop_timer_t timer)
+{
+	if (!loop || !timer) {
+		return;
+	}
+	if (timer == loop->current_timer) {
+		/* cancelled from inside its own callback, freed by the dispatcher */
+		timer->cancelled = 1;
+		return;
+	}
+	_timer_heap_remove(loop, timer);
+	free(timer);
+}
+
+int socket_loop_post(socket_loop_t loop, socket_loop_post_cb_t cb, void *user_data)
+{
+	if (!loop || !cb) {
+		return -EINVAL;
+	}
+	struct socket_loop_post *post = malloc(sizeof(struct socket_loop_post));
+	if (!post) {
+		return -ENOMEM;
+	}
+	post->next = NULL;
+	post->cb = cb;
+	post->user_data = user_data;
+	mutex_lock(&loop->posts_lock);
+	*loop->posts_tail = post;
+	loop->posts_tail = &post->next;
+	mutex_unlock(&loop->posts_lock);
+	socket_loop_wakeup(loop);
+	return 0;
+}
+
+/* Drops queued posts matching cb and user_data; used when their target goes
+ * away. Posts already taken by the dispatcher still run. Returns the number
+ * of dropped posts. */
+static unsigned int _socket_loop_cancel_posts(struct socket_loop *loop, socket_loop_post_cb_t cb, void *user_data)
+{
+	unsigned int count = 0;
+	mutex_lock(&loop->posts_lock);
+	struct socket_loop_post **pp = &loop->posts;
+	while (*pp) {
+		struct socket_loop_post *post = *pp;
+		if (post->cb == cb && post->user_data == user_data) {
+			*pp = post->next;
+			free(post);
+			count++;
+		} else {
+			pp = &post->next;
+		}
+	}
+	loop->posts_tail = pp;
+	mutex_unlock(&loop->posts_lock);
+	return count;
+}
+
+static int _socket_loop_dispatch_posts(struct socket_loop *loop)
+{
+	int count = 0;
+	mutex_lock(&loop->posts_lock);
+	struct socket_loop_post *post = loop->posts;
+	loop->posts = NULL;
+	loop->posts_tail = &loop->posts;
+	mutex_unlock(&loop->posts_lock);
+	while (post) {
+		struct socket_loop_post *next = post->next;
+		post->cb(loop, post->user_data);
+		free(post);
+		post = next;
+		count++;
+	}
+	return count;
+}
+
+static int _socket_loop_dispatch_timers(struct socket_loop *loop)
+{
+	int count = 0;
+	uint64_t now = _monotonic_ms();
+	while (loop->num_timers > 0 && loop->timers[0]->deadline <= now) {
+		struct socket_loop_timer *timer = loop->timers[0];
+		if (timer->interval > 0) {
+			/* rescheduled in place, so the timer never leaves the heap and
+			 * its handle stays valid until it is cancelled */
+			timer->deadline += timer->interval;
+			if (timer->deadline <= now) {
+				timer->deadline = now + timer->interval;
+			}
+			_timer_heap_down(loop, 0);
+		} else {
+			_timer_heap_remove(loop, timer);
+		}
+		loop->current_timer = timer;
+		timer->cb(loop, timer, timer->user_data);
+		loop->current_timer = NULL;
+		count++;
+		if (timer->cancelled) {
+			_timer_heap_remove(loop, timer);
+			free(timer);
+		} else if (timer->interval == 0) {
+			free(timer);
+		}
+	}
+	return count;
+}
+
+static int _socket_loop_wait_timeout(struct socket_loop *loop, int timeout_ms)
+{
+	if (loop->num_timers == 0) {
+		return timeout_ms;
+	}
+	uint64_t now = _monotonic_ms();
+	uint64_t deadline = loop->timers[0]->deadline;
+	int64_t diff = (deadline > now) ? (int64_t)(deadline - now) : 0;
+	if (timeout_ms < 0 || diff < timeout_ms) {
+		return (diff > INT32_MAX) ? INT32_MAX : (int)diff;
+	}
+	return timeout_ms;
+}
+
+int socket_loop_run_once(socket_loop_t loop, int timeout_ms)
+{
+	struct socket_pollset_event events[SOCKET_LOOP_MAX_EVENTS];
+	int count = 0;
+	int i;
+	if (!loop) {
+		return -EINVAL;
+	}
+	int wait_ms = _socket_loop_wait_timeout(loop, timeout_ms);
+	int n = socket_pollset_wait(loop->pollset, events, SOCKET_LOOP_MAX_EVENTS, wait_ms);
+	if (n < 0) {
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		int fd = events[i].fd;
+		if (fd == loop->wake_rfd) {
+			_socket_loop_wake_drain(loop);
+			count += _socket_loop_dispatch_posts(loop);
+			continue;
+		}
+		/* skip events for sources removed or replaced by an earlier callback */
+		uint32_t gen = (uint32_t)(uintptr_t)events[i].user_data;
+		if ((unsigned int)fd >= loop->sources_size || loop->sources[fd].fd != fd || loop->sources[fd].gen != gen) {
+			continue;
+		}
+		struct socket_loop_source *src = &loop->sources[fd];
+		unsigned int ev = events[i].events;
+		if (src->wcb && (ev & (FDE_WRITE | FDE_HUP | FDE_ERROR))) {
+			src->wcb(loop, fd, ev, src->wdata);
+			count++;
+			/* the handler may have detached and taken the source with it */
+			src = &loop->sources[fd];
+			if (src->fd != fd || src->gen != gen) {
+				continue;
+			}
+		}
+		ev &= src->events | FDE_HUP | FDE_ERROR;
+		if (src->cb && ev) {
+			src->cb(loop, fd, ev, src->user_data);
+			count++;
+		}
+	}
+	count += _socket_loop_dispatch_timers(loop);
+	return count;
+}
+
+int socket_loop_run(socket_loop_t loop)
+{
+	if (!loop) {
+		return -EINVAL;
+	}
+	while (!loop->stop) {
+		int res = socket_loop_run_once(loop, -1);
+		if (res < 0) {
+			loop->stop = 0;
+			return res;
+		}
+	}
+	loop->stop = 0;
+	return 0;
+}
+
+void socket_loop_wakeup(socket_loop_t loop)
+{
+	if (!loop) {
+		return;
+	}
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+#ifdef _WIN32
+	/* a full socket buffer means a wakeup is pending already */
+	if (send(loop->wake_wfd, &one, sizeof(one), 0) < 0 && _socket_errno() != EWOULDBLOCK) {
+		SOCKET_ERR(2, "%s: send: %s\n", __func__, strerror(errno));
+	}
+#else
+	if (write(loop->wake_wfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		SOCKET_ERR(2, "%s: write: %s\n", __func__, strerror(errno));
+	}
+#endif
+}
+
+void socket_loop_stop(socket_loop_t loop)
+{
+	if (!loop) {
+		return;
+	}
+	loop->stop = 1;
+	socket_loop_wakeup(loop);
+}
+#else
+socket_pollset_t socket_pollset_new(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void socket_pollset_free(socket_pollset_t ps)
+{
+}
+
+int socket_pollset_add(socket_pollset_t ps, int fd, unsigned int events, void *user_data)
+{
+	return -ENOSYS;
+}
+
+int socket_pollset_modify(socket_pollset_t ps, int fd, unsigned int events)
+{
+	return -ENOSYS;
+}
+
+int socket_pollset_remove(socket_pollset_t ps, int fd)
+{
+	return -ENOSYS;
+}
+
+int socket_pollset_wait(socket_pollset_t ps, struct socket_pollset_event *events, int max_events, int timeout_ms)
+{
+	return -ENOSYS;
+}
+
+socket_loop_t socket_loop_new(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void socket_loop_free(socket_loop_t loop)
+{
+}
+
+int socket_loop_add(socket_loop_t loop, int fd, unsigned int events, socket_loop_io_cb_t cb, void *user_data)
+{
+	return -ENOSYS;
+}
+
+int socket_loop_modify(socket_loop_t loop, int fd, unsigned int events)
+{
+	return -ENOSYS;
+}
+
+int socket_loop_remove(socket_loop_t loop, int fd)
+{
+	return -ENOSYS;
+}
+
+socket_loop_timer_t socket_loop_timer_add(socket_loop_t loop, unsigned int timeout_ms, unsigned int interval_ms, socket_loop_timer_cb_t cb, void *user_data)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void socket_loop_timer_cancel(socket_loop_t loop, socket_loop_timer_t timer)
+{
+}
+
+int socket_loop_run_once(socket_loop_t loop, int timeout_ms)
+{
+	return -ENOSYS;
+}
+
+int socket_loop_run(socket_loop_t loop)
+{
+	return -ENOSYS;
+}
+
+void socket_loop_stop(socket_loop_t loop)
+{
+}
+
+void socket_loop_wakeup(socket_loop_t loop)
+{
+}
+
+int socket_loop_post(socket_loop_t loop, socket_loop_post_cb_t cb, void *user_data)
+{
+	return -ENOSYS;
+}
+
+static int _socket_loop_set_writer(struct socket_loop *loop, int fd, socket_loop_io_cb_t cb, void *user_data)
+{
+	return -ENOSYS;
+}
+
+static unsigned int _socket_loop_cancel_posts(struct socket_loop *loop, socket_loop_post_cb_t cb, void *user_data)
+{
+	return 0;
+}
+#endif
+
+#define RELAY_DEFAULT_BUFFERED 0x10000
+
+struct socket_relay_dir {
+	int src;
+	int dst;
+	int pipe[2];
+	char *buf;
+	size_t buf_off;
+	size_t pending;
+	int eof;
+	int shut;
+	int hup;
+	uint64_t bytes;
+};
+
+struct socket_relay {
+	socket_loop_t loop;
+	int fd_a;
+	int fd_b;
+	size_t max_buffered;
+	struct socket_relay_dir ab;
+	struct socket_relay_dir ba;
+	socket_relay_done_cb_t done_cb;
+	void *user_data;
+	int finished;
+};
+
+/* Moves as much data as possible from src to dst without blocking.
+ * Returns 0 or a negative errno on a fatal error. */
+static int _socket_relay_pump(struct socket_relay *relay, struct socket_relay_dir *dir)
+{
+	int progress;
+	do {
+		progress = 0;
+		if (dir->pending > 0) {
+			ssize_t w;
+#ifdef HAVE_SPLICE
+			if (dir->pipe[0] >= 0) {
+				w = splice(dir->pipe[0], NULL, dir->dst, NULL, dir->pending, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+			} else
+#endif
+			{
+				int flags = 0;
+#ifdef MSG_NOSIGNAL
+				flags |= MSG_NOSIGNAL;
+#endif
+				w = send(dir->dst, dir->buf + dir->buf_off, dir->pending, flags);
+			}
+			if (w > 0) {
+				dir->pending -= w;
+				dir->buf_off = (dir->pending > 0) ? dir->buf_off + w : 0;
+				dir->bytes += w;
+				progress = 1;
+			} else if (w < 0) {
+				int err = _socket_errno();
+				if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+					SOCKET_ERR(2, "%s: write to fd %d failed: %s\n", __func__, dir->dst, strerror(err));
+					return -err;
+				}
+			}
+		}
+		if (!dir->eof && dir->pending < relay->max_buffered) {
+			ssize_t r;
+			size_t space = relay->max_buffered - dir->pending;
+#ifdef HAVE_SPLICE
+			if (dir->pipe[1] >= 0) {
+				r = splice(dir->src, NULL, dir->pipe[1], NULL, space, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+			} else
+#endif
+			{
+				if (dir->buf_off + dir->pending == relay->max_buffered) {
+					memmove(dir->buf, dir->buf + dir->buf_off, dir->pending);
+					dir->buf_off = 0;
+				}
+				space = relay->max_buffered - (dir->buf_off + dir->pending);
+				r = recv(dir->src, dir->buf + dir->buf_off + dir->pending, space, 0);
+			}
+			if (r > 0) {
+				dir->pending += r;
+				progress = 1;
+			} else if (r == 0) {
+				dir->eof = 1;
+				progress = 1;
+			} else {
+				int err = _socket_errno();
+				if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+					SOCKET_ERR(2, "%s: read from fd %d failed: %s\n", __func__, dir->src, strerror(err));
+					return -err;
+				}
+			}
+		}
+	} while (progress);
+
+	if (dir->eof && dir->pending == 0 && !dir->shut) {
+		/* propagate the half-close to the other side */
+		socket_shutdown(dir->dst, SHUT_WR);
+		dir->shut = 1;
+	}
+	return 0;
+}
+
+static unsigned int _socket_relay_interest(struct socket_relay *relay, struct socket_relay_dir *in, struct socket_relay_dir *out)
+{
+	unsigned int events = 0;
+	if (!in->eof && in->pending < relay->max_buffered) {
+		events |= FDE_READ;
+	}
+	if (out->pending > 0) {
+		events |= FDE_WRITE;
+	}
+	return events;
+}
+
+static void _socket_relay_finish(struct socket_relay *relay, int error)
+{
+	relay->finished = 1;
+	socket_loop_remove(relay->loop, relay->fd_a);
+	socket_loop_remove(relay->loop, relay->fd_b);
+	if (relay->done_cb) {
+		/* must be the last thing we do, the callback may free the relay */
+		relay->done_cb(relay, error, relay->user_data);
+	}
+}
+
+static void _socket_relay_io_cb(socket_loop_t loop, int fd, unsigned int events, void *user_data)
+{
+	struct socket_relay *relay = (struct socket_relay*)user_data;
+	int res;
+
+	if (relay->finished) {
+		return;
+	}
+	res = _socket_relay_pump(relay, &relay->ab);
+	if (res == 0) {
+		res = _socket_relay_pump(relay, &relay->ba);
+	}
+	if (res < 0) {
+		_socket_relay_finish(relay, res);
+		return;
+	}
+	if ((relay->ab.shut && relay->ba.shut) || (relay->ab.hup && relay->ab.shut) || (relay->ba.hup && relay->ba.shut)) {
+		_socket_relay_finish(relay, 0);
+		return;
+	}
+	if (events & (FDE_HUP | FDE_ERROR)) {
+		struct socket_relay_dir *in = (fd == relay->fd_a) ? &relay->ab : &relay->ba;
+		if (in->eof) {
+			/* the peer is gone in both directions, nothing more can be written to it */
+			_socket_relay_finish(relay, (events & FDE_ERROR) ? -ECONNRESET : 0);
+			return;
+		}
+		/* Data is still queued on the hung up socket, but its direction is
+		 * paused for backpressure. HUP is reported regardless of the
+		 * requested events, so stop watching the socket; the rest is read
+		 * whenever the other side becomes writable. */
+		in->hup = 1;
+		socket_loop_remove(loop, fd);
+	}
+	if (!relay->ab.hup) {
+		socket_loop_modify(loop, relay->fd_a, _socket_relay_interest(relay, &relay->ab, &relay->ba));
+	}
+	if (!relay->ba.hup) {
+		socket_loop_modify(loop, relay->fd_b, _socket_relay_interest(relay, &relay->ba, &relay->ab));
+	}
+}
+
+static int _socket_relay_dir_init(struct socket_relay *relay, struct socket_relay_dir *dir, int src, int dst)
+{
+	dir->src = src;
+	dir->dst = dst;
+	dir->pipe[0] = -1;
+	dir->pipe[1] = -1;
+#ifdef HAVE_SPLICE
+	if (pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+		if ((size_t)fcntl(dir->pipe[1], F_GETPIPE_SZ) < relay->max_buffered) {
+			fcntl(dir->pipe[1], F_SETPIPE_SZ, (int)relay->max_buffered);
+		}
+		int pipe_size = fcntl(dir->pipe[1], F_GETPIPE_SZ);
+		if (pipe_size > 0 && (size_t)pipe_size < relay->max_buffered) {
+			relay->max_buffered = (size_t)pipe_size;
+		}
+		return 0;
+	}
+	SOCKET_ERR(2, "%s: pipe2: %s, using buffered relay\n", __func__, strerror(errno));
+	dir->pipe[0] = -1;
+	dir->pipe[1] = -1;
+#endif
+	dir->buf = (char*)malloc(relay->max_buffered);
+	if (!dir->buf) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void _socket_relay_dir_free(struct socket_relay_dir *dir)
+{
+	if (dir->pipe[0] >= 0) {
+		close(dir->pipe[0]);
+	}
+	if (dir->pipe[1] >= 0) {
+		close(dir->pipe[1]);
+	}
+	free(dir->buf);
+}
+
+socket_relay_t socket_relay_new(socket_loop_t loop, int fd_a, int fd_b, size_t max_buffered, socket_relay_done_cb_t done_cb, void *user_data)
+{
+	if (!loop || fd_a < 0 || fd_b < 0 || fd_a == fd_b) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct socket_relay *relay = (struct socket_relay*)calloc(1, sizeof(struct socket_relay));
+	if (!relay) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	relay->loop = loop;
+	relay->fd_a = fd_a;
+	relay->fd_b = fd_b;
+	relay->max_buffered = (max_buffered > 0) ? max_buffered : RELAY_DEFAULT_BUFFERED;
+	relay->done_cb = done_cb;
+	relay->user_data = user_data;
+	relay->ab.pipe[0] = relay->ab.pipe[1] = -1;
+	relay->ba.pipe[0] = relay->ba.pipe[1] = -1;
+
+	int res = _socket_relay_dir_init(relay, &relay->ab, fd_a, fd_b);
+	if (res == 0) {
+		res = _socket_relay_dir_init(relay, &relay->ba, fd_b, fd_a);
+	}
+	if (res == 0 && (_socket_set_nonblocking(fd_a) < 0 || _socket_set_nonblocking(fd_b) < 0)) {
+		res = -errno;
+	}
+	if (res == 0) {
+		res = socket_loop_add(loop, fd_a, FDE_READ, _socket_relay_io_cb, relay);
+	}
+	if (res == 0) {
+		res = socket_loop_add(loop, fd_b, FDE_READ, _socket_relay_io_cb, relay);
+		if (res < 0) {
+			socket_loop_remove(loop, fd_a);
+		}
+	}
+	if (res < 0) {
+		_socket_relay_dir_free(&relay->ab);
+		_socket_relay_dir_free(&relay->ba);
+		free(relay);
+		errno = -res;
+		return NULL;
+	}
+	return relay;
+}
+
+void socket_relay_free(socket_relay_t relay)
+{
+	if (!relay) {
+		return;
+	}
+	if (!relay->finished) {
+		socket_loop_remove(relay->loop, relay->fd_a);
+		socket_loop_remove(relay->loop, relay->fd_b);
+	}
+	_socket_relay_dir_free(&relay->ab);
+	_socket_relay_dir_free(&relay->ba);
+	free(relay);
+}
+
+void socket_relay_get_stats(socket_relay_t relay, uint64_t *bytes_a_to_b, uint64_t *bytes_b_to_a)
+{
+	if (!relay) {
+		return;
+	}
+	if (bytes_a_to_b) {
+		*bytes_a_to_b = relay->ab.bytes;
+	}
+	if (bytes_b_to_a) {
+		*bytes_b_to_a = relay->ba.bytes;
+	}
+}
+
+#define LISTENER_MAX_SHARDS 64
+#define LISTENER_ACCEPT_BACKOFF 100
+
+struct socket_listener_shard {
+	struct socket_listener *listener;
+	unsigned int index;
+	int fd;
+	socket_loop_t loop;
+	THREAD_T thread;
+	int started;
+	int paused;
+};
+
+struct socket_listener {
+	unsigned int num_shards;
+	struct socket_listener_shard *shards;
+	uint16_t port;
+	int shared_fd;
+	socket_listener_accept_cb_t cb;
+	void *user_data;
+};
+
+static void _socket_listener_resume_cb(socket_loop_t loop, socket_loop_timer_t timer, void *user_data)
+{
+	struct socket_listener_shard *shard = (struct socket_listener_shard*)user_data;
+	shard->paused = 0;
+	socket_loop_modify(loop, shard->fd, FDE_READ);
+}
+
+static void _socket_listener_accept_cb(socket_loop_t loop, int fd, unsigned int events, void *user_data)
+{
+	struct socket_listener_shard *shard = (struct socket_listener_shard*)user_data;
+	struct socket_listener *listener = shard->listener;
+
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int cfd = socket_accept_ex(fd, (struct sockaddr*)&addr, &addr_len, SOCKET_ACCEPT_NONBLOCK | SOCKET_ACCEPT_CLOEXEC);
+		if (cfd < 0) {
+			int err = errno;
+			if (err == EINTR || err == ECONNABORTED) {
+				continue;
+			}
+			if (err != EAGAIN && err != EWOULDBLOCK && !shard->paused) {
+				/* e.g. EMFILE/ENFILE/ENOBUFS: the pending connection stays
+				 * queued and the socket readable, so stop watching it for a
+				 * while instead of spinning until resources free up */
+				SOCKET_ERR(1, "%s: shard %u accept: %s, pausing for %d ms\n", __func__, shard->index, strerror(err), LISTENER_ACCEPT_BACKOFF);
+				if (socket_loop_timer_add(loop, LISTENER_ACCEPT_BACKOFF, 0, _socket_listener_resume_cb, shard)) {
+					socket_loop_modify(loop, fd, 0);
+					shard->paused = 1;
+				}
+			}
+			break;
+		}
+		listener->cb(listener, cfd, (struct sockaddr*)&addr, addr_len, shard->index, listener->user_data);
+	}
+}
+
+static void* _socket_listener_thread(void *data)
+{
+	struct socket_listener_shard *shard = (struct socket_listener_shard*)data;
+	socket_loop_run(shard->loop);
+	return NULL;
+}
+
+socket_listener_t socket_listener_new(const char *addr, uint16_t port, unsigned int num_shards, int backlog, const struct socket_options *opts, socket_listener_accept_cb_t cb, void *user_data)
+{
+	unsigned int i;
+	int res = 0;
+
+	if (!cb) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (num_shards == 0) {
+		num_shards = (unsigned int)thread_get_cpu_count();
+	}
+	if (num_shards > LISTENER_MAX_SHARDS) {
+		num_shards = LISTENER_MAX_SHARDS;
+	}
+	struct socket_listener *listener = (struct socket_listener*)calloc(1, sizeof(struct socket_listener));
+	if (!listener) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	listener->shards = (struct socket_listener_shard*)calloc(num_shards, sizeof(struct socket_listener_shard));
+	if (!listener->shards) {
+		free(listener);
+		errno = ENOMEM;
+		return NULL;
+	}
+	listener->num_shards = num_shards;
+	listener->cb = cb;
+	listener->user_data = user_data;
+	for (i = 0; i < num_shards; i++) {
+		listener->shards[i].fd = -1;
+	}
+#ifndef SO_REUSEPORT
+	/* no SO_REUSEPORT: all shards accept from the same socket */
+	listener->shared_fd = 1;
+#endif
+
+	for (i = 0; i < num_shards && res == 0; i++) {
+		struct socket_listener_shard *shard = &listener->shards[i];
+		shard->listener = listener;
+		shard->index = i;
+		if (i == 0 || !listener->shared_fd) {
+			shard->fd = _socket_create_listener(addr, (i == 0) ? port : listener->port, backlog, opts, 1);
+			if (shard->fd < 0) {
+				res = -errno;
+				break;
+			}
+			if (i == 0 && socket_get_socket_port(shard->fd, &listener->port) < 0) {
+				res = -errno;
+				break;
+			}
+			if (_socket_set_nonblocking(shard->fd) < 0) {
+				res = -errno;
+				break;
+			}
+		} else {
+			shard->fd = listener->shards[0].fd;
+		}
+		shard->loop = socket_loop_new();
+		if (!shard->loop) {
+			res = -errno;
+			break;
+		}
+		res = socket_loop_add(shard->loop, shard->fd, FDE_READ, _socket_listener_accept_cb, shard);
+	}
+	for (i = 0; i < num_shards && res == 0; i++) {
+		struct socket_listener_shard *shard = &listener->shards[i];
+		if (thread_new(&shard->thread, _socket_listener_thread, shard) != 0) {
+			res = -EAGAIN;
+			break;
+		}
+		shard->started = 1;
+		if (thread_set_cpu_affinity(shard->thread, i) < 0) {
+			SOCKET_ERR(2, "%s: could not pin shard %u to a CPU\n", __func__, i);
+		}
+	}
+	if (res < 0) {
+		SOCKET_ERR(1, "%s: failed to set up listener: %s\n", __func__, strerror(-res));
+		socket_listener_free(listener);
+		errno = -res;
+		return NULL;
+	}
+	return listener;
+}
+
+void socket_listener_free(socket_listener_t listener)
+{
+	unsigned int i;
+	if (!listener) {
+		return;
+	}
+	for (i = 0; i < listener->num_shards; i++) {
+		struct socket_listener_shard *shard = &listener->shards[i];
+		if (shard->started) {
+			socket_loop_stop(shard->loop);
+			thread_join(shard->thread);
+			thread_free(shard->thread);
+		}
+	}
+	for (i = 0; i < listener->num_shards; i++) {
+		struct socket_listener_shard *shard = &listener->shards[i];
+		socket_loop_free(shard->loop);
+		if (shard->fd >= 0 && (i == 0 || !listener->shared_fd)) {
+			socket_close(shard->fd);
+		}
+	}
+	free(listener->shards);
+	free(listener);
+}
+
+uint16_t socket_listener_get_port(socket_listener_t listener)
+{
+	return (listener) ? listener->port : 0;
+}
+
+unsigned int socket_listener_get_num_shards(socket_listener_t listener)
+{
+	return (listener) ? listener->num_shards : 0;
+}
+
+#define WRITEQ_CHUNK_SIZE 0x4000
+#define WRITEQ_MAX_IOV 64
+#define WRITEQ_DEFAULT_HIGH_WATER 0x100000
+
+struct socket_writeq_chunk {
+	struct socket_writeq_chunk *next;
+	size_t off;
+	size_t len;
+	size_t cap;
+	char data[];
+};
+
+struct socket_writeq {
+	socket_loop_t loop;
+	int fd;
+	mutex_t lock;
+	struct socket_writeq_chunk *head;
+	struct socket_writeq_chunk *tail;
+	size_t pending;
+	size_t low_water;
+	size_t high_water;
+	int above_high;
+	int armed;
+	int post_queued;
+	int error;
+	/* one for the owner and one per queued post */
+	unsigned int refs;
+	int freed;
+	socket_writeq_cb_t cb;
+	void *user_data;
+};
+
+/* Non-blocking gather write. Returns the bytes written, 0 if the socket
+ * is not writable, or a negative errno. */
+static int _socket_sendv_nonblock(int fd, struct iovec *iov, int iovcnt)
+{
+	int s;
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef _WIN32
+	WSABUF stackbufs[WSABUF_STACK_COUNT];
+	WSABUF *bufs = _iovec_to_wsabuf(iov, iovcnt, stackbufs);
+	DWORD sent = 0;
+	if (!bufs) {
+		return -ENOMEM;
+	}
+	s = (WSASend(fd, bufs, iovcnt, &sent, (DWORD)flags, NULL, NULL) == SOCKET_ERROR) ? -1 : (int)sent;
+	if (bufs != stackbufs) {
+		free(bufs);
+	}
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+#endif
+	do {
+		s = (int)sendmsg(fd, &msg, flags);
+	} while (s < 0 && errno == EINTR);
+#endif
+	if (s < 0) {
+		int err = _socket_errno();
+		if (err == EAGAIN || err == EWOULDBLOCK) {
+			return 0;
+		}
+		return -err;
+	}
+	return s;
+}
+
+/* Writes as much queued data as the socket takes. Called with wq->lock held.
+ * Returns 0 or a negative errno. */
+static int _socket_writeq_flush_locked(struct socket_writeq *wq)
+{
+	struct iovec iov[WRITEQ_MAX_IOV];
+
+	while (wq->head) {
+		int iovcnt = 0;
+		struct socket_writeq_chunk *chunk;
+		for (chunk = wq->head; chunk && iovcnt < WRITEQ_MAX_IOV; chunk = chunk->next) {
+			iov[iovcnt].iov_base = chunk->data + chunk->off;
+			iov[iovcnt].iov_len = chunk->len - chunk->off;
+			iovcnt++;
+		}
+		int s = _socket_sendv_nonblock(wq->fd, iov, iovcnt);
+		if (s <= 0) {
+			return s;
+		}
+		size_t n = (size_t)s;
+		wq->pending -= n;
+		while (n > 0) {
+			chunk = wq->head;
+			size_t left = chunk->len - chunk->off;
+			if (n < left) {
+				chunk->off += n;
+				break;
+			}
+			n -= left;
+			wq->head = chunk->next;
+			if (!wq->head) {
+				wq->tail = NULL;
+			}
+			free(chunk);
+		}
+	}
+	return 0;
+}
+
+static void _socket_writeq_discard_locked(struct socket_writeq *wq)
+{
+	while (wq->head) {
+		struct socket_writeq_chunk *chunk = wq->head;
+		wq->head = chunk->next;
+		free(chunk);
+	}
+	wq->tail = NULL;
+	wq->pending = 0;
+}
+
+static void _socket_writeq_io_cb(socket_loop_t loop, int fd, unsigned int events, void *user_data)
+{
+	struct socket_writeq *wq = (struct socket_writeq*)user_data;
+	enum socket_writeq_event ev = SOCKET_WRITEQ_EVENT_NONE;
+	int err = 0;
+
+	mutex_lock(&wq->lock);
+	int res = _socket_writeq_flush_locked(wq);
+	if (res == 0 && (events & (FDE_ERROR | FDE_HUP)) && wq->head) {
+		res = -EPIPE;
+	}
+	if (res < 0) {
+		SOCKET_ERR(2, "%s: fd=%d write failed: %s\n", __func__, fd, strerror(-res));
+		wq->error = -res;
+		_socket_writeq_discard_locked(wq);
+		ev = SOCKET_WRITEQ_EVENT_ERROR;
+		err = wq->error;
+	} else if (wq->above_high && wq->pending <= wq->low_water) {
+		wq->above_high = 0;
+		ev = SOCKET_WRITEQ_EVENT_LOW_WATER;
+	}
+	if (!wq->head && wq->armed) {
+		_socket_loop_set_writer(loop, fd, NULL, NULL);
+		wq->armed = 0;
+	}
+	mutex_unlock(&wq->lock);
+
+	if (ev != SOCKET_WRITEQ_EVENT_NONE && wq->cb) {
+		wq->cb(wq, ev, err, wq->user_data);
+	}
+}
+
+static void _socket_writeq_unref(struct socket_writeq *wq, unsigned int count)
+{
+	mutex_lock(&wq->lock);
+	wq->refs -= count;
+	int last = (wq->refs == 0);
+	mutex_unlock(&wq->lock);
+	if (last) {
+		mutex_destroy(&wq->lock);
+		free(wq);
+	}
+}
+
+static void _socket_writeq_arm(socket_loop_t loop, void *user_data)
+{
+	struct socket_writeq *wq = (struct socket_writeq*)user_data;
+	int err = 0;
+
+	mutex_lock(&wq->lock);
+	wq->post_queued = 0;
+	if (!wq->freed && wq->head && !wq->armed && !wq->error) {
+		/* only adds write interest if the fd is already in the loop */
+		int res = _socket_loop_set_writer(loop, wq->fd, _socket_writeq_io_cb, wq);
+		if (res < 0) {
+			SOCKET_ERR(1, "%s: fd=%d could not register with loop: %s\n", __func__, wq->fd, strerror(-res));
+			/* nothing would ever flush the queue, fail it */
+			wq->error = -res;
+			_socket_writeq_discard_locked(wq);
+			err = wq->error;
+		} else {
+			wq->armed = 1;
+		}
+	}
+	int notify = (err != 0 && wq->cb);
+	mutex_unlock(&wq->lock);
+
+	if (notify) {
+		wq->cb(wq, SOCKET_WRITEQ_EVENT_ERROR, err, wq->user_data);
+	}
+	_socket_writeq_unref(wq, 1);
+}
+
+socket_writeq_t socket_writeq_new(socket_loop_t loop, int fd, size_t low_water, size_t high_water, socket_writeq_cb_t cb, void *user_data)
+{
+	if (!loop || fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (high_water == 0) {
+		high_water = WRITEQ_DEFAULT_HIGH_WATER;
+	}
+	if (low_water >= high_water) {
+		low_water = high_water / 2;
+	}
+	if (_socket_set_nonblocking(fd) < 0) {
+		return NULL;
+	}
+	struct socket_writeq *wq = (struct socket_writeq*)calloc(1, sizeof(struct socket_writeq));
+	if (!wq) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	wq->loop = loop;
+	wq->fd = fd;
+	wq->low_water = low_water;
+	wq->high_water = high_water;
+	wq->cb = cb;
+	wq->user_data = user_data;
+	wq->refs = 1;
+	mutex_init(&wq->lock);
+	return wq;
+}
+
+void socket_writeq_free(socket_writeq_t wq)
+{
+	if (!wq) {
+		return;
+	}
+	unsigned int cancelled = _socket_loop_cancel_posts(wq->loop, _socket_writeq_arm, wq);
+	mutex_lock(&wq->lock);
+	wq->freed = 1;
+	if (wq->armed) {
+		_socket_loop_set_writer(wq->loop, wq->fd, NULL, NULL);
+		wq->armed = 0;
+	}
+	_socket_writeq_discard_locked(wq);
+	mutex_unlock(&wq->lock);
+	/* a post the dispatcher already took drops its reference when it runs */
+	_socket_writeq_unref(wq, 1 + cancelled);
+}
+
+int socket_writeq_write(socket_writeq_t wq, const void *data, size_t length)
+{
+	int res = 0;
+	int crossed = 0;
+
+	if (!wq || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	mutex_lock(&wq->lock);
+	if (wq->error) {
+		res = -wq->error;
+		mutex_unlock(&wq->lock);
+		return res;
+	}
+
+	const char *p = (const char*)data;
+	if (!wq->head) {
+		/* nothing queued: try to send right away */
+		struct iovec iov = { (void*)p, length };
+		int s = _socket_sendv_nonblock(wq->fd, &iov, 1);
+		if (s < 0) {
+			wq->error = -s;
+			mutex_unlock(&wq->lock);
+			return s;
+		}
+		p += s;
+		length -= s;
+	}
+
+	if (length > 0) {
+		struct socket_writeq_chunk *tail = wq->tail;
+		if (tail && tail->cap - tail->len >= length) {
+			/* coalesce small writes into the last chunk */
+			memcpy(tail->data + tail->len, p, length);
+			tail->len += length;
+		} else {
+			size_t cap = (length > WRITEQ_CHUNK_SIZE) ? length : WRITEQ_CHUNK_SIZE;
+			struct socket_writeq_chunk *chunk = (struct socket_writeq_chunk*)malloc(sizeof(struct socket_writeq_chunk) + cap);
+			if (!chunk) {
+				mutex_unlock(&wq->lock);
+				return -ENOMEM;
+			}
+			chunk->next = NULL;
+			chunk->off = 0;
+			chunk->len = length;
+			chunk->cap = cap;
+			memcpy(chunk->data, p, length);
+			if (tail) {
+				tail->next = chunk;
+			} else {
+				wq->head = chunk;
+			}
+			wq->tail = chunk;
+		}
+		wq->pending += length;
+		if (!wq->armed && !wq->post_queued) {
+			res = socket_loop_post(wq->loop, _socket_writeq_arm, wq);
+			if (res < 0) {
+				mutex_unlock(&wq->lock);
+				return res;
+			}
+			wq->post_queued = 1;
+			wq->refs++;
+		}
+	}
+	if (wq->pending >= wq->high_water) {
+		if (!wq->above_high) {
+			wq->above_high = 1;
+			crossed = 1;
+		}
+		res = 1;
+	}
+	mutex_unlock(&wq->lock);
+
+	if (crossed && wq->cb) {
+		wq->cb(wq, SOCKET_WRITEQ_EVENT_HIGH_WATER, 0, wq->user_data);
+	}
+	return res;
+}
+
+size_t socket_writeq_pending(socket_writeq_t wq)
+{
+	size_t pending;
+	if (!wq) {
+		return 0;
+	}
+	mutex_lock(&wq->lock);
+	pending = wq->pending;
+	mutex_unlock(&wq->lock);
+	return pending;
+}
+
+#define READER_DEFAULT_SIZE 0x10000
+
+struct socket_reader {
+	int fd;
+	char *buf;
+	size_t capacity;
+	size_t start;
+	size_t end;
+};
+
+socket_reader_t socket_reader_new(int fd, size_t buffer_size)
+{
+	if (fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct socket_reader *reader = (struct socket_reader*)calloc(1, sizeof(struct socket_reader));
+	if (!reader) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->capacity = (buffer_size > 0) ? buffer_size : READER_DEFAULT_SIZE;
+	reader->buf = (char*)malloc(reader->capacity);
+	if (!reader->buf) {
+		free(reader);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return reader;
+}
+
+void socket_reader_free(socket_reader_t reader)
+{
+	if (!reader) {
+		return;
+	}
+	free(reader->buf);
+	free(reader);
+}
+
+int socket_reader_get_fd(socket_reader_t reader)
+{
+	return (reader) ? reader->fd : -1;
+}
+
+size_t socket_reader_available(socket_reader_t reader)
+{
+	return (reader) ? reader->end - reader->start : 0;
+}
+
+/* Makes room for at least `length` contiguous bytes starting at reader->start. */
+static int _socket_reader_reserve(struct socket_reader *reader, size_t length)
+{
+	if (reader->start == reader->end) {
+		reader->start = reader->end = 0;
+	}
+	if (reader->capacity - reader->start >= length) {
+		return 0;
+	}
+	size_t avail = reader->end - reader->start;
+	if (length > reader->capacity) {
+		size_t newcap = (length + 0xFFF) & ~(size_t)0xFFF;
+		char *newbuf = (char*)malloc(newcap);
+		if (!newbuf) {
+			return -ENOMEM;
+		}
+		memcpy(newbuf, reader->buf + reader->start, avail);
+		free(reader->buf);
+		reader->buf = newbuf;
+		reader->capacity = newcap;
+	} else {
+		memmove(reader->buf, reader->buf + reader->start, avail);
+	}
+	reader->start = 0;
+	reader->end = avail;
+	return 0;
+}
+
+/* Reads as much as fits into the buffer until at least `want` bytes are
+ * buffered. Returns 0 or a negative errno. */
+static int _socket_reader_fill(struct socket_reader *reader, size_t want, uint64_t deadline)
+{
+	int flags = 0;
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+	int need_poll = 0;
+#else
+	int need_poll = 1;
+#endif
+
+	while (reader->end - reader->start < want) {
+		if (need_poll) {
+			int remaining = _deadline_remaining(deadline);
+			if (remaining == 0) {
+				return -ETIMEDOUT;
+			}
+			enum poll_status ps = poll_wrapper(reader->fd, FDM_READ, remaining);
+			if (ps == poll_status_timeout) {
+				return -ETIMEDOUT;
+			} else if (ps == poll_status_cancelled) {
+				return -ECANCELED;
+			} else if (ps != poll_status_success) {
+				SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
+				return -ECONNRESET;
+			}
+		}
+		size_t space = reader->capacity - reader->end;
+		if (faults_active) {
+			int res = _socket_fault_apply(reader->fd, FAULT_RECV, &space);
+			if (res < 0) {
+				return res;
+			}
+		}
+		int chunk = (space > INT32_MAX) ? INT32_MAX : (int)space;
+		int r = (int)recv(reader->fd, reader->buf + reader->end, chunk, flags);
+		if (r > 0) {
+			reader->end += r;
+#ifdef MSG_DONTWAIT
+			need_poll = 0;
+#endif
+			continue;
+		}
+		if (r == 0) {
+			SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, reader->fd);
+			return -ECONNRESET;
+		}
+		int err = _socket_errno();
+		if (err == EINTR) {
+			continue;
+		}
+		if (err == EAGAIN || err == EWOULDBLOCK) {
+			need_poll = 1;
+			continue;
+		}
+		return -err;
+	}
+	return 0;
+}
+
+int socket_reader_fill(socket_reader_t reader, unsigned int timeout)
+{
+	if (!reader) {
+		return -EINVAL;
+	}
+	size_t avail = reader->end - reader->start;
+	if (reader->capacity - reader->end == 0) {
+		if (reader->start == 0) {
+			return 0;
+		}
+		_socket_reader_reserve(reader, reader->capacity);
+	}
+	uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+	int res = _socket_reader_fill(reader, avail + 1, deadline);
+	if (res < 0) {
+		return res;
+	}
+	return (int)(reader->end - reader->start - avail);
+}
+
+int socket_reader_peek(socket_reader_t reader, size_t length, const void **data, unsigned int timeout)
+{
+	if (!reader || !data || length > INT32_MAX) {
+		return -EINVAL;
+	}
+	if (reader->end - reader->start < length) {
+		int res = _socket_reader_reserve(reader, length);
+		if (res < 0) {
+			return res;
+		}
+		uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+		res = _socket_reader_fill(reader, length, deadline);
+		if (res < 0) {
+			return res;
+		}
+	}
+	*data = reader->buf + reader->start;
+	return (int)length;
+}
+
+int socket_reader_consume(socket_reader_t reader, size_t length)
+{
+	if (!reader || length > reader->end - reader->start) {
+		return -EINVAL;
+	}
+	reader->start += length;
+	return 0;
+}
+
+int socket_reader_next(socket_reader_t reader, size_t length, const void **data, unsigned int timeout)
+{
+	int res = socket_reader_peek(reader, length, data, timeout);
+	if (res > 0) {
+		reader->start += length;
+	}
+	return res;
+}
+
+int socket_reader_read(socket_reader_t reader, void *data, size_t length, size_t *received, unsigned int timeout)
+{
+	size_t done = 0;
+	int res = 0;
+
+	if (!reader || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	size_t avail = reader->end - reader->start;
+	if (avail >= length || length - avail < reader->capacity) {
+		/* small enough to go through the buffer */
+		size_t n = length;
+		if (avail < length) {
+			uint64_t deadline = (timeout > 0) ? _monotonic_ms() + timeout : 0;
+			res = _socket_reader_reserve(reader, length);
+			if (res == 0) {
+				res = _socket_reader_fill(reader, length, deadline);
+			}
+			if (res < 0) {
+				n = reader->end - reader->start;
+			}
+		}
+		memcpy(data, reader->buf + reader->start, n);
+		reader->start += n;
+		done = n;
+	} else {
+		/* large read: drain the buffer, then receive directly into the caller's memory */
+		memcpy(data, reader->buf + reader->start, avail);
+		reader->start = reader->end = 0;
+		size_t got = 0;
+		res = socket_receive_all(reader->fd, (char*)data + avail, length - avail, &got, timeout);
+		done = avail + got;
+	}
+	if (received) {
+		*received = done;
+	}
+	return res;
+}
+
+#define FRAMER_DEFAULT_MAX_FRAME 0x1000000
+#define FRAMER_OUT_SIZE 0x10000
+
+struct socket_framer {
+	struct socket_framer_config config;
+	struct socket_reader *reader;
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+};
+
+static uint64_t _framer_get_length(const struct socket_framer_config *config, const unsigned char *p)
+{
+	uint64_t value = 0;
+	uint32_t i;
+	for (i = 0; i < config->length_width; i++) {
+		if (config->big_endian) {
+			value = (value << 8) | p[i];
+		} else {
+			value |= (uint64_t)p[i] << (8 * i);
+		}
+	}
+	return value;
+}
+
+static void _framer_put_length(const struct socket_framer_config *config, unsigned char *p, uint64_t value)
+{
+	uint32_t i;
+	for (i = 0; i < config->length_width; i++) {
+		unsigned int shift = (config->big_endian) ? 8 * (config->length_width - 1 - i) : 8 * i;
+		p[i] = (unsigned char)(value >> shift);
+	}
+}
+
+/* Sends all iovecs, advancing over partial writes. Returns 0 or a negative errno. */
+static int _socket_sendv_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		int s = socket_sendv(fd, iov, iovcnt);
+		if (s < 0) {
+			if (s == -EINTR || s == -EAGAIN || s == -EWOULDBLOCK) {
+				continue;
+			}
+			return s;
+		}
+		if (s == 0) {
+			return -ETIMEDOUT;
+		}
+		size_t n = (size_t)s;
+		while (iovcnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+socket_framer_t socket_framer_new(int fd, const struct socket_framer_config *config, size_t buffer_size)
+{
+	if (fd < 0 || !config || config->header_size == 0
+	    || (config->length_width != 1 && config->length_width != 2 && config->length_width != 4 && config->length_width != 8)
+	    || config->length_offset > config->header_size || config->length_width > config->header_size - config->length_offset
+	    || config->max_frame_size > INT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct socket_framer *framer = (struct socket_framer*)calloc(1, sizeof(struct socket_framer));
+	if (!framer) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	framer->config = *config;
+	if (framer->config.max_frame_size == 0) {
+		framer->config.max_frame_size = FRAMER_DEFAULT_MAX_FRAME;
+	}
+	if (framer->config.header_size > framer->config.max_frame_size) {
+		free(framer);
+		errno = EINVAL;
+		return NULL;
+	}
+	framer->reader = socket_reader_new(fd, buffer_size);
+	framer->out_cap = FRAMER_OUT_SIZE;
+	framer->out = (char*)malloc(framer->out_cap);
+	if (!framer->reader || !framer->out) {
+		socket_reader_free(framer->reader);
+		free(framer->out);
+		free(framer);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return framer;
+}
+
+void socket_framer_free(socket_framer_t framer)
+{
+	if (!framer) {
+		return;
+	}
+	socket_reader_free(framer->reader);
+	free(framer->out);
+	free(framer);
+}
+
+socket_reader_t socket_framer_get_reader(socket_framer_t framer)
+{
+	return (framer) ? framer->reader : NULL;
+}
+
+int socket_framer_read(socket_framer_t framer, const void **header, const void **payload, unsigned int timeout)
+{
+	const void *hdr = NULL;
+	int res;
+
+	if (!framer) {
+		return -EINVAL;
+	}
+	const struct socket_framer_config *config = &framer->config;
+
+	res = socket_reader_peek(framer->reader, config->header_size, &hdr, timeout);
+	if (res < 0) {
+		return res;
+	}
+	int64_t payload_len = (int64_t)_framer_get_length(config, (const unsigned char*)hdr + config->length_offset) + config->length_adjust;
+	if (payload_len < 0) {
+		SOCKET_ERR(1, "%s: invalid frame length field on fd %d\n", __func__, framer->reader->fd);
+		return -EBADMSG;
+	}
+	/* validate before the reader grows its buffer for this frame */
+	if ((uint64_t)payload_len > config->max_frame_size - config->header_size) {
+		SOCKET_ERR(1, "%s: frame on fd %d exceeds maximum size (%lld > %u)\n", __func__, framer->reader->fd, (long long)payload_len, config->max_frame_size - config->header_size);
+		return -EMSGSIZE;
+	}
+
+	size_t frame_len = config->header_size + (size_t)payload_len;
+	res = socket_reader_next(framer->reader, frame_len, &hdr, timeout);
+	if (res < 0) {
+		return res;
+	}
+	if (header) {
+		*header = hdr;
+	}
+	if (payload) {
+		*payload = (const char*)hdr + config->header_size;
+	}
+	return (int)payload_len;
+}
+
+int socket_framer_flush(socket_framer_t framer)
+{
+	if (!framer) {
+		return -EINVAL;
+	}
+	if (framer->out_len == 0) {
+		return 0;
+	}
+	struct iovec iov = { framer->out, framer->out_len };
+	int res = _socket_sendv_all(framer->reader->fd, &iov, 1);
+	framer->out_len = 0;
+	return res;
+}
+
+int socket_framer_write(socket_framer_t framer, const void *header, const void *payload, size_t payload_len)
+{
+	unsigned char hdrbuf[256];
+	unsigned char *hdr = hdrbuf;
+
+	if (!framer || (!payload && payload_len > 0)) {
+		return -EINVAL;
+	}
+	const struct socket_framer_config *config = &framer->config;
+	if (payload_len > config->max_frame_size - config->header_size) {
+		return -EMSGSIZE;
+	}
+	int64_t field = (int64_t)payload_len - config->length_adjust;
+	if (field < 0 || (config->length_width < 8 && (uint64_t)field >> (8 * config->length_width))) {
+		return -EMSGSIZE;
+	}
+
+	size_t frame_len = config->header_size + payload_len;
+	if (framer->out_len + frame_len <= framer->out_cap) {
+		/* small frame: coalesce into the output buffer */
+		hdr = (unsigned char*)framer->out + framer->out_len;
+		if (header) {
+			memcpy(hdr, header, config->header_size);
+		} else {
+			memset(hdr, 0, config->header_size);
+		}
+		_framer_put_length(config, hdr + config->length_offset, (uint64_t)field);
+		if (payload_len > 0) {
+			memcpy(hdr + config->header_size, payload, payload_len);
+		}
+		framer->out_len += frame_len;
+		return 0;
+	}
+
+	/* large frame: send pending output, header and payload in one sendmsg */
+	if (config->header_size > sizeof(hdrbuf)) {
+		hdr = (unsigned char*)malloc(config->header_size);
+		if (!hdr) {
+			return -ENOMEM;
+		}
+	}
+	if (header) {
+		memcpy(hdr, header, config->header_size);
+	} else {
+		memset(hdr, 0, config->header_size);
+	}
+	_framer_put_length(config, hdr + config->length_offset, (uint64_t)field);
+
+	struct iovec iov[3];
+	int iovcnt = 0;
+	if (framer->out_len > 0) {
+		iov[iovcnt].iov_base = framer->out;
+		iov[iovcnt].iov_len = framer->out_len;
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = hdr;
+	iov[iovcnt].iov_len = config->header_size;
+	iovcnt++;
+	if (payload_len > 0) {
+		iov[iovcnt].iov_base = (void*)payload;
+		iov[iovcnt].iov_len = payload_len;
+		iovcnt++;
+	}
+	int res = _socket_sendv_all(framer->reader->fd, iov, iovcnt);
+	framer->out_len = 0;
+	if (hdr != hdrbuf) {
+		free(hdr);
+	}
+	return res;
 }
@@ -22,12 +22,82 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
 #ifdef _WIN32
 #include <windows.h>
 #endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#endif
+#ifdef HAVE_LINUX_FUTEX_H
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define HAVE_FUTEX 1
+#endif
 #include "common.h"
 #include "libimobiledevice-glue/thread.h"
 
+#ifndef ECANCELED
+#define ECANCELED 105
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* operate on volatile uint32_t/int64_t/pointer fields */
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_RELAXED(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_ADD32(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_OR32(ptr, val) __atomic_fetch_or((ptr), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG32(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS32(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define ATOMIC_ADD64(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG_PTR(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS64(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ATOMIC_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define ATOMIC_LOAD_RELAXED(ptr) (*(ptr))
+#define ATOMIC_LOAD_ACQUIRE(ptr) (*(ptr))
+#define ATOMIC_LOAD(ptr) (MemoryBarrier(), *(ptr))
+#define ATOMIC_STORE_RELAXED(ptr, val) (*(ptr) = (val))
+#define ATOMIC_STORE_RELEASE(ptr, val) (*(ptr) = (val))
+#define ATOMIC_ADD32(ptr, val) (InterlockedExchangeAdd((volatile LONG*)(ptr), (val)) + (val))
+#define ATOMIC_OR32(ptr, val) ((uint32_t)InterlockedOr((volatile LONG*)(ptr), (LONG)(val)))
+#define ATOMIC_XCHG32(ptr, val) ((uint32_t)InterlockedExchange((volatile LONG*)(ptr), (LONG)(val)))
+#define ATOMIC_CAS32(ptr, expected, desired) ((uint32_t)InterlockedCompareExchange((volatile LONG*)(ptr), (LONG)(desired), (LONG)(expected)) == (uint32_t)(expected))
+#define ATOMIC_ADD64(ptr, val) (InterlockedExchangeAdd64((volatile LONG64*)(ptr), (val)) + (val))
+#define ATOMIC_XCHG_PTR(ptr, val) InterlockedExchangePointer((PVOID volatile*)(ptr), (val))
+#define ATOMIC_CAS64(ptr, expected, desired) (InterlockedCompareExchange64((volatile LONG64*)(ptr), (desired), (expected)) == (expected))
+#define ATOMIC_FENCE() MemoryBarrier()
+#define ATOMIC_FENCE_RELEASE() MemoryBarrier()
+#define ATOMIC_FENCE_ACQUIRE() MemoryBarrier()
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#elif defined(_MSC_VER)
+#define CPU_RELAX() YieldProcessor()
+#else
+#define CPU_RELAX() do { } while (0)
+#endif
+
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
 {
 #ifdef _WIN32
@@ -93,6 +163,70 @@ int thread_cancel(THREAD_T thread)
 #endif
 }
 
+int thread_get_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+#else
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_COUNT)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+		return CPU_COUNT(&set);
+	}
+#endif
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+#endif
+}
+
+int thread_set_cpu_affinity(THREAD_T thread, unsigned int cpu_index)
+{
+#ifdef _WIN32
+	DWORD_PTR process_mask = 0;
+	DWORD_PTR system_mask = 0;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) || !process_mask) {
+		return -1;
+	}
+	unsigned int count = 0;
+	unsigned int bit;
+	for (bit = 0; bit < sizeof(DWORD_PTR) * 8; bit++) {
+		count += (process_mask >> bit) & 1;
+	}
+	cpu_index %= count;
+	for (bit = 0; bit < sizeof(DWORD_PTR) * 8; bit++) {
+		if (((process_mask >> bit) & 1) && cpu_index-- == 0) {
+			break;
+		}
+	}
+	return (SetThreadAffinityMask(thread, (DWORD_PTR)1 << bit) != 0) ? 0 : -1;
+#elif defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_COUNT)
+	/* cpu_index counts the CPUs this process is allowed to run on */
+	cpu_set_t allowed;
+	cpu_set_t set;
+	int cpu;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+		return -1;
+	}
+	cpu_index %= (unsigned int)CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && cpu_index-- == 0) {
+			break;
+		}
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) ? 0 : -1;
+#else
+	(void)thread;
+	(void)cpu_index;
+	return -1;
+#endif
+}
+
 void mutex_init(mutex_t* mutex)
 {
 #ifdef _WIN32
@@ -145,6 +279,36 @@ void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 #endif
 }
 
+#ifndef _WIN32
+/* waits against CLOCK_MONOTONIC where possible, so that wall clock jumps
+ * do not stretch or cut short the timeout */
+static int _pthread_cond_wait_ms(pthread_cond_t* cond, pthread_mutex_t* mutex, unsigned int timeout_ms)
+{
+	struct timespec ts;
+#if defined(__APPLE__)
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	return pthread_cond_timedwait_relative_np(cond, mutex, &ts);
+#else
+#ifdef HAVE_PTHREAD_COND_CLOCKWAIT
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	/* pthread_cond_timedwait() uses the condattr clock, CLOCK_REALTIME by default */
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
+	ts.tv_nsec %= (1000 * 1000 * 1000);
+#ifdef HAVE_PTHREAD_COND_CLOCKWAIT
+	return pthread_cond_clockwait(cond, mutex, CLOCK_MONOTONIC, &ts);
+#else
+	return pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+#endif
+}
+#endif
+
 void cond_init(cond_t* cond)
 {
 #ifdef _WIN32
@@ -204,16 +368,1501 @@ int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
 		default:
 			return -1;
 	}
+#else
+	return _pthread_cond_wait_ms(cond, mutex, timeout_ms);
+#endif
+}
+
+struct thread_pool_task {
+	thread_pool_func_t func;
+	void* data;
+};
+
+struct thread_pool_worker {
+	struct thread_pool* pool;
+	unsigned int index;
+	THREAD_T thread;
+};
+
+struct thread_pool {
+	char name[32];
+	mutex_t lock;
+	cond_t work_cond;
+	cond_t space_cond;
+	cond_t idle_cond;
+	/* ring buffer; grows on demand unless max_queue is set */
+	struct thread_pool_task* tasks;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int max_queue;
+	unsigned int active;
+	unsigned int work_waiters;
+	unsigned int space_waiters;
+	unsigned int idle_waiters;
+	int shutdown;
+	unsigned int num_threads;
+	struct thread_pool_worker* workers;
+};
+
+static void _thread_set_name(const char* name)
+{
+#ifdef HAVE_PTHREAD_SETNAME_NP
+#ifdef __APPLE__
+	pthread_setname_np(name);
+#else
+	/* Linux limits thread names to 15 characters */
+	char buf[16];
+	size_t len = strlen(name);
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+	pthread_setname_np(pthread_self(), buf);
+#endif
+#else
+	(void)name;
+#endif
+}
+
+/* cond_wait() on Windows returns with the mutex released */
+static void _cond_wait_relock(cond_t* cond, mutex_t* mutex)
+{
+	cond_wait(cond, mutex);
+#ifdef _WIN32
+	mutex_lock(mutex);
+#endif
+}
+
+static void _cond_wake(cond_t* cond, unsigned int waiters)
+{
+	while (waiters-- > 0) {
+		cond_signal(cond);
+	}
+}
+
+static void* _thread_pool_worker(void* arg)
+{
+	struct thread_pool_worker* worker = (struct thread_pool_worker*)arg;
+	struct thread_pool* pool = worker->pool;
+	char name[48];
+
+	snprintf(name, sizeof(name), "%s-%u", pool->name, worker->index);
+	_thread_set_name(name);
+
+	mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->count == 0 && !pool->shutdown) {
+			pool->work_waiters++;
+			_cond_wait_relock(&pool->work_cond, &pool->lock);
+			pool->work_waiters--;
+		}
+		if (pool->count == 0) {
+			break;
+		}
+		struct thread_pool_task task = pool->tasks[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->count--;
+		pool->active++;
+		if (pool->space_waiters > 0) {
+			cond_signal(&pool->space_cond);
+		}
+		mutex_unlock(&pool->lock);
+
+		task.func(task.data);
+
+		mutex_lock(&pool->lock);
+		pool->active--;
+		if (pool->count == 0 && pool->active == 0) {
+			_cond_wake(&pool->idle_cond, pool->idle_waiters);
+		}
+	}
+	mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int _thread_pool_grow(struct thread_pool* pool)
+{
+	unsigned int capacity = pool->capacity * 2;
+	unsigned int i;
+	struct thread_pool_task* tasks = (struct thread_pool_task*)malloc(sizeof(struct thread_pool_task) * capacity);
+	if (!tasks) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < pool->count; i++) {
+		tasks[i] = pool->tasks[(pool->head + i) % pool->capacity];
+	}
+	free(pool->tasks);
+	pool->tasks = tasks;
+	pool->capacity = capacity;
+	pool->head = 0;
+	return 0;
+}
+
+static int _thread_pool_push(struct thread_pool* pool, thread_pool_func_t func, void* data, int block)
+{
+	if (!pool || !func) {
+		return -EINVAL;
+	}
+	mutex_lock(&pool->lock);
+	while (!pool->shutdown && pool->max_queue > 0 && pool->count >= pool->max_queue) {
+		if (!block) {
+			mutex_unlock(&pool->lock);
+			return -EAGAIN;
+		}
+		pool->space_waiters++;
+		_cond_wait_relock(&pool->space_cond, &pool->lock);
+		pool->space_waiters--;
+	}
+	if (pool->shutdown) {
+		mutex_unlock(&pool->lock);
+		return -ECANCELED;
+	}
+	if (pool->count == pool->capacity && _thread_pool_grow(pool) < 0) {
+		mutex_unlock(&pool->lock);
+		return -ENOMEM;
+	}
+	struct thread_pool_task* task = &pool->tasks[(pool->head + pool->count) % pool->capacity];
+	task->func = func;
+	task->data = data;
+	pool->count++;
+	if (pool->work_waiters > 0) {
+		cond_signal(&pool->work_cond);
+	}
+	mutex_unlock(&pool->lock);
+	return 0;
+}
+
+thread_pool_t thread_pool_new(const char* name, unsigned int num_threads, unsigned int max_queue)
+{
+	unsigned int i;
+	struct thread_pool* pool = (struct thread_pool*)calloc(1, sizeof(struct thread_pool));
+	if (!pool) {
+		return NULL;
+	}
+	snprintf(pool->name, sizeof(pool->name), "%s", (name) ? name : "pool");
+	pool->num_threads = (num_threads > 0) ? num_threads : (unsigned int)thread_get_cpu_count();
+	pool->max_queue = max_queue;
+	pool->capacity = (max_queue > 0) ? max_queue : 64;
+	pool->tasks = (struct thread_pool_task*)malloc(sizeof(struct thread_pool_task) * pool->capacity);
+	pool->workers = (struct thread_pool_worker*)calloc(pool->num_threads, sizeof(struct thread_pool_worker));
+	if (!pool->tasks || !pool->workers) {
+		free(pool->tasks);
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+	mutex_init(&pool->lock);
+	cond_init(&pool->work_cond);
+	cond_init(&pool->space_cond);
+	cond_init(&pool->idle_cond);
+
+	for (i = 0; i < pool->num_threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		if (thread_new(&pool->workers[i].thread, _thread_pool_worker, &pool->workers[i]) != 0) {
+			break;
+		}
+	}
+	if (i < pool->num_threads) {
+		pool->num_threads = i;
+		thread_pool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void thread_pool_free(thread_pool_t pool)
+{
+	unsigned int i;
+	if (!pool) {
+		return;
+	}
+	mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	_cond_wake(&pool->work_cond, pool->work_waiters);
+	_cond_wake(&pool->space_cond, pool->space_waiters);
+	mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++) {
+		thread_join(pool->workers[i].thread);
+		thread_free(pool->workers[i].thread);
+	}
+	cond_destroy(&pool->idle_cond);
+	cond_destroy(&pool->space_cond);
+	cond_destroy(&pool->work_cond);
+	mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool->tasks);
+	free(pool);
+}
+
+int thread_pool_submit(thread_pool_t pool, thread_pool_func_t func, void* data)
+{
+	return _thread_pool_push(pool, func, data, 1);
+}
+
+int thread_pool_try_submit(thread_pool_t pool, thread_pool_func_t func, void* data)
+{
+	return _thread_pool_push(pool, func, data, 0);
+}
+
+void thread_pool_wait(thread_pool_t pool)
+{
+	if (!pool) {
+		return;
+	}
+	mutex_lock(&pool->lock);
+	while (pool->count > 0 || pool->active > 0) {
+		pool->idle_waiters++;
+		_cond_wait_relock(&pool->idle_cond, &pool->lock);
+		pool->idle_waiters--;
+	}
+	mutex_unlock(&pool->lock);
+}
+
+unsigned int thread_pool_get_num_threads(thread_pool_t pool)
+{
+	return (pool) ? pool->num_threads : 0;
+}
+
+unsigned int thread_pool_get_pending(thread_pool_t pool)
+{
+	unsigned int pending;
+	if (!pool) {
+		return 0;
+	}
+	mutex_lock(&pool->lock);
+	pending = pool->count + pool->active;
+	mutex_unlock(&pool->lock);
+	return pending;
+}
+
+const char* thread_pool_get_name(thread_pool_t pool)
+{
+	return (pool) ? pool->name : NULL;
+}
+
+/* Work-stealing scheduler: each worker owns a Chase-Lev deque (push/take at
+ * the bottom by the owner, steal from the top by everyone else). Tasks
+ * spawned from outside the scheduler go through a locked injection queue. */
+
+struct thread_task {
+	thread_task_func_t func;
+	void* data;
+	struct thread_task_group* group;
+	struct thread_task* next;
+};
+
+struct ws_array {
+	int64_t size;
+	struct ws_array* prev;
+	struct thread_task* volatile slots[1];
+};
+
+#define WS_CACHE_LINE 64
+#define WS_INITIAL_SIZE 256
+#define WS_STEAL_ROUNDS 64
+
+struct ws_worker {
+	volatile int64_t top;
+	char pad0[WS_CACHE_LINE - sizeof(int64_t)];
+	volatile int64_t bottom;
+	struct ws_array* volatile array;
+	char pad1[WS_CACHE_LINE - sizeof(int64_t) - sizeof(void*)];
+	struct thread_scheduler* sched;
+	unsigned int index;
+	uint32_t rng;
+	int started;
+	THREAD_T thread;
+};
+
+struct thread_scheduler {
+	unsigned int num_workers;
+	struct ws_worker* workers;
+	/* queued but not yet started tasks, across all deques */
+	volatile int64_t pending;
+	volatile int64_t sleepers;
+	volatile int64_t shutdown;
+	mutex_t sleep_lock;
+	cond_t sleep_cond;
+	mutex_t inject_lock;
+	struct thread_task* inject_head;
+	struct thread_task* inject_tail;
+	volatile int64_t inject_count;
+};
+
+/* outstanding tasks in the low bits, parked waiters above; kept in one
+ * word so that only the task completing the group touches it afterwards */
+#define WS_GROUP_WAITER ((int64_t)1 << 40)
+#define WS_GROUP_PENDING_MASK (WS_GROUP_WAITER - 1)
+
+struct thread_task_group {
+	struct thread_scheduler* sched;
+	volatile int64_t state;
+	unsigned int epoch;
+	mutex_t lock;
+	cond_t cond;
+};
+
+static THREAD_LOCAL struct ws_worker* ws_current_worker = NULL;
+
+static struct ws_array* _ws_array_new(int64_t size)
+{
+	struct ws_array* a = (struct ws_array*)malloc(sizeof(struct ws_array) + sizeof(struct thread_task*) * (size - 1));
+	if (a) {
+		a->size = size;
+		a->prev = NULL;
+	}
+	return a;
+}
+
+/* owner only */
+static int _ws_push(struct ws_worker* w, struct thread_task* task)
+{
+	int64_t b = ATOMIC_LOAD_RELAXED(&w->bottom);
+	int64_t t = ATOMIC_LOAD_ACQUIRE(&w->top);
+	struct ws_array* a = ATOMIC_LOAD_RELAXED(&w->array);
+	if (b - t > a->size - 1) {
+		int64_t i;
+		struct ws_array* grown = _ws_array_new(a->size * 2);
+		if (!grown) {
+			return -ENOMEM;
+		}
+		for (i = t; i < b; i++) {
+			grown->slots[i & (grown->size - 1)] = ATOMIC_LOAD_RELAXED(&a->slots[i & (a->size - 1)]);
+		}
+		/* thieves may still read the old array; freed with the scheduler */
+		grown->prev = a;
+		ATOMIC_STORE_RELEASE(&w->array, grown);
+		a = grown;
+	}
+	ATOMIC_STORE_RELAXED(&a->slots[b & (a->size - 1)], task);
+	ATOMIC_FENCE_RELEASE();
+	ATOMIC_STORE_RELAXED(&w->bottom, b + 1);
+	return 0;
+}
+
+/* owner only */
+static struct thread_task* _ws_take(struct ws_worker* w)
+{
+	int64_t b = ATOMIC_LOAD_RELAXED(&w->bottom) - 1;
+	struct ws_array* a = ATOMIC_LOAD_RELAXED(&w->array);
+	struct thread_task* task = NULL;
+	ATOMIC_STORE_RELAXED(&w->bottom, b);
+	ATOMIC_FENCE();
+	int64_t t = ATOMIC_LOAD_RELAXED(&w->top);
+	if (t <= b) {
+		task = ATOMIC_LOAD_RELAXED(&a->slots[b & (a->size - 1)]);
+		if (t == b) {
+			/* last element, race against thieves */
+			if (!ATOMIC_CAS64(&w->top, t, t + 1)) {
+				task = NULL;
+			}
+			ATOMIC_STORE_RELAXED(&w->bottom, b + 1);
+		}
+	} else {
+		ATOMIC_STORE_RELAXED(&w->bottom, b + 1);
+	}
+	return task;
+}
+
+static struct thread_task* _ws_steal(struct ws_worker* w)
+{
+	int64_t t = ATOMIC_LOAD_ACQUIRE(&w->top);
+	ATOMIC_FENCE();
+	int64_t b = ATOMIC_LOAD_ACQUIRE(&w->bottom);
+	if (t < b) {
+		struct ws_array* a = ATOMIC_LOAD_ACQUIRE(&w->array);
+		struct thread_task* task = ATOMIC_LOAD_RELAXED(&a->slots[t & (a->size - 1)]);
+		if (ATOMIC_CAS64(&w->top, t, t + 1)) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static struct thread_task* _ws_pop_injected(struct thread_scheduler* sched)
+{
+	struct thread_task* task = NULL;
+	if (ATOMIC_LOAD_RELAXED(&sched->inject_count) == 0) {
+		return NULL;
+	}
+	mutex_lock(&sched->inject_lock);
+	task = sched->inject_head;
+	if (task) {
+		sched->inject_head = task->next;
+		if (!sched->inject_head) {
+			sched->inject_tail = NULL;
+		}
+		ATOMIC_ADD64(&sched->inject_count, -1);
+	}
+	mutex_unlock(&sched->inject_lock);
+	return task;
+}
+
+/* self is NULL for threads outside the scheduler */
+static struct thread_task* _ws_find_task(struct thread_scheduler* sched, struct ws_worker* self)
+{
+	struct thread_task* task = NULL;
+	unsigned int i;
+	unsigned int start;
+
+	if (self) {
+		task = _ws_take(self);
+	}
+	if (!task) {
+		task = _ws_pop_injected(sched);
+	}
+	if (!task && sched->num_workers > 0) {
+		if (self) {
+			self->rng ^= self->rng << 13;
+			self->rng ^= self->rng >> 17;
+			self->rng ^= self->rng << 5;
+			start = self->rng % sched->num_workers;
+		} else {
+			start = 0;
+		}
+		for (i = 0; i < sched->num_workers && !task; i++) {
+			struct ws_worker* victim = &sched->workers[(start + i) % sched->num_workers];
+			if (victim != self) {
+				task = _ws_steal(victim);
+			}
+		}
+	}
+	if (task) {
+		ATOMIC_ADD64(&sched->pending, -1);
+	}
+	return task;
+}
+
+static void _ws_run_task(struct thread_task* task)
+{
+	struct thread_task_group* group = task->group;
+	task->func(task->data);
+	free(task);
+	int64_t state = ATOMIC_ADD64(&group->state, -1);
+	if ((state & WS_GROUP_PENDING_MASK) == 0 && state > 0) {
+		mutex_lock(&group->lock);
+		group->epoch++;
+		_cond_wake(&group->cond, (unsigned int)(state / WS_GROUP_WAITER));
+		mutex_unlock(&group->lock);
+	}
+}
+
+static void _thread_yield(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static void* _ws_worker_main(void* arg)
+{
+	struct ws_worker* self = (struct ws_worker*)arg;
+	struct thread_scheduler* sched = self->sched;
+	char name[32];
+	unsigned int idle = 0;
+
+	snprintf(name, sizeof(name), "ws-%u", self->index);
+	_thread_set_name(name);
+	ws_current_worker = self;
+
+	while (1) {
+		struct thread_task* task = _ws_find_task(sched, self);
+		if (task) {
+			_ws_run_task(task);
+			idle = 0;
+			continue;
+		}
+		if (++idle < WS_STEAL_ROUNDS) {
+			_thread_yield();
+			continue;
+		}
+		idle = 0;
+		mutex_lock(&sched->sleep_lock);
+		ATOMIC_ADD64(&sched->sleepers, 1);
+		while (ATOMIC_LOAD(&sched->pending) == 0 && !ATOMIC_LOAD(&sched->shutdown)) {
+			_cond_wait_relock(&sched->sleep_cond, &sched->sleep_lock);
+		}
+		ATOMIC_ADD64(&sched->sleepers, -1);
+		mutex_unlock(&sched->sleep_lock);
+		if (ATOMIC_LOAD(&sched->shutdown) && ATOMIC_LOAD(&sched->pending) == 0) {
+			break;
+		}
+	}
+	ws_current_worker = NULL;
+	return NULL;
+}
+
+thread_scheduler_t thread_scheduler_new(unsigned int num_workers)
+{
+	unsigned int i;
+	struct thread_scheduler* sched = (struct thread_scheduler*)calloc(1, sizeof(struct thread_scheduler));
+	if (!sched) {
+		return NULL;
+	}
+	sched->num_workers = (num_workers > 0) ? num_workers : (unsigned int)thread_get_cpu_count();
+	sched->workers = (struct ws_worker*)calloc(sched->num_workers, sizeof(struct ws_worker));
+	if (!sched->workers) {
+		free(sched);
+		return NULL;
+	}
+	mutex_init(&sched->sleep_lock);
+	cond_init(&sched->sleep_cond);
+	mutex_init(&sched->inject_lock);
+	for (i = 0; i < sched->num_workers; i++) {
+		struct ws_worker* w = &sched->workers[i];
+		w->sched = sched;
+		w->index = i;
+		w->rng = 2654435761u * (i + 1);
+		w->array = _ws_array_new(WS_INITIAL_SIZE);
+		if (!w->array) {
+			break;
+		}
+	}
+	if (i == sched->num_workers) {
+		for (i = 0; i < sched->num_workers; i++) {
+			if (thread_new(&sched->workers[i].thread, _ws_worker_main, &sched->workers[i]) != 0) {
+				break;
+			}
+			sched->workers[i].started = 1;
+		}
+		if (i == sched->num_workers) {
+			return sched;
+		}
+	}
+	thread_scheduler_free(sched);
+	return NULL;
+}
+
+void thread_scheduler_free(thread_scheduler_t sched)
+{
+	unsigned int i;
+	if (!sched) {
+		return;
+	}
+	mutex_lock(&sched->sleep_lock);
+	ATOMIC_STORE_RELEASE(&sched->shutdown, 1);
+	_cond_wake(&sched->sleep_cond, sched->num_workers);
+	mutex_unlock(&sched->sleep_lock);
+	for (i = 0; i < sched->num_workers; i++) {
+		if (sched->workers[i].started) {
+			thread_join(sched->workers[i].thread);
+			thread_free(sched->workers[i].thread);
+		}
+	}
+	for (i = 0; i < sched->num_workers; i++) {
+		struct ws_array* a = sched->workers[i].array;
+		while (a) {
+			struct ws_array* prev = a->prev;
+			free(a);
+			a = prev;
+		}
+	}
+	mutex_destroy(&sched->inject_lock);
+	cond_destroy(&sched->sleep_cond);
+	mutex_destroy(&sched->sleep_lock);
+	free(sched->workers);
+	free(sched);
+}
+
+static thread_scheduler_t default_scheduler = NULL;
+static thread_once_t default_scheduler_once = THREAD_ONCE_INIT;
+
+static void _default_scheduler_init(void)
+{
+	default_scheduler = thread_scheduler_new(0);
+}
+
+thread_scheduler_t thread_scheduler_get_default(void)
+{
+	thread_once(&default_scheduler_once, _default_scheduler_init);
+	return default_scheduler;
+}
+
+unsigned int thread_scheduler_get_num_workers(thread_scheduler_t sched)
+{
+	return (sched) ? sched->num_workers : 0;
+}
+
+thread_task_group_t thread_task_group_new(thread_scheduler_t sched)
+{
+	struct thread_task_group* group;
+	if (!sched) {
+		sched = thread_scheduler_get_default();
+		if (!sched) {
+			return NULL;
+		}
+	}
+	group = (struct thread_task_group*)calloc(1, sizeof(struct thread_task_group));
+	if (!group) {
+		return NULL;
+	}
+	group->sched = sched;
+	mutex_init(&group->lock);
+	cond_init(&group->cond);
+	return group;
+}
+
+void thread_task_group_free(thread_task_group_t group)
+{
+	if (!group) {
+		return;
+	}
+	thread_task_group_wait(group);
+	cond_destroy(&group->cond);
+	mutex_destroy(&group->lock);
+	free(group);
+}
+
+int thread_task_group_spawn(thread_task_group_t group, thread_task_func_t func, void* data)
+{
+	struct thread_scheduler* sched;
+	struct ws_worker* self = ws_current_worker;
+	struct thread_task* task;
+
+	if (!group || !func) {
+		return -EINVAL;
+	}
+	sched = group->sched;
+	if (ATOMIC_LOAD_RELAXED(&sched->shutdown)) {
+		return -ECANCELED;
+	}
+	task = (struct thread_task*)malloc(sizeof(struct thread_task));
+	if (!task) {
+		return -ENOMEM;
+	}
+	task->func = func;
+	task->data = data;
+	task->group = group;
+	task->next = NULL;
+	ATOMIC_ADD64(&group->state, 1);
+
+	if (self && self->sched == sched) {
+		if (_ws_push(self, task) < 0) {
+			ATOMIC_ADD64(&group->state, -1);
+			free(task);
+			return -ENOMEM;
+		}
+	} else {
+		mutex_lock(&sched->inject_lock);
+		if (sched->inject_tail) {
+			sched->inject_tail->next = task;
+		} else {
+			sched->inject_head = task;
+		}
+		sched->inject_tail = task;
+		ATOMIC_ADD64(&sched->inject_count, 1);
+		mutex_unlock(&sched->inject_lock);
+	}
+
+	/* pairs with the pending check of a worker going to sleep */
+	ATOMIC_ADD64(&sched->pending, 1);
+	if (ATOMIC_LOAD(&sched->sleepers) > 0) {
+		mutex_lock(&sched->sleep_lock);
+		cond_signal(&sched->sleep_cond);
+		mutex_unlock(&sched->sleep_lock);
+	}
+	return 0;
+}
+
+void thread_task_group_wait(thread_task_group_t group)
+{
+	struct thread_scheduler* sched;
+	struct ws_worker* self = ws_current_worker;
+	unsigned int idle = 0;
+
+	if (!group) {
+		return;
+	}
+	sched = group->sched;
+	if (self && self->sched != sched) {
+		self = NULL;
+	}
+	/* help running tasks instead of blocking the calling thread */
+	while (ATOMIC_LOAD(&group->state) & WS_GROUP_PENDING_MASK) {
+		struct thread_task* task = _ws_find_task(sched, self);
+		if (task) {
+			_ws_run_task(task);
+			idle = 0;
+			continue;
+		}
+		if (++idle < WS_STEAL_ROUNDS) {
+			_thread_yield();
+			continue;
+		}
+		idle = 0;
+		mutex_lock(&group->lock);
+		unsigned int epoch = group->epoch;
+		if (ATOMIC_ADD64(&group->state, WS_GROUP_WAITER) & WS_GROUP_PENDING_MASK) {
+			/* the completing task bumps epoch under the lock */
+			while (group->epoch == epoch) {
+				_cond_wait_relock(&group->cond, &group->lock);
+			}
+		}
+		ATOMIC_ADD64(&group->state, -WS_GROUP_WAITER);
+		mutex_unlock(&group->lock);
+	}
+}
+
+static uint64_t _thread_monotonic_ms(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
 #else
 	struct timespec ts;
-	struct timeval now;
-	gettimeofday(&now, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)(ts.tv_nsec / 1000000);
+#endif
+}
 
-	ts.tv_sec = now.tv_sec + timeout_ms / 1000;
-	ts.tv_nsec = now.tv_usec * 1000 + 1000 * 1000 * (timeout_ms % 1000);
-	ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
-	ts.tv_nsec %= (1000 * 1000 * 1000);
+#ifdef HAVE_FUTEX
+/* timeout is relative and measured against CLOCK_MONOTONIC */
+static int _futex_wait(volatile uint32_t* addr, uint32_t expected, int timeout_ms)
+{
+	struct timespec ts;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	}
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, (timeout_ms >= 0) ? &ts : NULL, NULL, 0) < 0) {
+		return -errno;
+	}
+	return 0;
+}
 
-	return pthread_cond_timedwait(cond, mutex, &ts);
+static void _futex_wake(volatile uint32_t* addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 #endif
+
+/* Eventcount: lets a consumer sleep on "queue is empty" without making the
+ * producer's fast path take a lock. Bit 0 of state flags waiters, the rest
+ * is a sequence number. A waiter sets the flag, re-checks its condition and
+ * sleeps on the state it saw; a notifier only bumps the sequence (and makes
+ * the wake syscall) if the flag is set, and clears it in the same step so
+ * later notifications stay cheap until someone waits again. */
+#define EC_WAITERS 1u
+#define EC_SEQ_INC 2u
+
+struct thread_eventcount {
+	volatile uint32_t state;
+#ifndef HAVE_FUTEX
+	mutex_t lock;
+	cond_t cond;
+	unsigned int sleeping;
+#endif
+};
+
+static void _ec_init(struct thread_eventcount* ec)
+{
+	ec->state = 0;
+#ifndef HAVE_FUTEX
+	mutex_init(&ec->lock);
+	cond_init(&ec->cond);
+	ec->sleeping = 0;
+#endif
+}
+
+static void _ec_destroy(struct thread_eventcount* ec)
+{
+#ifndef HAVE_FUTEX
+	cond_destroy(&ec->cond);
+	mutex_destroy(&ec->lock);
+#else
+	(void)ec;
+#endif
+}
+
+static uint32_t _ec_prepare_wait(struct thread_eventcount* ec)
+{
+	return ATOMIC_OR32(&ec->state, EC_WAITERS) | EC_WAITERS;
+}
+
+/* returns early on notification, timeout or spuriously */
+static void _ec_wait(struct thread_eventcount* ec, uint32_t key, int timeout_ms)
+{
+#ifdef HAVE_FUTEX
+	_futex_wait(&ec->state, key, timeout_ms);
+#else
+	mutex_lock(&ec->lock);
+	if (ATOMIC_LOAD(&ec->state) == key) {
+		ec->sleeping++;
+		if (timeout_ms < 0) {
+			cond_wait(&ec->cond, &ec->lock);
+		} else {
+			cond_wait_timeout(&ec->cond, &ec->lock, (unsigned int)timeout_ms);
+		}
+#ifdef _WIN32
+		mutex_lock(&ec->lock);
+#endif
+		ec->sleeping--;
+	}
+	mutex_unlock(&ec->lock);
+#endif
+}
+
+static void _ec_notify(struct thread_eventcount* ec)
+{
+	ATOMIC_FENCE();
+	uint32_t state = ATOMIC_LOAD_RELAXED(&ec->state);
+	if (!(state & EC_WAITERS)) {
+		return;
+	}
+#ifndef HAVE_FUTEX
+	mutex_lock(&ec->lock);
+#endif
+	while (!ATOMIC_CAS32(&ec->state, state, (state + EC_SEQ_INC) & ~EC_WAITERS)) {
+		state = ATOMIC_LOAD_RELAXED(&ec->state);
+	}
+#ifdef HAVE_FUTEX
+	_futex_wake(&ec->state, INT32_MAX);
+#else
+	_cond_wake(&ec->cond, ec->sleeping);
+	mutex_unlock(&ec->lock);
+#endif
+}
+
+/* try_op returns 0 on success, -EAGAIN if it would block and 1 if it should
+ * simply be retried */
+typedef int (*_ec_try_op_t)(void* obj, void** data);
+
+static int _ec_wait_for(struct thread_eventcount* ec, _ec_try_op_t try_op, void* obj, void** data, int timeout_ms)
+{
+	uint64_t deadline = (timeout_ms > 0) ? _thread_monotonic_ms() + (uint64_t)timeout_ms : 0;
+	while (1) {
+		int res = try_op(obj, data);
+		if (res == 0) {
+			return 0;
+		}
+		if (res > 0) {
+			_thread_yield();
+			continue;
+		}
+		if (timeout_ms == 0) {
+			return -EAGAIN;
+		}
+		/* a stale waiters flag only costs one extra wake-up */
+		uint32_t key = _ec_prepare_wait(ec);
+		res = try_op(obj, data);
+		if (res >= 0) {
+			if (res == 0) {
+				return 0;
+			}
+			continue;
+		}
+		int remaining = -1;
+		if (timeout_ms > 0) {
+			uint64_t now = _thread_monotonic_ms();
+			if (now >= deadline) {
+				return -ETIMEDOUT;
+			}
+			remaining = (int)(deadline - now);
+		}
+		_ec_wait(ec, key, remaining);
+	}
+}
+
+/* Vyukov's MPSC queue: producers swap themselves in at head, the consumer
+ * follows next pointers from a dummy node at tail. */
+struct mpsc_node {
+	struct mpsc_node* volatile next;
+	void* data;
+};
+
+struct thread_mpsc_queue {
+	struct mpsc_node* volatile head;
+	char pad0[WS_CACHE_LINE - sizeof(void*)];
+	struct mpsc_node* tail;
+	char pad1[WS_CACHE_LINE - sizeof(void*)];
+	struct thread_eventcount ec;
+};
+
+thread_mpsc_queue_t thread_mpsc_queue_new(void)
+{
+	struct thread_mpsc_queue* queue = (struct thread_mpsc_queue*)calloc(1, sizeof(struct thread_mpsc_queue));
+	if (!queue) {
+		return NULL;
+	}
+	struct mpsc_node* stub = (struct mpsc_node*)calloc(1, sizeof(struct mpsc_node));
+	if (!stub) {
+		free(queue);
+		return NULL;
+	}
+	queue->head = stub;
+	queue->tail = stub;
+	_ec_init(&queue->ec);
+	return queue;
+}
+
+void thread_mpsc_queue_free(thread_mpsc_queue_t queue)
+{
+	if (!queue) {
+		return;
+	}
+	struct mpsc_node* node = queue->tail;
+	while (node) {
+		struct mpsc_node* next = node->next;
+		free(node);
+		node = next;
+	}
+	_ec_destroy(&queue->ec);
+	free(queue);
+}
+
+int thread_mpsc_queue_push(thread_mpsc_queue_t queue, void* data)
+{
+	if (!queue) {
+		return -EINVAL;
+	}
+	struct mpsc_node* node = (struct mpsc_node*)malloc(sizeof(struct mpsc_node));
+	if (!node) {
+		return -ENOMEM;
+	}
+	node->next = NULL;
+	node->data = data;
+	struct mpsc_node* prev = ATOMIC_XCHG_PTR(&queue->head, node);
+	ATOMIC_STORE_RELEASE(&prev->next, node);
+	_ec_notify(&queue->ec);
+	return 0;
+}
+
+static int _mpsc_try_pop(void* obj, void** data)
+{
+	struct thread_mpsc_queue* queue = (struct thread_mpsc_queue*)obj;
+	struct mpsc_node* tail = queue->tail;
+	struct mpsc_node* next = ATOMIC_LOAD_ACQUIRE(&tail->next);
+	if (!next) {
+		/* a producer may have swapped head but not linked its node yet */
+		return (ATOMIC_LOAD(&queue->head) != tail) ? 1 : -EAGAIN;
+	}
+	*data = next->data;
+	queue->tail = next;
+	free(tail);
+	return 0;
+}
+
+int thread_mpsc_queue_pop(thread_mpsc_queue_t queue, void** data, int timeout_ms)
+{
+	if (!queue || !data) {
+		return -EINVAL;
+	}
+	return _ec_wait_for(&queue->ec, _mpsc_try_pop, queue, data, timeout_ms);
+}
+
+/* SPSC ring: each side keeps its index and a cached copy of the other
+ * side's index on its own cache line */
+struct thread_spsc_ring {
+	volatile int64_t head;
+	int64_t cached_tail;
+	char pad0[WS_CACHE_LINE - 2 * sizeof(int64_t)];
+	volatile int64_t tail;
+	int64_t cached_head;
+	char pad1[WS_CACHE_LINE - 2 * sizeof(int64_t)];
+	int64_t size;
+	void* volatile* slots;
+	struct thread_eventcount not_empty;
+	struct thread_eventcount not_full;
+};
+
+thread_spsc_ring_t thread_spsc_ring_new(unsigned int capacity)
+{
+	int64_t size = 2;
+	if (capacity == 0) {
+		capacity = 1024;
+	}
+	while (size < (int64_t)capacity) {
+		size <<= 1;
+	}
+	struct thread_spsc_ring* ring = (struct thread_spsc_ring*)calloc(1, sizeof(struct thread_spsc_ring));
+	if (!ring) {
+		return NULL;
+	}
+	ring->slots = (void* volatile*)calloc((size_t)size, sizeof(void*));
+	if (!ring->slots) {
+		free(ring);
+		return NULL;
+	}
+	ring->size = size;
+	_ec_init(&ring->not_empty);
+	_ec_init(&ring->not_full);
+	return ring;
+}
+
+void thread_spsc_ring_free(thread_spsc_ring_t ring)
+{
+	if (!ring) {
+		return;
+	}
+	_ec_destroy(&ring->not_full);
+	_ec_destroy(&ring->not_empty);
+	free((void*)ring->slots);
+	free(ring);
+}
+
+static int _spsc_try_push(void* obj, void** data)
+{
+	struct thread_spsc_ring* ring = (struct thread_spsc_ring*)obj;
+	int64_t tail = ATOMIC_LOAD_RELAXED(&ring->tail);
+	if (tail - ring->cached_head >= ring->size) {
+		ring->cached_head = ATOMIC_LOAD_ACQUIRE(&ring->head);
+		if (tail - ring->cached_head >= ring->size) {
+			return -EAGAIN;
+		}
+	}
+	ATOMIC_STORE_RELAXED(&ring->slots[tail & (ring->size - 1)], *data);
+	ATOMIC_STORE_RELEASE(&ring->tail, tail + 1);
+	return 0;
+}
+
+static int _spsc_try_pop(void* obj, void** data)
+{
+	struct thread_spsc_ring* ring = (struct thread_spsc_ring*)obj;
+	int64_t head = ATOMIC_LOAD_RELAXED(&ring->head);
+	if (head >= ring->cached_tail) {
+		ring->cached_tail = ATOMIC_LOAD_ACQUIRE(&ring->tail);
+		if (head >= ring->cached_tail) {
+			return -EAGAIN;
+		}
+	}
+	*data = ATOMIC_LOAD_RELAXED(&ring->slots[head & (ring->size - 1)]);
+	ATOMIC_STORE_RELEASE(&ring->head, head + 1);
+	return 0;
+}
+
+int thread_spsc_ring_push(thread_spsc_ring_t ring, void* data, int timeout_ms)
+{
+	if (!ring) {
+		return -EINVAL;
+	}
+	int res = _ec_wait_for(&ring->not_full, _spsc_try_push, ring, &data, timeout_ms);
+	if (res == 0) {
+		_ec_notify(&ring->not_empty);
+	}
+	return res;
+}
+
+int thread_spsc_ring_pop(thread_spsc_ring_t ring, void** data, int timeout_ms)
+{
+	if (!ring || !data) {
+		return -EINVAL;
+	}
+	int res = _ec_wait_for(&ring->not_empty, _spsc_try_pop, ring, data, timeout_ms);
+	if (res == 0) {
+		_ec_notify(&ring->not_full);
+	}
+	return res;
+}
+
+/* fast_mutex_t / fast_cond_t */
+
+#ifdef HAVE_FUTEX
+#define FAST_MUTEX_MAX_SPIN 100
+#define FAST_COND_MAX_SPIN 200
+
+static int fast_mutex_spin = -1;
+
+static int _fast_mutex_should_spin(void)
+{
+	/* spinning only helps if the owner can run at the same time */
+	if (fast_mutex_spin < 0) {
+		fast_mutex_spin = (thread_get_cpu_count() > 1) ? 1 : 0;
+	}
+	return fast_mutex_spin;
+}
+
+/* state: 0 unlocked, 1 locked, 2 locked with (possible) waiters */
+static void _fast_mutex_lock_slow(fast_mutex_t* mutex)
+{
+	uint32_t c;
+	if (_fast_mutex_should_spin()) {
+		/* adaptive: aim for twice the spin count that recently succeeded */
+		unsigned int spins = ATOMIC_LOAD_RELAXED(&mutex->spins);
+		unsigned int max = spins * 2 + 10;
+		unsigned int i;
+		if (max > FAST_MUTEX_MAX_SPIN) {
+			max = FAST_MUTEX_MAX_SPIN;
+		}
+		for (i = 0; i < max; i++) {
+			CPU_RELAX();
+			if (ATOMIC_LOAD_RELAXED(&mutex->state) == 0 && ATOMIC_CAS32(&mutex->state, 0, 1)) {
+				ATOMIC_STORE_RELAXED(&mutex->spins, spins + ((int)i - (int)spins) / 8);
+				return;
+			}
+		}
+		ATOMIC_STORE_RELAXED(&mutex->spins, spins + ((int)max - (int)spins) / 8);
+	}
+	c = ATOMIC_XCHG32(&mutex->state, 2);
+	while (c != 0) {
+		_futex_wait(&mutex->state, 2, -1);
+		c = ATOMIC_XCHG32(&mutex->state, 2);
+	}
+}
+#elif defined(_WIN32) && defined(_WIN32_WINNT) && (_WIN32_WINNT < 0x0600)
+/* no SRWLOCK/CONDITION_VARIABLE before Vista: the mutex is a spinlock that
+ * yields with SwitchToThread() and condition waits poll a sequence counter
+ * with Sleep(1), so signal and broadcast both wake every waiter */
+#define FAST_MUTEX_LEGACY_WIN32 1
+#elif defined(__linux__)
+/* thread.h gives fast_mutex_t the futex layout on Linux; without
+ * <linux/futex.h> lock by yielding and let condition waits poll */
+#define FAST_MUTEX_POLLING 1
+
+static void _fast_cond_poll_sleep(void)
+{
+	struct timespec ts = { 0, 1000000 };
+	nanosleep(&ts, NULL);
+}
+#endif
+
+void fast_mutex_init(fast_mutex_t* mutex)
+{
+#if defined(HAVE_FUTEX) || defined(FAST_MUTEX_POLLING)
+	mutex->state = 0;
+	mutex->spins = 0;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	mutex->ptr = NULL;
+#elif defined(_WIN32)
+	InitializeSRWLock((PSRWLOCK)mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void fast_mutex_destroy(fast_mutex_t* mutex)
+{
+#if defined(HAVE_FUTEX) || defined(FAST_MUTEX_POLLING) || defined(_WIN32)
+	(void)mutex;
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void fast_mutex_lock(fast_mutex_t* mutex)
+{
+#if defined(HAVE_FUTEX)
+	if (!ATOMIC_CAS32(&mutex->state, 0, 1)) {
+		_fast_mutex_lock_slow(mutex);
+	}
+#elif defined(FAST_MUTEX_POLLING)
+	while (!ATOMIC_CAS32(&mutex->state, 0, 1)) {
+		sched_yield();
+	}
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	while (InterlockedCompareExchangePointer(&mutex->ptr, (PVOID)1, NULL) != NULL) {
+		SwitchToThread();
+	}
+#elif defined(_WIN32)
+	AcquireSRWLockExclusive((PSRWLOCK)mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+int fast_mutex_trylock(fast_mutex_t* mutex)
+{
+#if defined(HAVE_FUTEX) || defined(FAST_MUTEX_POLLING)
+	return ATOMIC_CAS32(&mutex->state, 0, 1) ? 0 : EBUSY;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	return (InterlockedCompareExchangePointer(&mutex->ptr, (PVOID)1, NULL) == NULL) ? 0 : EBUSY;
+#elif defined(_WIN32)
+	return TryAcquireSRWLockExclusive((PSRWLOCK)mutex) ? 0 : EBUSY;
+#else
+	return pthread_mutex_trylock(mutex);
+#endif
+}
+
+void fast_mutex_unlock(fast_mutex_t* mutex)
+{
+#if defined(HAVE_FUTEX)
+	if (ATOMIC_XCHG32(&mutex->state, 0) == 2) {
+		_futex_wake(&mutex->state, 1);
+	}
+#elif defined(FAST_MUTEX_POLLING)
+	ATOMIC_XCHG32(&mutex->state, 0);
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	InterlockedExchangePointer(&mutex->ptr, NULL);
+#elif defined(_WIN32)
+	ReleaseSRWLockExclusive((PSRWLOCK)mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void fast_cond_init(fast_cond_t* cond)
+{
+#if defined(HAVE_FUTEX) || defined(FAST_MUTEX_POLLING)
+	cond->seq = 0;
+	cond->waiters = 0;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	cond->ptr = NULL;
+#elif defined(_WIN32)
+	InitializeConditionVariable((PCONDITION_VARIABLE)cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void fast_cond_destroy(fast_cond_t* cond)
+{
+#if defined(HAVE_FUTEX) || defined(FAST_MUTEX_POLLING) || defined(_WIN32)
+	(void)cond;
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+int fast_cond_signal(fast_cond_t* cond)
+{
+#if defined(HAVE_FUTEX)
+	ATOMIC_ADD32(&cond->seq, 1);
+	if (ATOMIC_LOAD(&cond->waiters) > 0) {
+		_futex_wake(&cond->seq, 1);
+	}
+	return 0;
+#elif defined(FAST_MUTEX_POLLING)
+	ATOMIC_ADD32(&cond->seq, 1);
+	return 0;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	InterlockedIncrement((volatile LONG*)&cond->ptr);
+	return 0;
+#elif defined(_WIN32)
+	WakeConditionVariable((PCONDITION_VARIABLE)cond);
+	return 0;
+#else
+	return pthread_cond_signal(cond);
+#endif
+}
+
+int fast_cond_broadcast(fast_cond_t* cond)
+{
+#if defined(HAVE_FUTEX)
+	ATOMIC_ADD32(&cond->seq, 1);
+	if (ATOMIC_LOAD(&cond->waiters) > 0) {
+		_futex_wake(&cond->seq, INT32_MAX);
+	}
+	return 0;
+#elif defined(FAST_MUTEX_POLLING)
+	ATOMIC_ADD32(&cond->seq, 1);
+	return 0;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	InterlockedIncrement((volatile LONG*)&cond->ptr);
+	return 0;
+#elif defined(_WIN32)
+	WakeAllConditionVariable((PCONDITION_VARIABLE)cond);
+	return 0;
+#else
+	return pthread_cond_broadcast(cond);
+#endif
+}
+
+/* timeout_ms < 0 waits forever; returns 0 or ETIMEDOUT */
+static int _fast_cond_wait(fast_cond_t* cond, fast_mutex_t* mutex, int timeout_ms)
+{
+#if defined(HAVE_FUTEX)
+	int res = 0;
+	/* read under the mutex, so a signal sent after we unlock changes it */
+	uint32_t seq = ATOMIC_LOAD(&cond->seq);
+	fast_mutex_unlock(mutex);
+	if (_fast_mutex_should_spin()) {
+		/* a quick hand-off is caught here without any syscall: we are not
+		 * counted as a waiter yet, so the signaller doesn't wake us */
+		unsigned int i;
+		for (i = 0; i < FAST_COND_MAX_SPIN; i++) {
+			CPU_RELAX();
+			if (ATOMIC_LOAD_RELAXED(&cond->seq) != seq) {
+				break;
+			}
+		}
+	}
+	if (ATOMIC_LOAD_RELAXED(&cond->seq) == seq) {
+		/* a signal between here and the futex check makes it return
+		 * right away; after that the signaller sees us counted */
+		ATOMIC_ADD32(&cond->waiters, 1);
+		res = _futex_wait(&cond->seq, seq, timeout_ms);
+		ATOMIC_ADD32(&cond->waiters, -1);
+	}
+	/* relock through the regular path: waiters are woken rather than
+	 * requeued onto the mutex, so it only needs to be marked contended
+	 * if somebody actually has to sleep on it, and the signaller's
+	 * unlock stays syscall free */
+	fast_mutex_lock(mutex);
+	return (res == -ETIMEDOUT) ? ETIMEDOUT : 0;
+#elif defined(FAST_MUTEX_POLLING)
+	uint32_t seq = ATOMIC_LOAD(&cond->seq);
+	uint64_t deadline = _thread_monotonic_ms() + (uint64_t)timeout_ms;
+	int res = 0;
+	fast_mutex_unlock(mutex);
+	while (ATOMIC_LOAD(&cond->seq) == seq) {
+		if (timeout_ms >= 0 && _thread_monotonic_ms() >= deadline) {
+			res = ETIMEDOUT;
+			break;
+		}
+		_fast_cond_poll_sleep();
+	}
+	fast_mutex_lock(mutex);
+	return res;
+#elif defined(FAST_MUTEX_LEGACY_WIN32)
+	LONG seq = InterlockedCompareExchange((volatile LONG*)&cond->ptr, 0, 0);
+	uint64_t deadline = _thread_monotonic_ms() + (uint64_t)timeout_ms;
+	int res = 0;
+	fast_mutex_unlock(mutex);
+	while (InterlockedCompareExchange((volatile LONG*)&cond->ptr, 0, 0) == seq) {
+		if (timeout_ms >= 0 && _thread_monotonic_ms() >= deadline) {
+			res = ETIMEDOUT;
+			break;
+		}
+		Sleep(1);
+	}
+	fast_mutex_lock(mutex);
+	return res;
+#elif defined(_WIN32)
+	if (!SleepConditionVariableSRW((PCONDITION_VARIABLE)cond, (PSRWLOCK)mutex, (timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms, 0)) {
+		return (GetLastError() == ERROR_TIMEOUT) ? ETIMEDOUT : EINVAL;
+	}
+	return 0;
+#else
+	if (timeout_ms < 0) {
+		return pthread_cond_wait(cond, mutex);
+	}
+	return _pthread_cond_wait_ms(cond, mutex, (unsigned int)timeout_ms);
+#endif
+}
+
+int fast_cond_wait(fast_cond_t* cond, fast_mutex_t* mutex)
+{
+	return _fast_cond_wait(cond, mutex, -1);
+}
+
+int fast_cond_wait_timeout(fast_cond_t* cond, fast_mutex_t* mutex, unsigned int timeout_ms)
+{
+	return _fast_cond_wait(cond, mutex, (timeout_ms > INT32_MAX) ? INT32_MAX : (int)timeout_ms);
+}
+
+/* rwlock_t */
+
+void rwlock_init(rwlock_t* rwlock)
+{
+#if defined(FAST_MUTEX_LEGACY_WIN32)
+	rwlock->ptr = NULL;
+#elif defined(_WIN32)
+	InitializeSRWLock((PSRWLOCK)rwlock);
+#elif defined(__GLIBC__) && defined(PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP)
+	/* glibc prefers readers by default, which can starve writers */
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+#else
+	pthread_rwlock_init(rwlock, NULL);
+#endif
+}
+
+void rwlock_destroy(rwlock_t* rwlock)
+{
+#ifdef _WIN32
+	(void)rwlock;
+#else
+	pthread_rwlock_destroy(rwlock);
+#endif
+}
+
+void rwlock_read_lock(rwlock_t* rwlock)
+{
+#if defined(FAST_MUTEX_LEGACY_WIN32)
+	/* no shared mode without SRWLOCK */
+	fast_mutex_lock((fast_mutex_t*)rwlock);
+#elif defined(_WIN32)
+	AcquireSRWLockShared((PSRWLOCK)rwlock);
+#else
+	pthread_rwlock_rdlock(rwlock);
+#endif
+}
+
+void rwlock_read_unlock(rwlock_t* rwlock)
+{
+#if defined(FAST_MUTEX_LEGACY_WIN32)
+	fast_mutex_unlock((fast_mutex_t*)rwlock);
+#elif defined(_WIN32)
+	ReleaseSRWLockShared((PSRWLOCK)rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+void rwlock_write_lock(rwlock_t* rwlock)
+{
+#if defined(FAST_MUTEX_LEGACY_WIN32)
+	fast_mutex_lock((fast_mutex_t*)rwlock);
+#elif defined(_WIN32)
+	AcquireSRWLockExclusive((PSRWLOCK)rwlock);
+#else
+	pthread_rwlock_wrlock(rwlock);
+#endif
+}
+
+void rwlock_write_unlock(rwlock_t* rwlock)
+{
+#if defined(FAST_MUTEX_LEGACY_WIN32)
+	fast_mutex_unlock((fast_mutex_t*)rwlock);
+#elif defined(_WIN32)
+	ReleaseSRWLockExclusive((PSRWLOCK)rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+/* seqlock_t: the sequence is odd while a write is in progress */
+
+void seqlock_init(seqlock_t* seqlock)
+{
+	seqlock->seq = 0;
+	fast_mutex_init(&seqlock->lock);
+}
+
+void seqlock_destroy(seqlock_t* seqlock)
+{
+	fast_mutex_destroy(&seqlock->lock);
+}
+
+void seqlock_write_lock(seqlock_t* seqlock)
+{
+	fast_mutex_lock(&seqlock->lock);
+	ATOMIC_STORE_RELAXED(&seqlock->seq, seqlock->seq + 1);
+	/* the odd sequence must be visible before any of the data stores */
+	ATOMIC_FENCE_RELEASE();
+}
+
+void seqlock_write_unlock(seqlock_t* seqlock)
+{
+	ATOMIC_STORE_RELEASE(&seqlock->seq, seqlock->seq + 1);
+	fast_mutex_unlock(&seqlock->lock);
+}
+
+unsigned int seqlock_read_begin(seqlock_t* seqlock)
+{
+	unsigned int spins = 0;
+	unsigned int seq;
+	while ((seq = ATOMIC_LOAD_ACQUIRE(&seqlock->seq)) & 1) {
+		/* the writer may have been preempted inside its critical section */
+		if (++spins < 64) {
+			CPU_RELAX();
+		} else {
+			_thread_yield();
+		}
+	}
+	return seq;
+}
+
+int seqlock_read_retry(seqlock_t* seqlock, unsigned int start)
+{
+	/* order the data loads before the sequence re-check */
+	ATOMIC_FENCE_ACQUIRE();
+	return ATOMIC_LOAD_RELAXED(&seqlock->seq) != start;
 }